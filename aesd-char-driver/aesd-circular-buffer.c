@@ -29,67 +29,154 @@
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-    // Start tracking the cumulative number of bytes seen so far
-    size_t cumulative_bytes = 0;
-    // Start searching from the oldest entry in the buffer
-    uint8_t index = buffer->out_offs;
-
-    // Iterate through all possible entries in the buffer
-    for (int i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
-        
-        // Check if the requested offset is within the current entry's range
-        if (char_offset < (cumulative_bytes + buffer->entry[index].size)) {
-            // Calculate the specific byte within this entry
-            *entry_offset_byte_rtn = char_offset - cumulative_bytes;
-            // Return the pointer to this entry
-            return &buffer->entry[index];
-        }
+    size_t oldest_start = buffer->entry_start[buffer->out_offs];
+    // The answer is the newest entry among [low, high) starting at or before char_offset
+    uint32_t low = 0;
+    uint32_t high = aesd_circular_buffer_entries(buffer);
+    uint32_t index;
 
-        // Add this entry's size to our total and move to the next entry
-        cumulative_bytes += buffer->entry[index].size;
-        index = (index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    if (char_offset >= buffer->total_size) {
+        return NULL;
+    }
 
-        // If we reach the write head and the buffer isn't full, we've checked everything
-        if (index == buffer->in_offs && !buffer->full) {
-            break;
+    // The oldest entry starts at 0, so low always qualifies. Empty entries share their
+    // start with the next one, settling on the newest skips them.
+    while (high - low > 1) {
+        uint32_t mid = low + (high - low) / 2;
+        index = (buffer->out_offs + mid) & buffer->mask;
+        if (buffer->entry_start[index] - oldest_start <= char_offset) {
+            low = mid;
+        } else {
+            high = mid;
         }
     }
 
-    return NULL;
+    index = (buffer->out_offs + low) & buffer->mask;
+    *entry_offset_byte_rtn = char_offset - (buffer->entry_start[index] - oldest_start);
+    return &buffer->entry[index];
+}
+
+/**
+* @return the number of entries currently held by @param buffer
+*/
+uint32_t aesd_circular_buffer_entries(const struct aesd_circular_buffer *buffer)
+{
+    // in_offs == out_offs is ambiguous only when every slot is in use
+    if (buffer->full) {
+        return buffer->depth;
+    }
+    return (buffer->in_offs - buffer->out_offs) & buffer->mask;
+}
+
+/**
+* @return true if adding an entry of @param size bytes to @param buffer would drop the oldest
+* entry, because the buffer is full or the entries would exceed max_bytes
+*/
+bool aesd_circular_buffer_must_evict(const struct aesd_circular_buffer *buffer, size_t size)
+{
+    if (aesd_circular_buffer_entries(buffer) == 0) {
+        return false;
+    }
+    return buffer->full || (buffer->max_bytes > 0 && buffer->total_size + size > buffer->max_bytes);
+}
+
+/**
+* Removes the oldest entry from @param buffer and stores it in @param entry_rtn, so the caller
+* can free its memory. Any necessary locking must be handled by the caller.
+* @return true if there was an entry to remove
+*/
+bool aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *entry_rtn)
+{
+    struct aesd_buffer_entry *oldest = &buffer->entry[buffer->out_offs];
+
+    if (aesd_circular_buffer_entries(buffer) == 0) {
+        return false;
+    }
+
+    *entry_rtn = *oldest;
+    buffer->total_size -= oldest->size;
+    memset(oldest, 0, sizeof(*oldest));
+    buffer->out_offs = (buffer->out_offs + 1) & buffer->mask;
+    buffer->full = false;
+    return true;
 }
 
 /**
 * Adds entry @param add_entry to @param buffer in the location specified in buffer->in_offs.
-* If the buffer was already full, overwrites the oldest entry and advances buffer->out_offs to the
-* new start location.
+* If the buffer was already full, or the entries would exceed max_bytes, drops the oldest entries
+* and advances buffer->out_offs to the new start location.
 * Any necessary locking must be handled by the caller
 * Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
+* Use aesd_circular_buffer_remove_oldest() first to free the memory of dropped entries.
 */
 void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
 {
-    // 1. Add the new entry at the current write position (in_offs)
-    buffer->entry[buffer->in_offs] = *add_entry;
-
-    // 2. Advance the write pointer
-    buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    struct aesd_buffer_entry dropped;
 
-    // 3. Handle the "Full" logic
-    if (buffer->full) {
-        // If we were already full, we just overwrote the oldest data.
-        // We must advance the read pointer (out_offs) to the new "oldest" entry.
-        buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    // 1. Make room by dropping the oldest entries
+    while (aesd_circular_buffer_must_evict(buffer, add_entry->size)) {
+        aesd_circular_buffer_remove_oldest(buffer, &dropped);
     }
 
+    // 2. Add the new entry at the current write position (in_offs). The running byte
+    // count only grows, differences between starts stay right even once it wraps around.
+    buffer->entry[buffer->in_offs] = *add_entry;
+    buffer->entry_start[buffer->in_offs] = buffer->added_bytes;
+    buffer->added_bytes += add_entry->size;
+    buffer->total_size += add_entry->size;
+
+    // 3. Advance the write pointer
+    buffer->in_offs = (buffer->in_offs + 1) & buffer->mask;
+
     // 4. Check if we just filled the buffer
-    if (buffer->in_offs == buffer->out_offs) {
+    if (aesd_circular_buffer_entries(buffer) == buffer->depth || buffer->in_offs == buffer->out_offs) {
         buffer->full = true;
     }
 }
 
+#ifndef __KERNEL__
 /**
-* Initializes the circular buffer described by @param buffer to an empty struct
+* Initializes the circular buffer described by @param buffer to an empty struct holding up to
+* AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries in its own storage
 */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
+    aesd_circular_buffer_init_storage(buffer, buffer->default_entry, buffer->default_entry_start,
+            AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+}
+#endif
+
+/**
+* @return the number of slots, the power of two at or above @param depth, a buffer holding up to
+* depth entries needs
+*/
+uint32_t aesd_circular_buffer_slots(uint32_t depth)
+{
+    uint32_t slots = 1;
+
+    while (slots < depth) {
+        slots <<= 1;
+    }
+    return slots;
+}
+
+/**
+* Initializes @param buffer to an empty struct holding up to @param depth entries in @param entry
+* and @param entry_start, which must have aesd_circular_buffer_slots(depth) zeroed elements each
+* and outlive the buffer
+* @return 0 on success, -1 if depth is 0 or above AESDCHAR_MAX_DEPTH
+*/
+int aesd_circular_buffer_init_storage(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *entry,
+            size_t *entry_start, uint32_t depth)
+{
+    if (depth == 0 || depth > AESDCHAR_MAX_DEPTH) {
+        return -1;
+    }
+
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    buffer->entry = entry;
+    buffer->entry_start = entry_start;
+    buffer->mask = aesd_circular_buffer_slots(depth) - 1;
+    buffer->depth = depth;
+    return 0;
 }
@@ -16,8 +16,15 @@
 #include <stdbool.h>
 #endif
 
+// Default depth, and the entries a buffer set up with aesd_circular_buffer_init() holds
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
 
+// Slots of the storage embedded in userspace buffers, the next power of two
+#define AESDCHAR_DEFAULT_SLOTS 16
+
+// Largest depth aesd_circular_buffer_init_storage() accepts
+#define AESDCHAR_MAX_DEPTH (1U << 20)
+
 struct aesd_buffer_entry
 {
     /**
@@ -33,39 +40,87 @@ struct aesd_buffer_entry
 struct aesd_circular_buffer
 {
     /**
-     * An array of pointers to memory allocated for the most recent write operations
+     * An array of pointers to memory allocated for the most recent write operations,
+     * mask + 1 slots of it. Slots not holding an entry are zeroed.
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    struct aesd_buffer_entry *entry;
     /**
      * The current location in the entry structure where the next write should
      * be stored.
      */
-    uint8_t in_offs;
+    uint32_t in_offs;
     /**
      * The first location in the entry structure to read from
      */
-    uint8_t out_offs;
+    uint32_t out_offs;
     /**
-     * set to true when the buffer entry structure is full
+     * set to true when the buffer holds depth entries
      */
     bool full;
+    /**
+     * Slots minus one, the slot count is a power of two so positions wrap around with a mask
+     */
+    uint32_t mask;
+    /**
+     * Most entries held at once, at most mask + 1
+     */
+    uint32_t depth;
+    /**
+     * Most bytes held at once, older entries are dropped to make room for a new one.
+     * 0 leaves only depth as the limit, the newest entry is kept even if it is larger.
+     */
+    size_t max_bytes;
+    /**
+     * Bytes added before each entry since the buffer was initialized. The position of an
+     * entry in the concatenated contents is its start minus the start of the oldest entry,
+     * so lookups binary search these instead of summing entry sizes.
+     */
+    size_t *entry_start;
+    /**
+     * Bytes added since the buffer was initialized, the start of the next entry
+     */
+    size_t added_bytes;
+    /**
+     * Bytes held by all entries currently in the buffer
+     */
+    size_t total_size;
+#ifndef __KERNEL__
+    /**
+     * Storage used by aesd_circular_buffer_init(), the driver always brings its own
+     */
+    struct aesd_buffer_entry default_entry[AESDCHAR_DEFAULT_SLOTS];
+    size_t default_entry_start[AESDCHAR_DEFAULT_SLOTS];
+#endif
 };
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn );
 
+extern uint32_t aesd_circular_buffer_entries(const struct aesd_circular_buffer *buffer);
+
+extern bool aesd_circular_buffer_must_evict(const struct aesd_circular_buffer *buffer, size_t size);
+
+extern bool aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *entry_rtn);
+
 extern void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
 
+#ifndef __KERNEL__
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
+#endif
+
+extern uint32_t aesd_circular_buffer_slots(uint32_t depth);
+
+extern int aesd_circular_buffer_init_storage(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *entry,
+            size_t *entry_start, uint32_t depth);
 
 /**
  * Create a for loop to iterate over each member of the circular buffer.
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a uint32_t stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * uint32_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -74,7 +129,7 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
     for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
+            index<=(buffer)->mask; \
             index++, entryptr=&((buffer)->entry[index]))
 
 
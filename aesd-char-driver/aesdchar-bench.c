@@ -0,0 +1,180 @@
+/*
+ * aesdchar-bench.c
+ *
+ *  Userspace benchmark for the write path of the aesdchar driver. Large
+ *  commands are written to the device in small pieces, the way a client
+ *  trickling a long line into aesdsocket hands it over, so nearly all of
+ *  the time goes into appending to the partial command. With -v the device
+ *  is read back at the end and has to end with the last command written.
+ *
+ *  Usage: aesdchar-bench [-d device] [-s command bytes] [-p piece bytes]
+ *                        [-n commands] [-v]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <time.h>
+
+#define BENCH_READ_SIZE 65536
+
+struct bench_config {
+    const char *device;
+    size_t command_bytes;
+    size_t piece_bytes;
+    int commands;
+    bool verify;
+};
+
+static struct bench_config config = {
+    .device = "/dev/aesdchar",
+    .command_bytes = 1024 * 1024,
+    .piece_bytes = 16,
+    .commands = 10,
+    .verify = false,
+};
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Fills @param cmd with a command that differs from the ones written before and after it
+static void make_command(char *cmd, size_t len, int index) {
+    for (size_t i = 0; i + 1 < len; i++) {
+        cmd[i] = 'a' + (i + index) % 26;
+    }
+    cmd[len - 1] = '\n';
+}
+
+// Writes @param len bytes of @param buf, retrying short writes
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t sent = write(fd, buf, len);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("write");
+            return -1;
+        }
+        buf += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+// Reads the whole device and checks that it ends with @param cmd
+static int verify_tail(const char *cmd, size_t len) {
+    int fd = open(config.device, O_RDONLY);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+
+    size_t size = 0;
+    size_t capacity = len + BENCH_READ_SIZE;
+    char *data = malloc(capacity);
+    ssize_t got = -1;
+    while (data != NULL && (got = read(fd, data + size, capacity - size)) != 0) {
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("read");
+            break;
+        }
+        size += got;
+        if (capacity - size < BENCH_READ_SIZE) {
+            capacity *= 2;
+            char *grown = realloc(data, capacity);
+            if (grown == NULL) {
+                free(data);
+                data = NULL;
+                break;
+            }
+            data = grown;
+        }
+    }
+    close(fd);
+
+    int ret = data != NULL && got == 0 && size >= len && memcmp(data + size - len, cmd, len) == 0 ? 0 : -1;
+    free(data);
+    return ret;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-d device] [-s command bytes] [-p piece bytes] [-n commands] [-v]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "d:s:p:n:v")) != -1) {
+        switch (opt) {
+            case 'd': config.device = optarg; break;
+            case 's': config.command_bytes = strtoul(optarg, NULL, 10); break;
+            case 'p': config.piece_bytes = strtoul(optarg, NULL, 10); break;
+            case 'n': config.commands = atoi(optarg); break;
+            case 'v': config.verify = true; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (config.command_bytes == 0 || config.piece_bytes == 0 || config.commands <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    char *cmd = malloc(config.command_bytes);
+    if (cmd == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    int fd = open(config.device, O_WRONLY);
+    if (fd < 0) {
+        perror("open");
+        free(cmd);
+        return 1;
+    }
+
+    double writing = 0;
+    for (int c = 0; c < config.commands; c++) {
+        make_command(cmd, config.command_bytes, c);
+
+        double start = now_seconds();
+        for (size_t offset = 0; offset < config.command_bytes; offset += config.piece_bytes) {
+            size_t piece = config.command_bytes - offset;
+            if (piece > config.piece_bytes) {
+                piece = config.piece_bytes;
+            }
+            if (write_all(fd, cmd + offset, piece) != 0) {
+                close(fd);
+                free(cmd);
+                return 1;
+            }
+        }
+        writing += now_seconds() - start;
+    }
+    close(fd);
+
+    double total = (double)config.command_bytes * config.commands;
+    printf("commands=%d size=%zu piece=%zu: %.3f s, %.1f MiB/s, %.0f writes/s\n",
+           config.commands, config.command_bytes, config.piece_bytes, writing,
+           total / writing / (1024 * 1024), total / config.piece_bytes / writing);
+
+    int ret = 0;
+    if (config.verify) {
+        ret = verify_tail(cmd, config.command_bytes) == 0 ? 0 : 1;
+        printf("verify: %s\n", ret == 0 ? "ok" : "FAILED");
+    }
+
+    free(cmd);
+    return ret;
+}
@@ -18,12 +18,28 @@
 #endif
 
 #include <linux/mutex.h>
+#include <linux/list.h>
 #include "aesd-circular-buffer.h"
 
+/**
+ * A page holding part of the command being written. Incomplete commands are kept
+ * as a list of these, so every write only copies its own bytes and the command is
+ * linearized once, when its newline arrives.
+ */
+struct aesd_write_chunk
+{
+    struct list_head list;
+    size_t used;
+    char data[];
+};
+
+#define AESD_WRITE_CHUNK_DATA (PAGE_SIZE - offsetof(struct aesd_write_chunk, data))
+
 struct aesd_dev
 {
     struct aesd_circular_buffer buffer; /* The circular buffer for history */
-    struct aesd_buffer_entry working_entry; /* Buffer for the current incomplete write */
+    struct list_head working_chunks; /* Chunks of the current incomplete write, oldest first */
+    size_t working_size; /* Bytes held by working_chunks */
     struct mutex lock; /* Mutex for locking */
     struct cdev cdev; /* Char device structure */
 };
@@ -18,7 +18,11 @@
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
 #include <linux/slab.h> // kmalloc, kfree
+#include <linux/mm.h> // kvmalloc, kvfree
+#include <linux/list.h>
 #include <linux/uaccess.h> // copy_to_user, copy_from_user
+#include <linux/uio.h> // iov_iter, copy_to_iter
+#include <linux/version.h>
 #include <linux/mutex.h>
 #include "aesdchar.h"
 #include "aesd-circular-buffer.h"
@@ -29,11 +33,20 @@ int aesd_minor =   0;
 MODULE_AUTHOR("JavierFo");
 MODULE_LICENSE("Dual BSD/GPL");
 
+// Size of the command history, e.g. insmod aesdchar.ko depth=4096 max_bytes=16777216
+static unsigned int depth = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(depth, uint, 0444);
+MODULE_PARM_DESC(depth, "Most commands kept (default 10)");
+
+static unsigned long max_bytes;
+module_param(max_bytes, ulong, 0444);
+MODULE_PARM_DESC(max_bytes, "Most bytes kept, older commands are dropped first (default 0, no limit)");
+
 struct aesd_dev aesd_device;
 
 int aesd_open(struct inode *inode, struct file *filp);
 int aesd_release(struct inode *inode, struct file *filp);
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos);
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to);
 ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos);
 int aesd_init_module(void);
 void aesd_cleanup_module(void);
@@ -58,116 +71,223 @@ int aesd_release(struct inode *inode, struct file *filp)
     return 0;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
     ssize_t retval = 0;
-    struct aesd_dev *dev = filp->private_data;
+    struct aesd_dev *dev = iocb->ki_filp->private_data;
     struct aesd_buffer_entry *entry;
     size_t entry_offset_byte = 0;
-    size_t bytes_to_copy = 0;
+    uint32_t index;
     
-    PDEBUG("read %zu bytes with offset %lld", count, *f_pos);
+    PDEBUG("read %zu bytes with offset %lld", iov_iter_count(to), iocb->ki_pos);
 
     // Lock the device to prevent modification of the buffer during read
     if (mutex_lock_interruptible(&dev->lock))
         return -ERESTARTSYS;
 
-    // Find the entry that corresponds to the current file position
-    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->buffer, *f_pos, &entry_offset_byte);
-    
-    if (entry) {
-        // Calculate how many bytes are available in this specific entry from the offset
-        size_t available_bytes = entry->size - entry_offset_byte;
-        
-        // If the user asked for more than is available in this entry, just return what's left in this entry
-        // (The user will call read again for the rest)
-        bytes_to_copy = (available_bytes > count) ? count : available_bytes;
-        
-        if (copy_to_user(buf, entry->buffptr + entry_offset_byte, bytes_to_copy)) {
-            retval = -EFAULT;
-        } else {
-            retval = bytes_to_copy;
-            *f_pos += bytes_to_copy; // Advance file position
+    // Find the entry that corresponds to the current file position, if entry is NULL
+    // we have reached the end of the buffer
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->buffer, iocb->ki_pos, &entry_offset_byte);
+
+    // Fill as much of the user buffer as the entries from there on allow
+    while (entry && iov_iter_count(to) > 0) {
+        size_t bytes_to_copy = min_t(size_t, entry->size - entry_offset_byte, iov_iter_count(to));
+        size_t copied = copy_to_iter(entry->buffptr + entry_offset_byte, bytes_to_copy, to);
+
+        retval += copied;
+        if (copied < bytes_to_copy) {
+            // Report the bytes copied before the fault, if any
+            if (retval == 0)
+                retval = -EFAULT;
+            break;
         }
-    } else {
-        // If entry is NULL, we have reached the end of the buffer
-        retval = 0;
+
+        // Move on to the next entry, in_offs is one past the newest
+        entry_offset_byte = 0;
+        index = (entry - dev->buffer.entry + 1) & dev->buffer.mask;
+        entry = index != dev->buffer.in_offs ? &dev->buffer.entry[index] : NULL;
     }
 
+    if (retval > 0)
+        iocb->ki_pos += retval; // Advance file position
+
     mutex_unlock(&dev->lock);
     return retval;
 }
 
+/**
+ * Drops chunks from the end of the working command until only its first @param size bytes are
+ * left, empty chunks included
+ */
+static void aesd_working_truncate(struct aesd_dev *dev, size_t size)
+{
+    while (!list_empty(&dev->working_chunks)) {
+        struct aesd_write_chunk *chunk = list_last_entry(&dev->working_chunks, struct aesd_write_chunk, list);
+        size_t excess = dev->working_size - size;
+
+        if (excess < chunk->used) {
+            chunk->used -= excess;
+            dev->working_size = size;
+            break;
+        }
+        dev->working_size -= chunk->used;
+        list_del(&chunk->list);
+        kfree(chunk);
+    }
+}
+
+/**
+ * Appends @param count bytes of @param buf to the working command, filling up the
+ * last chunk before allocating new ones. Nothing is appended if it fails.
+ * @return 0 on success, or -ENOMEM
+ */
+static int aesd_working_append(struct aesd_dev *dev, const char *buf, size_t count)
+{
+    size_t old_size = dev->working_size;
+
+    while (count > 0) {
+        struct aesd_write_chunk *chunk = NULL;
+        size_t len;
+
+        if (!list_empty(&dev->working_chunks)) {
+            chunk = list_last_entry(&dev->working_chunks, struct aesd_write_chunk, list);
+        }
+        if (!chunk || chunk->used == AESD_WRITE_CHUNK_DATA) {
+            chunk = kmalloc(PAGE_SIZE, GFP_KERNEL);
+            if (!chunk) {
+                aesd_working_truncate(dev, old_size);
+                return -ENOMEM;
+            }
+            chunk->used = 0;
+            list_add_tail(&chunk->list, &dev->working_chunks);
+        }
+
+        len = min_t(size_t, count, AESD_WRITE_CHUNK_DATA - chunk->used);
+        memcpy(chunk->data + chunk->used, buf, len);
+        chunk->used += len;
+        dev->working_size += len;
+        buf += len;
+        count -= len;
+    }
+    return 0;
+}
+
+/**
+ * Copies the working command followed by @param tail_len bytes of @param tail into one
+ * buffer and frees the chunks
+ * @return the buffer, or NULL if it could not be allocated (the chunks are kept then)
+ */
+static char *aesd_working_linearize(struct aesd_dev *dev, const char *tail, size_t tail_len)
+{
+    struct aesd_write_chunk *chunk, *next;
+    size_t offset = 0;
+    char *command = kvmalloc(dev->working_size + tail_len, GFP_KERNEL);
+
+    if (!command)
+        return NULL;
+
+    list_for_each_entry_safe(chunk, next, &dev->working_chunks, list) {
+        memcpy(command + offset, chunk->data, chunk->used);
+        offset += chunk->used;
+        list_del(&chunk->list);
+        kfree(chunk);
+    }
+    memcpy(command + offset, tail, tail_len);
+    dev->working_size = 0;
+    return command;
+}
+
+/**
+ * Stores the completed command @param command of @param size bytes, freeing the
+ * oldest ones if the circular buffer is full or over its byte budget
+ */
+static void aesd_add_command(struct aesd_dev *dev, const char *command, size_t size)
+{
+    struct aesd_buffer_entry entry;
+
+    // The buffer would drop these entries itself, we MUST free their memory
+    // first to avoid a leak.
+    while (aesd_circular_buffer_must_evict(&dev->buffer, size)) {
+        aesd_circular_buffer_remove_oldest(&dev->buffer, &entry);
+        kvfree(entry.buffptr);
+    }
+
+    entry.buffptr = command;
+    entry.size = size;
+    aesd_circular_buffer_add_entry(&dev->buffer, &entry);
+}
+
 ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
                 loff_t *f_pos)
 {
-    ssize_t retval = -ENOMEM;
     struct aesd_dev *dev = filp->private_data;
-    char *new_buffer;
-    size_t new_size;
+    char *staged;
+    size_t done = 0;
     
     PDEBUG("write %zu bytes with offset %lld", count, *f_pos);
-    
-    if (mutex_lock_interruptible(&dev->lock))
-        return -ERESTARTSYS;
 
-    // 1. Calculate the new size needed (current partial buffer + new write)
-    new_size = dev->working_entry.size + count;
-    
-    // 2. Allocate the new buffer
-    new_buffer = kmalloc(new_size, GFP_KERNEL);
-    if (!new_buffer) {
-        mutex_unlock(&dev->lock);
-        return -ENOMEM;
-    }
+    if (count == 0)
+        return 0;
 
-    // 3. Copy existing partial data if any
-    if (dev->working_entry.size > 0) {
-        memcpy(new_buffer, dev->working_entry.buffptr, dev->working_entry.size);
-        kfree(dev->working_entry.buffptr); // Free the old partial buffer
+    // The write is copied in once, before taking the lock, and split at its newlines from there
+    staged = kvmalloc(count, GFP_KERNEL);
+    if (!staged)
+        return -ENOMEM;
+    if (copy_from_user(staged, buf, count)) {
+        kvfree(staged);
+        return -EFAULT;
     }
     
-    // 4. Copy the new data from user space
-    if (copy_from_user(new_buffer + dev->working_entry.size, buf, count)) {
-        kfree(new_buffer);
-        mutex_unlock(&dev->lock);
-        return -EFAULT;
+    if (mutex_lock_interruptible(&dev->lock)) {
+        kvfree(staged);
+        return -ERESTARTSYS;
     }
 
-    // 5. Update the working entry to point to the new buffer
-    dev->working_entry.buffptr = new_buffer;
-    dev->working_entry.size = new_size;
-    retval = count;
-
-    // 6. Check if we found a newline character at the end of the input
-    // The instructions imply a command ends with \n. 
-    if (dev->working_entry.buffptr[new_size - 1] == '\n') {
-        
-        // Check if the circular buffer is full. If so, we are about to overwrite
-        // an entry. We MUST free that memory first to avoid a leak.
-        if (dev->buffer.full) {
-            struct aesd_buffer_entry *oldest_entry = &dev->buffer.entry[dev->buffer.in_offs];
-            if (oldest_entry->buffptr) {
-                kfree(oldest_entry->buffptr);
-            }
+    // Every newline ends a command, which becomes an entry of its own
+    while (done < count) {
+        const char *start = staged + done;
+        const char *newline = memchr(start, '\n', count - done);
+        size_t len, size;
+        char *command;
+
+        if (!newline) {
+            // The rest is the beginning of a command completed by a later write
+            if (aesd_working_append(dev, start, count - done) == 0)
+                done = count;
+            break;
         }
 
-        // Add the working entry to the circular buffer
-        aesd_circular_buffer_add_entry(&dev->buffer, &dev->working_entry);
-
-        // Reset the working entry for the next command
-        dev->working_entry.buffptr = NULL;
-        dev->working_entry.size = 0;
+        len = newline - start + 1;
+        size = dev->working_size + len;
+        if (dev->working_size == 0 && done == 0 && len == count) {
+            // The write is exactly one command, the staging buffer becomes its entry
+            command = staged;
+            staged = NULL;
+        } else {
+            command = aesd_working_linearize(dev, start, len);
+            if (!command)
+                break;
+        }
+        aesd_add_command(dev, command, size);
+        done += len;
     }
 
     mutex_unlock(&dev->lock);
-    return retval;
+    kvfree(staged);
+
+    // Out of memory part way through, the commands stored so far are reported as a short write
+    return done > 0 ? done : -ENOMEM;
 }
 
 struct file_operations aesd_fops = {
     .owner =    THIS_MODULE,
-    .read =     aesd_read,
+    .read_iter = aesd_read_iter,
+    // Splicing the device into a pipe goes through read_iter as well
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read = copy_splice_read,
+#else
+    .splice_read = generic_file_splice_read,
+#endif
     .write =    aesd_write,
     .open =     aesd_open,
     .release =  aesd_release,
@@ -191,6 +311,8 @@ int aesd_init_module(void)
 {
     dev_t dev = 0;
     int result;
+    struct aesd_buffer_entry *entries;
+    size_t *entry_start;
     result = alloc_chrdev_region(&dev, aesd_minor, 1,
             "aesdchar");
     aesd_major = MAJOR(dev);
@@ -199,14 +321,31 @@ int aesd_init_module(void)
         return result;
     }
     memset(&aesd_device,0,sizeof(struct aesd_dev));
+    INIT_LIST_HEAD(&aesd_device.working_chunks);
 
-    // Initialize the mutex and the circular buffer
+    // Initialize the mutex and the circular buffer, sized by the module parameters
     mutex_init(&aesd_device.lock);
-    aesd_circular_buffer_init(&aesd_device.buffer);
+    if (depth == 0 || depth > AESDCHAR_MAX_DEPTH) {
+        printk(KERN_WARNING "Invalid depth %u, must be 1 to %u\n", depth, AESDCHAR_MAX_DEPTH);
+        unregister_chrdev_region(dev, 1);
+        return -EINVAL;
+    }
+    entries = kvcalloc(aesd_circular_buffer_slots(depth), sizeof(*entries), GFP_KERNEL);
+    entry_start = kvcalloc(aesd_circular_buffer_slots(depth), sizeof(*entry_start), GFP_KERNEL);
+    if (!entries || !entry_start) {
+        kvfree(entries);
+        kvfree(entry_start);
+        unregister_chrdev_region(dev, 1);
+        return -ENOMEM;
+    }
+    aesd_circular_buffer_init_storage(&aesd_device.buffer, entries, entry_start, depth);
+    aesd_device.buffer.max_bytes = max_bytes;
 
     result = aesd_setup_cdev(&aesd_device);
 
     if( result ) {
+        kvfree(entries);
+        kvfree(entry_start);
         unregister_chrdev_region(dev, 1);
     }
     return result;
@@ -216,21 +355,21 @@ void aesd_cleanup_module(void)
 {
     dev_t devno = MKDEV(aesd_major, aesd_minor);
     struct aesd_buffer_entry *entry;
-    uint8_t index;
+    uint32_t index;
 
     cdev_del(&aesd_device.cdev);
 
     // Free all memory stored in the circular buffer
     AESD_CIRCULAR_BUFFER_FOREACH(entry, &aesd_device.buffer, index) {
         if (entry->buffptr != NULL) {
-            kfree(entry->buffptr);
+            kvfree(entry->buffptr);
         }
     }
+    kvfree(aesd_device.buffer.entry);
+    kvfree(aesd_device.buffer.entry_start);
 
     // Free any partial write that was in progress but not completed
-    if (aesd_device.working_entry.buffptr != NULL) {
-        kfree(aesd_device.working_entry.buffptr);
-    }
+    aesd_working_truncate(&aesd_device, 0);
     
     // Destroy the mutex
     mutex_destroy(&aesd_device.lock);
@@ -0,0 +1,34 @@
+#define _GNU_SOURCE // CPU_SET(), pthread_setaffinity_np()
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "aesd-affinity.h"
+
+int aesd_affinity_pin(pthread_t thread, unsigned int index) {
+    cpu_set_t allowed, target;
+    int cpu;
+
+    // Respects taskset and cgroup cpusets, CPU numbers need not be contiguous
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        syslog(LOG_WARNING, "sched_getaffinity failed: %s", strerror(errno));
+        return -1;
+    }
+    index %= (unsigned int)CPU_COUNT(&allowed);
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && index-- == 0) {
+            break;
+        }
+    }
+
+    CPU_ZERO(&target);
+    CPU_SET(cpu, &target);
+    int rc = pthread_setaffinity_np(thread, sizeof(target), &target);
+    if (rc != 0) {
+        syslog(LOG_WARNING, "Pinning to CPU %d failed: %s", cpu, strerror(rc));
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,20 @@
+/*
+ * aesd-affinity.h
+ *
+ *  CPU pinning for the event loop threads, so each shard keeps its
+ *  connections, caches and listener on one core.
+ */
+
+#ifndef AESD_AFFINITY_H
+#define AESD_AFFINITY_H
+
+#include <pthread.h>
+
+/**
+ * Pins @param thread to the CPU @param index of those the process may run on,
+ * wrapping around when there are fewer CPUs than indexes
+ * @return 0 on success, -1 on failure (the thread keeps running unpinned)
+ */
+extern int aesd_affinity_pin(pthread_t thread, unsigned int index);
+
+#endif /* AESD_AFFINITY_H */
@@ -0,0 +1,393 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "aesdsocket.h"
+#include "aesd-config.h"
+
+// Longest line of a config file
+#define CONFIG_LINE_MAX 512
+
+enum aesd_config_type
+{
+    CONFIG_BOOL,
+    CONFIG_UINT,
+    CONFIG_SIZE,
+    CONFIG_STRING,  /* char[NI_MAXSERV] */
+    CONFIG_CUSTOM,
+};
+
+struct aesd_config_option
+{
+    const char *key;
+    enum aesd_config_type type;
+    size_t offset;
+    /**
+     * Accepted range of CONFIG_UINT and CONFIG_SIZE values
+     */
+    unsigned long long min;
+    unsigned long long max;
+    /**
+     * CONFIG_CUSTOM: parses and prints the value
+     */
+    int (*parse)(struct aesd_config *config, const char *value);
+    void (*print)(const struct aesd_config *config, FILE *out);
+};
+
+struct aesd_config_name
+{
+    const char *name;
+    int value;
+};
+
+static const struct aesd_config_name mode_names[] = {
+    { "thread", MODE_THREAD },
+    { "epoll", MODE_EPOLL },
+    { "pool", MODE_POOL },
+    { "uring", MODE_URING },
+    { NULL, 0 },
+};
+
+static const struct aesd_config_name backend_names[] = {
+    { "file", AESD_DATALOG_FILE },
+    { "mmap", AESD_DATALOG_MMAP },
+    { NULL, 0 },
+};
+
+static const struct aesd_config_name tcp_names[] = {
+    { "nodelay", AESD_TCP_NODELAY },
+    { "nagle", AESD_TCP_NAGLE },
+    { "cork", AESD_TCP_CORK },
+    { NULL, 0 },
+};
+
+static const struct aesd_config_name log_level_names[] = {
+    { "err", LOG_ERR },
+    { "warning", LOG_WARNING },
+    { "notice", LOG_NOTICE },
+    { "info", LOG_INFO },
+    { "debug", LOG_DEBUG },
+    { NULL, 0 },
+};
+
+// @return the value named @param name in @param names, or -1
+static int aesd_config_lookup(const struct aesd_config_name *names, const char *name) {
+    for (; names->name != NULL; names++) {
+        if (strcmp(names->name, name) == 0) {
+            return names->value;
+        }
+    }
+    return -1;
+}
+
+static const char *aesd_config_name_of(const struct aesd_config_name *names, int value) {
+    for (; names->name != NULL; names++) {
+        if (names->value == value) {
+            return names->name;
+        }
+    }
+    return "?";
+}
+
+static int parse_mode(struct aesd_config *config, const char *value) {
+    int mode = aesd_config_lookup(mode_names, value);
+    if (mode == -1) return -1;
+    config->mode = mode;
+    return 0;
+}
+
+static void print_mode(const struct aesd_config *config, FILE *out) {
+    fputs(aesd_config_name_of(mode_names, config->mode), out);
+}
+
+static int parse_backend(struct aesd_config *config, const char *value) {
+    int backend = aesd_config_lookup(backend_names, value);
+    if (backend == -1) return -1;
+    config->backend = backend;
+    return 0;
+}
+
+static void print_backend(const struct aesd_config *config, FILE *out) {
+    fputs(aesd_config_name_of(backend_names, config->backend), out);
+}
+
+static int parse_tcp(struct aesd_config *config, const char *value) {
+    int tcp = aesd_config_lookup(tcp_names, value);
+    if (tcp == -1) return -1;
+    config->tcp = tcp;
+    return 0;
+}
+
+static void print_tcp(const struct aesd_config *config, FILE *out) {
+    fputs(aesd_config_name_of(tcp_names, config->tcp), out);
+}
+
+static int parse_log_level(struct aesd_config *config, const char *value) {
+    int level = aesd_config_lookup(log_level_names, value);
+    if (level == -1) return -1;
+    config->log_level = level;
+    return 0;
+}
+
+static void print_log_level(const struct aesd_config *config, FILE *out) {
+    fputs(aesd_config_name_of(log_level_names, config->log_level), out);
+}
+
+// fdatasync() after every group commit, or at most once every N milliseconds
+static int parse_sync(struct aesd_config *config, const char *value) {
+    if (strcmp(value, "none") == 0) {
+        config->sync_policy = AESD_SYNC_NONE;
+    } else if (strcmp(value, "batch") == 0) {
+        config->sync_policy = AESD_SYNC_BATCH;
+    } else {
+        char *end;
+        errno = 0;
+        unsigned long interval = strtoul(value, &end, 10);
+        if (errno != 0 || end == value || *end != '\0' || value[0] == '-' || interval == 0 || interval > UINT_MAX) {
+            return -1;
+        }
+        config->sync_policy = AESD_SYNC_INTERVAL;
+        config->sync_interval_ms = interval;
+    }
+    return 0;
+}
+
+static void print_sync(const struct aesd_config *config, FILE *out) {
+    if (config->sync_policy == AESD_SYNC_INTERVAL) {
+        fprintf(out, "%u", config->sync_interval_ms);
+    } else {
+        fputs(config->sync_policy == AESD_SYNC_BATCH ? "batch" : "none", out);
+    }
+}
+
+#define OPTION(key, type, field, min, max) \
+    { key, type, offsetof(struct aesd_config, field), min, max, NULL, NULL }
+#define CUSTOM(key, name) \
+    { key, CONFIG_CUSTOM, 0, 0, 0, parse_##name, print_##name }
+
+static const struct aesd_config_option options[] = {
+    OPTION("daemon", CONFIG_BOOL, daemon, 0, 0),
+    OPTION("port", CONFIG_STRING, port, 0, 0),
+    OPTION("metrics_port", CONFIG_STRING, metrics_port, 0, 0),
+    CUSTOM("mode", mode),
+    OPTION("workers", CONFIG_UINT, workers, 1, 4096),
+    OPTION("backlog", CONFIG_UINT, backlog, 0, INT_MAX),
+    OPTION("recv_buffer", CONFIG_SIZE, recv_buffer, 64, CLIENT_MAX_PACKET_BYTES),
+    OPTION("max_packet_bytes", CONFIG_SIZE, max_packet_bytes, 1, SIZE_MAX),
+    OPTION("so_rcvbuf", CONFIG_UINT, so_rcvbuf, 0, INT_MAX / 2),
+    OPTION("so_sndbuf", CONFIG_UINT, so_sndbuf, 0, INT_MAX / 2),
+    CUSTOM("tcp", tcp),
+    OPTION("shard_listeners", CONFIG_BOOL, shard_listeners, 0, 0),
+    OPTION("pin_cpus", CONFIG_BOOL, pin_cpus, 0, 0),
+    OPTION("max_connections", CONFIG_UINT, max_connections, 1, UINT_MAX),
+    CUSTOM("log_level", log_level),
+    CUSTOM("backend", backend),
+    CUSTOM("sync", sync),
+    OPTION("cache_bytes", CONFIG_SIZE, cache_bytes, 0, SIZE_MAX),
+    OPTION("retain_bytes", CONFIG_SIZE, retention.max_bytes, 0, SIZE_MAX),
+    OPTION("retain_packets", CONFIG_SIZE, retention.max_packets, 0, SIZE_MAX),
+    OPTION("retain_seconds", CONFIG_UINT, retention.max_age_sec, 0, UINT_MAX / 1000),
+    OPTION("timestamp_interval", CONFIG_UINT, timestamp_interval_sec, 1, 86400),
+};
+
+void aesd_config_init(struct aesd_config *config) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    memset(config, 0, sizeof(*config));
+    snprintf(config->port, sizeof(config->port), "%s", PORT);
+    snprintf(config->metrics_port, sizeof(config->metrics_port), "%s", METRICS_PORT);
+    config->mode = MODE_THREAD;
+    config->workers = cpus > 0 ? cpus : 1;
+    config->recv_buffer = BUFFER_SIZE;
+    config->max_packet_bytes = CLIENT_MAX_PACKET_BYTES;
+    config->tcp = AESD_TCP_NODELAY;
+    config->max_connections = CLIENT_MAX_CONNECTIONS;
+    config->log_level = LOG_INFO;
+    config->backend = AESD_DATALOG_FILE;
+    config->sync_policy = AESD_SYNC_NONE;
+    config->cache_bytes = REPLAY_CACHE_BYTES;
+    config->timestamp_interval_sec = TIMESTAMP_INTERVAL_SEC;
+}
+
+static int aesd_config_parse_bool(const char *value, bool *result) {
+    if (strcasecmp(value, "yes") == 0 || strcasecmp(value, "true") == 0 || strcmp(value, "1") == 0) {
+        *result = true;
+    } else if (strcasecmp(value, "no") == 0 || strcasecmp(value, "false") == 0 || strcmp(value, "0") == 0) {
+        *result = false;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static int aesd_config_parse_number(const char *value, unsigned long long min, unsigned long long max,
+                                    unsigned long long *result) {
+    char *end;
+
+    // strtoull() would quietly negate a minus sign
+    if (!isdigit((unsigned char)value[0])) {
+        return -1;
+    }
+    errno = 0;
+    *result = strtoull(value, &end, 10);
+    if (errno != 0 || *end != '\0' || *result < min || *result > max) {
+        return -1;
+    }
+    return 0;
+}
+
+int aesd_config_set(struct aesd_config *config, const char *key, const char *value) {
+    for (size_t i = 0; i < sizeof(options) / sizeof(options[0]); i++) {
+        const struct aesd_config_option *option = &options[i];
+        char *field = (char *)config + option->offset;
+        unsigned long long number;
+
+        if (strcmp(option->key, key) != 0) {
+            continue;
+        }
+        switch (option->type) {
+        case CONFIG_BOOL:
+            return aesd_config_parse_bool(value, (bool *)field);
+        case CONFIG_UINT:
+            if (aesd_config_parse_number(value, option->min, option->max, &number) != 0) return -1;
+            *(unsigned int *)field = number;
+            return 0;
+        case CONFIG_SIZE:
+            if (aesd_config_parse_number(value, option->min, option->max, &number) != 0) return -1;
+            *(size_t *)field = number;
+            return 0;
+        case CONFIG_STRING:
+            if (value[0] == '\0' || strlen(value) >= NI_MAXSERV) return -1;
+            memcpy(field, value, strlen(value) + 1);
+            return 0;
+        case CONFIG_CUSTOM:
+            return option->parse(config, value);
+        }
+    }
+    return -1;
+}
+
+int aesd_config_set_pair(struct aesd_config *config, const char *pair) {
+    char key[CONFIG_LINE_MAX];
+    const char *equals = strchr(pair, '=');
+
+    if (equals == NULL || (size_t)(equals - pair) >= sizeof(key)) {
+        return -1;
+    }
+    memcpy(key, pair, equals - pair);
+    key[equals - pair] = '\0';
+    return aesd_config_set(config, key, equals + 1);
+}
+
+// Strips leading and trailing whitespace in place
+static char *aesd_config_trim(char *text) {
+    while (isspace((unsigned char)*text)) {
+        text++;
+    }
+    size_t len = strlen(text);
+    while (len > 0 && isspace((unsigned char)text[len - 1])) {
+        text[--len] = '\0';
+    }
+    return text;
+}
+
+int aesd_config_load(struct aesd_config *config, const char *path) {
+    char line[CONFIG_LINE_MAX];
+    unsigned int lineno = 0;
+    int rc = 0;
+
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), in) != NULL) {
+        lineno++;
+        char *text = aesd_config_trim(line);
+        if (text[0] == '\0' || text[0] == '#') {
+            continue;
+        }
+
+        char *equals = strchr(text, '=');
+        if (equals == NULL) {
+            fprintf(stderr, "%s:%u: expected key = value\n", path, lineno);
+            rc = -1;
+            continue;
+        }
+        *equals = '\0';
+        char *key = aesd_config_trim(text);
+        char *value = aesd_config_trim(equals + 1);
+        if (aesd_config_set(config, key, value) != 0) {
+            fprintf(stderr, "%s:%u: invalid setting %s = %s\n", path, lineno, key, value);
+            rc = -1;
+        }
+    }
+    fclose(in);
+    return rc;
+}
+
+int aesd_config_check(struct aesd_config *config) {
+    // Only the event loops can accept on their own
+    if (config->shard_listeners && config->mode != MODE_EPOLL && config->mode != MODE_URING) {
+        fprintf(stderr, "shard_listeners needs mode epoll or uring\n");
+        return -1;
+    }
+#if USE_AESD_CHAR_DEVICE
+    // The device keeps its last commands in a buffer of its own
+    if (config->backend != AESD_DATALOG_FILE) {
+        fprintf(stderr, "backend %s needs a regular data file\n", aesd_config_name_of(backend_names, config->backend));
+        return -1;
+    }
+    if (config->retention.max_bytes > 0 || config->retention.max_packets > 0 || config->retention.max_age_sec > 0) {
+        fprintf(stderr, "retain_* needs a regular data file, the char device keeps its last commands\n");
+        return -1;
+    }
+#endif
+    // The mapping only ever grows, a retention window would run into AESD_MAP_RESERVE all the same
+    if (config->backend == AESD_DATALOG_MMAP
+        && (config->retention.max_bytes > 0 || config->retention.max_packets > 0 || config->retention.max_age_sec > 0)) {
+        fprintf(stderr, "retain_* needs backend file, the mmap backend never releases dropped history\n");
+        return -1;
+    }
+
+    // The event loops are meant for connection storms, give them the largest accept queue allowed
+    if (config->backlog == 0) {
+        config->backlog = config->mode == MODE_EPOLL || config->mode == MODE_URING ? SOMAXCONN : BACKLOG;
+    }
+    return 0;
+}
+
+void aesd_config_dump(const struct aesd_config *config, FILE *out) {
+    for (size_t i = 0; i < sizeof(options) / sizeof(options[0]); i++) {
+        const struct aesd_config_option *option = &options[i];
+        const char *field = (const char *)config + option->offset;
+
+        fprintf(out, "%s = ", option->key);
+        switch (option->type) {
+        case CONFIG_BOOL:
+            fputs(*(const bool *)field ? "yes" : "no", out);
+            break;
+        case CONFIG_UINT:
+            fprintf(out, "%u", *(const unsigned int *)field);
+            break;
+        case CONFIG_SIZE:
+            fprintf(out, "%zu", *(const size_t *)field);
+            break;
+        case CONFIG_STRING:
+            fputs(field, out);
+            break;
+        case CONFIG_CUSTOM:
+            option->print(config, out);
+            break;
+        }
+        fputc('\n', out);
+    }
+}
@@ -0,0 +1,118 @@
+/*
+ * aesd-config.h
+ *
+ *  Every tuning knob of aesdsocket in one place. Settings are "key = value"
+ *  pairs, read from a config file and then overridden from the command line,
+ *  where the single letter options are shorthands for some of the keys. The
+ *  effective configuration is dumped in the same format, so a dump can be
+ *  saved and loaded back as a config file.
+ */
+
+#ifndef AESD_CONFIG_H
+#define AESD_CONFIG_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <netdb.h>
+
+#include "aesd-datalog.h"
+
+// Connection handling strategies selectable with -m
+enum server_mode {
+    MODE_THREAD,    // one thread per accepted connection
+    MODE_EPOLL,     // edge-triggered epoll reactor on a fixed set of threads
+    MODE_POOL,      // pre-spawned workers fed through a bounded lock-free queue
+    MODE_URING,     // io_uring loops accepting on their own, epoll if the kernel lacks support
+};
+
+/**
+ * How replies are pushed onto the wire
+ */
+enum aesd_tcp_policy
+{
+    AESD_TCP_NODELAY,   /* every send goes out right away */
+    AESD_TCP_NAGLE,     /* small sends wait for the ACK of the previous segment */
+    AESD_TCP_CORK,      /* a reply is corked until it is completely sent, then flushed */
+};
+
+struct aesd_config
+{
+    bool daemon;
+    char port[NI_MAXSERV];
+    /**
+     * "0" turns the metrics endpoint off
+     */
+    char metrics_port[NI_MAXSERV];
+    enum server_mode mode;
+    /**
+     * Event loops, pool workers or listener shards
+     */
+    unsigned int workers;
+    /**
+     * Listen backlog, 0 picks the mode default until aesd_config_check() resolves it
+     */
+    unsigned int backlog;
+    /**
+     * Room a recv() is given at least, the receive buffer grows in steps of it
+     */
+    size_t recv_buffer;
+    /**
+     * Longest packet accepted, newline included, CLIENT_MAX_PACKET_BYTES by default
+     */
+    size_t max_packet_bytes;
+    /**
+     * SO_RCVBUF and SO_SNDBUF of client sockets, 0 leaves them to the kernel
+     */
+    unsigned int so_rcvbuf;
+    unsigned int so_sndbuf;
+    enum aesd_tcp_policy tcp;
+    bool shard_listeners;
+    bool pin_cpus;
+    unsigned int max_connections;
+    int log_level;
+    enum aesd_datalog_backend backend;
+    enum aesd_sync_policy sync_policy;
+    unsigned int sync_interval_ms;
+    size_t cache_bytes;
+    struct aesd_retention retention;
+    unsigned int timestamp_interval_sec;
+};
+
+/**
+ * Fills @param config with the built-in defaults
+ */
+extern void aesd_config_init(struct aesd_config *config);
+
+/**
+ * Sets @param key of @param config to @param value
+ * @return 0 on success, -1 if the key is unknown or the value invalid
+ */
+extern int aesd_config_set(struct aesd_config *config, const char *key, const char *value);
+
+/**
+ * Sets a "key=value" pair from the command line
+ * @return 0 on success, -1 on failure
+ */
+extern int aesd_config_set_pair(struct aesd_config *config, const char *pair);
+
+/**
+ * Applies the "key = value" lines of the file at @param path to @param config. Blank lines
+ * and lines starting with '#' are skipped. Problems are reported on stderr with their line.
+ * @return 0 on success, -1 on failure
+ */
+extern int aesd_config_load(struct aesd_config *config, const char *path);
+
+/**
+ * Checks the settings of @param config against each other and against the build,
+ * then resolves the defaults that depend on other settings
+ * @return 0 on success, -1 with the problem reported on stderr
+ */
+extern int aesd_config_check(struct aesd_config *config);
+
+/**
+ * Writes every setting of @param config to @param out, one "key = value" line each
+ */
+extern void aesd_config_dump(const struct aesd_config *config, FILE *out);
+
+#endif /* AESD_CONFIG_H */
@@ -0,0 +1,286 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "aesdsocket.h"
+#include "aesd-conn.h"
+#include "aesd-newline.h"
+#include "aesd-metrics.h"
+#include "aesd-log.h"
+
+// Connections allocated and not freed yet, across every execution mode
+static atomic_uint open_connections;
+static unsigned int max_connections = CLIENT_MAX_CONNECTIONS;
+
+static size_t recv_buffer = BUFFER_SIZE;
+static size_t max_packet = CLIENT_MAX_PACKET_BYTES;
+static bool cork_replies = false;
+
+void aesd_conn_set_limit(unsigned int limit) {
+    max_connections = limit;
+}
+
+void aesd_conn_set_recv_buffer(size_t bytes) {
+    recv_buffer = bytes;
+}
+
+void aesd_conn_set_max_packet(size_t bytes) {
+    max_packet = bytes;
+}
+
+void aesd_conn_set_cork(bool cork) {
+    cork_replies = cork;
+}
+
+static void aesd_conn_cork(struct aesd_conn *conn, int cork) {
+    if (cork_replies) {
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+    }
+}
+
+struct aesd_conn *aesd_conn_new(int fd, const struct sockaddr_storage *addr) {
+    // Counted before anything else, so concurrent accepts cannot overshoot the limit
+    if (atomic_fetch_add_explicit(&open_connections, 1, memory_order_relaxed) >= max_connections) {
+        atomic_fetch_sub_explicit(&open_connections, 1, memory_order_relaxed);
+        aesd_metrics_add(AESD_METRIC_CONNECTIONS_REFUSED, 1);
+        aesd_log(LOG_NOTICE, "Connection limit of %u reached, refusing a client", max_connections);
+        return NULL;
+    }
+
+    struct aesd_conn *conn = calloc(1, sizeof(struct aesd_conn));
+    if (conn == NULL) {
+        atomic_fetch_sub_explicit(&open_connections, 1, memory_order_relaxed);
+        aesd_log(LOG_ERR, "Malloc for connection failed");
+        return NULL;
+    }
+
+    const void *ip;
+    if (addr->ss_family == AF_INET) {
+        ip = &(((const struct sockaddr_in *)addr)->sin_addr);
+    } else {
+        ip = &(((const struct sockaddr_in6 *)addr)->sin6_addr);
+    }
+    inet_ntop(addr->ss_family, ip, conn->client_ip, sizeof(conn->client_ip));
+
+    conn->fd = fd;
+    conn->state = AESD_CONN_RECV;
+    conn->deadline_ms = aesd_timer_now_ms() + CLIENT_IDLE_TIMEOUT_SEC * 1000ULL;
+    aesd_replay_init(&conn->replay);
+    aesd_metrics_add(AESD_METRIC_CONNECTIONS_ACCEPTED, 1);
+
+    aesd_log(LOG_INFO, "Accepted connection from %s", conn->client_ip);
+    return conn;
+}
+
+// Appends the first complete packet in rx to the data log. Only the append
+// itself is serialized, the reply is sent later from the captured snapshot.
+// A packet that could not be stored is not answered, the connection is closed.
+static bool aesd_conn_store_packet(struct aesd_conn *conn, size_t len) {
+    if (aesd_datalog_append(&data_log, conn->rx.data + conn->rx.start, len, &conn->replay) != 0) {
+        aesd_replay_release(&conn->replay);
+        aesd_metrics_add(AESD_METRIC_APPEND_ERRORS, 1);
+        aesd_log(LOG_ERR, "Could not store a %zu byte packet from %s, disconnecting", len, conn->client_ip);
+        conn->state = AESD_CONN_CLOSED;
+        return false;
+    }
+    aesd_metrics_add(AESD_METRIC_PACKETS, 1);
+
+    conn->packet_len = len;
+    conn->state = AESD_CONN_REPLAY;
+    aesd_conn_cork(conn, 1);
+    aesd_conn_sent(conn);
+    return true;
+}
+
+bool aesd_conn_expired(struct aesd_conn *conn, uint64_t now_ms) {
+    if (now_ms < conn->deadline_ms) {
+        return false;
+    }
+
+    const char *deadline = "idle";
+    if (conn->state == AESD_CONN_REPLAY) {
+        deadline = "write";
+    } else if (aesd_rxbuf_pending(&conn->rx) > 0) {
+        deadline = "read";
+    }
+    aesd_metrics_add(AESD_METRIC_CONNECTIONS_EXPIRED, 1);
+    aesd_log(LOG_NOTICE, "Connection from %s missed its %s deadline", conn->client_ip, deadline);
+    return true;
+}
+
+void aesd_conn_received(struct aesd_conn *conn, size_t len) {
+    // The whole packet has to arrive within the read deadline of its first byte
+    if (aesd_rxbuf_pending(&conn->rx) == 0) {
+        conn->deadline_ms = aesd_timer_now_ms() + CLIENT_READ_DEADLINE_SEC * 1000ULL;
+    }
+    conn->rx.len += len;
+    aesd_metrics_add(AESD_METRIC_BYTES_RECEIVED, len);
+}
+
+void aesd_conn_sent(struct aesd_conn *conn) {
+    conn->deadline_ms = aesd_timer_now_ms() + CLIENT_WRITE_DEADLINE_SEC * 1000ULL;
+}
+
+// Counts and logs a packet over the size cap and closes the connection
+static void aesd_conn_oversized(struct aesd_conn *conn) {
+    aesd_metrics_add(AESD_METRIC_PACKETS_OVERSIZED, 1);
+    aesd_log(LOG_NOTICE, "Packet from %s exceeds %zu bytes, disconnecting", conn->client_ip, max_packet);
+    conn->state = AESD_CONN_CLOSED;
+}
+
+// Stores the next packet, scanning the pending bytes not searched yet once the
+// ends found by the previous scan are used up. One scan finds every packet of a
+// pipelined burst, up to AESD_CONN_SCAN_BATCH of them.
+bool aesd_conn_next_packet(struct aesd_conn *conn) {
+    if (conn->next_end == conn->nends) {
+        const char *pending = conn->rx.data + conn->rx.start;
+        size_t count = aesd_rxbuf_pending(&conn->rx);
+
+        conn->nends = aesd_newline_scan(pending + conn->scanned, count - conn->scanned,
+                                        conn->ends, AESD_CONN_SCAN_BATCH);
+        conn->next_end = 0;
+        for (size_t i = 0; i < conn->nends; i++) {
+            conn->ends[i] += conn->scanned + 1;
+        }
+        // A full batch may have stopped short of the last newline
+        conn->scanned = conn->nends == AESD_CONN_SCAN_BATCH ? conn->ends[conn->nends - 1] : count;
+        if (conn->nends == 0) {
+            // Everything pending is one unfinished packet
+            if (count > max_packet) {
+                aesd_conn_oversized(conn);
+            }
+            return false;
+        }
+    }
+
+    // A long line received in one go arrives framed and still has to fit
+    size_t len = conn->ends[conn->next_end++];
+    if (len > max_packet) {
+        aesd_conn_oversized(conn);
+        return false;
+    }
+    return aesd_conn_store_packet(conn, len);
+}
+
+void aesd_conn_packet_done(struct aesd_conn *conn) {
+    aesd_replay_release(&conn->replay);
+    // Uncorking pushes out the partial segment left at the end of the reply
+    aesd_conn_cork(conn, 0);
+
+    // Answered, move on to whatever the client sent next
+    aesd_rxbuf_consume(&conn->rx, conn->packet_len);
+    for (size_t i = conn->next_end; i < conn->nends; i++) {
+        conn->ends[i] -= conn->packet_len;
+    }
+    conn->scanned -= conn->packet_len;
+    conn->packet_len = 0;
+    conn->state = AESD_CONN_RECV;
+
+    // A pipelined partial packet was held up by our reply, it gets a fresh read deadline
+    unsigned int timeout = aesd_rxbuf_pending(&conn->rx) > 0 ? CLIENT_READ_DEADLINE_SEC : CLIENT_IDLE_TIMEOUT_SEC;
+    conn->deadline_ms = aesd_timer_now_ms() + timeout * 1000ULL;
+}
+
+static enum aesd_conn_want aesd_conn_recv(struct aesd_conn *conn) {
+    // Pipelined packets received along with the previous one come first
+    if (aesd_rxbuf_pending(&conn->rx) > 0 && aesd_conn_next_packet(conn)) {
+        return AESD_CONN_WANT_WRITE;
+    }
+    if (conn->state == AESD_CONN_CLOSED) {
+        return AESD_CONN_WANT_CLOSE;
+    }
+
+    for (;;) {
+        // Receive straight into the free tail, which is at least recv_buffer long
+        if (aesd_rxbuf_reserve(&conn->rx, recv_buffer) != 0) {
+            aesd_log(LOG_ERR, "Malloc failed");
+            break;
+        }
+
+        ssize_t bytes_received = recv(conn->fd, aesd_rxbuf_tail(&conn->rx), conn->rx.capacity - conn->rx.len, 0);
+        if (bytes_received == 0) {
+            break;
+        }
+        if (bytes_received == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // Idle connections do not keep a buffer
+                if (aesd_rxbuf_pending(&conn->rx) == 0) {
+                    aesd_rxbuf_release(&conn->rx);
+                }
+                return AESD_CONN_WANT_READ;
+            }
+            break;
+        }
+        aesd_conn_received(conn, bytes_received);
+
+        if (aesd_conn_next_packet(conn)) {
+            return AESD_CONN_WANT_WRITE;
+        }
+        // A blocking socket does not come back out while bytes keep trickling in
+        if (conn->state == AESD_CONN_CLOSED || aesd_conn_expired(conn, aesd_timer_now_ms())) {
+            break;
+        }
+    }
+
+    // Peer closed, failed or was cut off: a trailing packet without newline is not stored
+    conn->state = AESD_CONN_CLOSED;
+    return AESD_CONN_WANT_CLOSE;
+}
+
+static enum aesd_conn_want aesd_conn_replay(struct aesd_conn *conn) {
+    while (aesd_replay_pending(&conn->replay) > 0) {
+        if (aesd_replay_send(&conn->replay, conn->fd) == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return AESD_CONN_WANT_WRITE;
+            aesd_replay_release(&conn->replay);
+            conn->state = AESD_CONN_CLOSED;
+            return AESD_CONN_WANT_CLOSE;
+        }
+        aesd_conn_sent(conn);
+    }
+    aesd_conn_packet_done(conn);
+    return AESD_CONN_WANT_READ;
+}
+
+enum aesd_conn_want aesd_conn_handle(struct aesd_conn *conn) {
+    for (;;) {
+        enum aesd_conn_state state = conn->state;
+        enum aesd_conn_want want;
+
+        switch (state) {
+        case AESD_CONN_RECV:
+            want = aesd_conn_recv(conn);
+            break;
+        case AESD_CONN_REPLAY:
+            want = aesd_conn_replay(conn);
+            break;
+        default:
+            return AESD_CONN_WANT_CLOSE;
+        }
+
+        // The socket would block in the current state; otherwise keep advancing
+        if (conn->state == state) {
+            return want;
+        }
+    }
+}
+
+void aesd_conn_free(struct aesd_conn *conn) {
+    close(conn->fd);
+    aesd_log(LOG_INFO, "Closed connection from %s", conn->client_ip);
+    aesd_rxbuf_release(&conn->rx);
+    aesd_replay_release(&conn->replay);
+    aesd_metrics_add(AESD_METRIC_CONNECTIONS_CLOSED, 1);
+    free(conn);
+    atomic_fetch_sub_explicit(&open_connections, 1, memory_order_relaxed);
+}
@@ -0,0 +1,166 @@
+/*
+ * aesd-conn.h
+ *
+ *  Per-connection state machine used by every aesdsocket execution mode.
+ *  The same code drives a blocking socket from a dedicated thread and a
+ *  non-blocking socket from the epoll reactor. Connections are persistent:
+ *  every newline terminated packet is stored and answered in order until
+ *  the client closes its side.
+ */
+
+#ifndef AESD_CONN_H
+#define AESD_CONN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "aesd-datalog.h"
+#include "aesd-rxbuf.h"
+#include "aesd-timer.h"
+
+// Packet ends remembered from one scan of the pending bytes
+#define AESD_CONN_SCAN_BATCH 16
+
+enum aesd_conn_state
+{
+    AESD_CONN_RECV,     /* accumulating bytes until a newline arrives */
+    AESD_CONN_REPLAY,   /* sending the data file history back, then on to the next packet */
+    AESD_CONN_CLOSED,   /* finished, ready to be freed */
+};
+
+/**
+ * What the connection needs before aesd_conn_handle() can make progress again
+ */
+enum aesd_conn_want
+{
+    AESD_CONN_WANT_READ,
+    AESD_CONN_WANT_WRITE,
+    AESD_CONN_WANT_CLOSE,
+};
+
+struct aesd_conn
+{
+    /**
+     * The accepted client socket, owned by the connection
+     */
+    int fd;
+    enum aesd_conn_state state;
+    /**
+     * Bytes received and not answered yet, possibly several pipelined packets
+     */
+    struct aesd_rxbuf rx;
+    /**
+     * Pending bytes already searched for a newline
+     */
+    size_t scanned;
+    /**
+     * Lengths, from the start of the pending bytes, of the packets found by the
+     * last scan; ends[next_end] is the next one to answer
+     */
+    size_t ends[AESD_CONN_SCAN_BATCH];
+    size_t nends;
+    size_t next_end;
+    /**
+     * Length of the packet being answered, consumed from rx once the reply is sent
+     */
+    size_t packet_len;
+    /**
+     * History captured when the packet was stored, still to be sent
+     */
+    struct aesd_replay replay;
+    char client_ip[INET6_ADDRSTRLEN];
+    /**
+     * CLOCK_MONOTONIC time by which the connection has to make progress: the idle timeout
+     * while no packet is pending, the read deadline once the first byte of one arrived,
+     * the write deadline while its reply is being sent. Kept up to date by the state machine.
+     */
+    uint64_t deadline_ms;
+    /**
+     * Timer the event loop owning the connection enforces deadline_ms with. It is only
+     * re-armed once it fires, so progress costs no more than updating deadline_ms.
+     */
+    struct aesd_timer deadline_timer;
+    /**
+     * Linkage for whichever owner (reactor loop, pool poller) tracks the connection
+     */
+    LIST_ENTRY(aesd_conn) entries;
+};
+
+LIST_HEAD(aesd_conn_list, aesd_conn);
+
+/**
+ * Sets how many connections may be open at once, CLIENT_MAX_CONNECTIONS by default
+ */
+extern void aesd_conn_set_limit(unsigned int max_connections);
+
+/**
+ * Sets how much room every recv() is given at least, BUFFER_SIZE by default
+ */
+extern void aesd_conn_set_recv_buffer(size_t bytes);
+
+/**
+ * Sets the longest packet accepted, newline included, CLIENT_MAX_PACKET_BYTES by default
+ */
+extern void aesd_conn_set_max_packet(size_t bytes);
+
+/**
+ * Corks client sockets with TCP_CORK while a reply is sent if @param cork, so
+ * the file, mapped and cached parts of a reply leave in full segments
+ */
+extern void aesd_conn_set_cork(bool cork);
+
+/**
+ * Allocates the state for a freshly accepted client socket @param fd connected from @param addr
+ * @return the new connection or NULL if allocation failed or the connection limit is reached.
+ * The caller still owns @param fd then, closing it is how the client is refused.
+ */
+extern struct aesd_conn *aesd_conn_new(int fd, const struct sockaddr_storage *addr);
+
+/**
+ * Runs the state machine of @param conn until it completes or the socket would block.
+ * On a blocking socket this only returns once the connection is finished.
+ * @return what the connection is waiting for
+ */
+extern enum aesd_conn_want aesd_conn_handle(struct aesd_conn *conn);
+
+/**
+ * @return true if @param conn missed its deadline as of @param now_ms, and should be closed
+ */
+extern bool aesd_conn_expired(struct aesd_conn *conn, uint64_t now_ms);
+
+/**
+ * For drivers doing their own socket I/O (io_uring): accounts for @param len bytes
+ * just received into the free tail of rx
+ */
+extern void aesd_conn_received(struct aesd_conn *conn, size_t len);
+
+/**
+ * For drivers doing their own socket I/O: notes that part of the reply went out
+ */
+extern void aesd_conn_sent(struct aesd_conn *conn);
+
+/**
+ * For drivers doing their own socket I/O (io_uring): stores the next complete packet
+ * received into rx, capturing its reply into replay and moving to AESD_CONN_REPLAY
+ * @return false if rx holds no complete packet yet, or if the packet could not be stored;
+ * the connection is AESD_CONN_CLOSED if storing failed or the packet, finished or not,
+ * is longer than aesd_conn_set_max_packet() allows
+ */
+extern bool aesd_conn_next_packet(struct aesd_conn *conn);
+
+/**
+ * For drivers doing their own socket I/O: drops the packet whose reply was just sent
+ * and moves @param conn back to AESD_CONN_RECV
+ */
+extern void aesd_conn_packet_done(struct aesd_conn *conn);
+
+/**
+ * Closes the socket of @param conn and releases every buffer it holds
+ */
+extern void aesd_conn_free(struct aesd_conn *conn);
+
+#endif /* AESD_CONN_H */
@@ -0,0 +1,148 @@
+/*
+ * aesd-conntable-bench.c
+ *
+ *  Microbenchmark for the bookkeeping of the thread-per-connection mode:
+ *  the connection table against the singly linked list it replaced, which
+ *  malloc()ed two nodes per accept and walked every live thread to find
+ *  the finished ones. With N connections open, every round one of them
+ *  finishes and a new one is accepted; the cost per accept is reported.
+ *  Threads are not actually started, pthread_join() costs the same either way.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/queue.h>
+#include <time.h>
+
+#include "aesd-conntable.h"
+
+struct list_params {
+    struct aesd_conn *conn;
+    bool thread_complete;
+};
+
+struct list_node {
+    struct list_params *thread_params;
+    SLIST_ENTRY(list_node) entries;
+};
+
+SLIST_HEAD(list_head, list_node);
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The accept loop as it was: allocate, insert, then walk everything for finished threads
+static void list_accept(struct list_head *head, struct list_params **live, size_t slot) {
+    struct list_params *params = malloc(sizeof(*params));
+    struct list_node *node = malloc(sizeof(*node));
+    params->conn = NULL;
+    params->thread_complete = false;
+    node->thread_params = params;
+    SLIST_INSERT_HEAD(head, node, entries);
+    live[slot] = params;
+
+    struct list_node *cursor = SLIST_FIRST(head);
+    while (cursor != NULL) {
+        struct list_node *next = SLIST_NEXT(cursor, entries);
+        if (cursor->thread_params->thread_complete) {
+            SLIST_REMOVE(head, cursor, list_node, entries);
+            free(cursor->thread_params);
+            free(cursor);
+        }
+        cursor = next;
+    }
+}
+
+static double bench_list(size_t connections, size_t rounds) {
+    struct list_head head = SLIST_HEAD_INITIALIZER(head);
+    struct list_params **live = calloc(connections, sizeof(*live));
+
+    for (size_t i = 0; i < connections; i++) {
+        list_accept(&head, live, i);
+    }
+
+    double start = now_seconds();
+    for (size_t r = 0; r < rounds; r++) {
+        size_t victim = (size_t)rand() % connections;
+        live[victim]->thread_complete = true;
+        list_accept(&head, live, victim);
+    }
+    double elapsed = now_seconds() - start;
+
+    while (!SLIST_EMPTY(&head)) {
+        struct list_node *node = SLIST_FIRST(&head);
+        SLIST_REMOVE_HEAD(&head, entries);
+        free(node->thread_params);
+        free(node);
+    }
+    free(live);
+    return elapsed / rounds * 1e9;
+}
+
+// The accept loop now: reap what finished, then take a recycled slot
+static bool table_accept(struct aesd_conntable *table, aesd_conn_slot_id *live, size_t slot) {
+    struct aesd_conn_slot *done = aesd_conntable_take_completed(table);
+    while (done != NULL) {
+        struct aesd_conn_slot *next = done->next;
+        aesd_conntable_free(table, done);
+        done = next;
+    }
+
+    struct aesd_conn_slot *fresh = aesd_conntable_alloc(table, NULL);
+    if (fresh == NULL) {
+        return false;
+    }
+    live[slot] = aesd_conntable_id(fresh);
+    return true;
+}
+
+static double bench_table(size_t connections, size_t rounds, bool *stale_ok) {
+    struct aesd_conntable table;
+    aesd_conn_slot_id *live = calloc(connections, sizeof(*live));
+
+    aesd_conntable_init(&table);
+    for (size_t i = 0; i < connections; i++) {
+        table_accept(&table, live, i);
+    }
+
+    *stale_ok = true;
+    double start = now_seconds();
+    for (size_t r = 0; r < rounds; r++) {
+        size_t victim = (size_t)rand() % connections;
+        aesd_conn_slot_id id = live[victim];
+        aesd_conntable_complete(&table, aesd_conntable_lookup(&table, id));
+        table_accept(&table, live, victim);
+        // The slot is probably reused by now, but never under the old id
+        if (aesd_conntable_lookup(&table, id) != NULL) {
+            *stale_ok = false;
+        }
+    }
+    double elapsed = now_seconds() - start;
+
+    aesd_conntable_destroy(&table);
+    free(live);
+    return elapsed / rounds * 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    static const size_t counts[] = { 10, 100, 1000, 10000 };
+    size_t rounds = argc > 1 ? strtoul(argv[1], NULL, 10) : 20000;
+
+    if (rounds == 0) {
+        fprintf(stderr, "Usage: %s [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        bool stale_ok;
+        double list_ns = bench_list(counts[c], rounds);
+        double table_ns = bench_table(counts[c], rounds, &stale_ok);
+        printf("connections=%-6zu list=%10.1f ns/accept  table=%7.1f ns/accept%s\n",
+               counts[c], list_ns, table_ns, stale_ok ? "" : "  STALE ID RESOLVED");
+    }
+    return 0;
+}
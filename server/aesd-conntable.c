@@ -0,0 +1,104 @@
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "aesd-conntable.h"
+
+void aesd_conntable_init(struct aesd_conntable *table) {
+    table->slabs = NULL;
+    table->nslabs = 0;
+    table->free_list = NULL;
+    table->used = 0;
+    atomic_init(&table->completed, NULL);
+}
+
+void aesd_conntable_destroy(struct aesd_conntable *table) {
+    for (size_t i = 0; i < table->nslabs; i++) {
+        free(table->slabs[i]);
+    }
+    free(table->slabs);
+    aesd_conntable_init(table);
+}
+
+// Adds one slab to @param table and puts its slots on the free list
+static int aesd_conntable_grow(struct aesd_conntable *table) {
+    struct aesd_conn_slot **slabs = realloc(table->slabs, (table->nslabs + 1) * sizeof(*slabs));
+    if (slabs == NULL) {
+        return -1;
+    }
+    table->slabs = slabs;
+
+    struct aesd_conn_slot *slab = calloc(AESD_CONNTABLE_SLAB_SLOTS, sizeof(struct aesd_conn_slot));
+    if (slab == NULL) {
+        return -1;
+    }
+    table->slabs[table->nslabs] = slab;
+
+    // Lowest index on top, so a small working set stays in the first slab
+    for (size_t i = AESD_CONNTABLE_SLAB_SLOTS; i-- > 0; ) {
+        slab[i].index = table->nslabs * AESD_CONNTABLE_SLAB_SLOTS + i;
+        slab[i].next = table->free_list;
+        table->free_list = &slab[i];
+    }
+    table->nslabs++;
+    return 0;
+}
+
+struct aesd_conn_slot *aesd_conntable_alloc(struct aesd_conntable *table, struct aesd_conn *conn) {
+    if (table->free_list == NULL && aesd_conntable_grow(table) != 0) {
+        syslog(LOG_ERR, "Malloc for connection table failed");
+        return NULL;
+    }
+
+    struct aesd_conn_slot *slot = table->free_list;
+    table->free_list = slot->next;
+    slot->next = NULL;
+    slot->conn = conn;
+    slot->used = true;
+    table->used++;
+    return slot;
+}
+
+void aesd_conntable_free(struct aesd_conntable *table, struct aesd_conn_slot *slot) {
+    slot->conn = NULL;
+    slot->used = false;
+    slot->generation++;
+    slot->next = table->free_list;
+    table->free_list = slot;
+    table->used--;
+}
+
+void aesd_conntable_complete(struct aesd_conntable *table, struct aesd_conn_slot *slot) {
+    struct aesd_conn_slot *head = atomic_load_explicit(&table->completed, memory_order_relaxed);
+
+    // Treiber stack push; the owner only ever takes the whole stack, so there is no ABA
+    do {
+        slot->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&table->completed, &head, slot,
+                                                    memory_order_release, memory_order_relaxed));
+}
+
+struct aesd_conn_slot *aesd_conntable_take_completed(struct aesd_conntable *table) {
+    // Cheap check first, most accepts find nothing to reap
+    if (atomic_load_explicit(&table->completed, memory_order_relaxed) == NULL) {
+        return NULL;
+    }
+    return atomic_exchange_explicit(&table->completed, NULL, memory_order_acquire);
+}
+
+aesd_conn_slot_id aesd_conntable_id(const struct aesd_conn_slot *slot) {
+    return (aesd_conn_slot_id)slot->generation << 32 | slot->index;
+}
+
+struct aesd_conn_slot *aesd_conntable_lookup(const struct aesd_conntable *table, aesd_conn_slot_id id) {
+    size_t index = (uint32_t)id;
+
+    if (index >= table->nslabs * AESD_CONNTABLE_SLAB_SLOTS) {
+        return NULL;
+    }
+    struct aesd_conn_slot *slot = aesd_conntable_slot(table, index);
+    if (!slot->used || slot->generation != (uint32_t)(id >> 32)) {
+        return NULL;
+    }
+    return slot;
+}
@@ -0,0 +1,117 @@
+/*
+ * aesd-conntable.h
+ *
+ *  Registry of the connection threads of the thread-per-connection mode.
+ *  Slots are carved out of slabs and recycled through a free list, so an
+ *  accept costs no allocation once the table has grown to the working set.
+ *  Finished threads push their slot onto a lock-free completion stack and
+ *  the accept loop reaps exactly those, instead of walking every thread.
+ */
+
+#ifndef AESD_CONNTABLE_H
+#define AESD_CONNTABLE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "aesd-conn.h"
+
+// Slots allocated at once whenever the free list runs dry
+#define AESD_CONNTABLE_SLAB_SLOTS 256
+
+struct aesd_conn_slot
+{
+    pthread_t thread_id;
+    struct aesd_conn *conn;
+    /**
+     * Index of the slot, stable for the life of the table
+     */
+    uint32_t index;
+    /**
+     * Bumped every time the slot is freed, so an id handed to a previous user goes stale
+     */
+    uint32_t generation;
+    bool used;
+    /**
+     * Next slot on the free list (accept loop only) or the completion stack
+     */
+    struct aesd_conn_slot *next;
+};
+
+struct aesd_conntable
+{
+    /**
+     * Slabs of AESD_CONNTABLE_SLAB_SLOTS slots, slot i lives in slabs[i / AESD_CONNTABLE_SLAB_SLOTS]
+     */
+    struct aesd_conn_slot **slabs;
+    size_t nslabs;
+    /**
+     * Unused slots, only touched by the owner of the table
+     */
+    struct aesd_conn_slot *free_list;
+    size_t used;
+    /**
+     * Slots of finished threads, pushed by any thread and taken all at once by the owner
+     */
+    _Atomic(struct aesd_conn_slot *) completed;
+};
+
+/**
+ * A slot reference that can be checked for staleness, generation in the high half
+ */
+typedef uint64_t aesd_conn_slot_id;
+
+/**
+ * Initializes @param table empty, slabs are allocated on demand
+ */
+extern void aesd_conntable_init(struct aesd_conntable *table);
+
+/**
+ * Frees the slabs of @param table, every slot must have been freed or abandoned
+ */
+extern void aesd_conntable_destroy(struct aesd_conntable *table);
+
+/**
+ * Takes an unused slot from @param table for @param conn. Owner only.
+ * @return the slot, or NULL if memory ran out
+ */
+extern struct aesd_conn_slot *aesd_conntable_alloc(struct aesd_conntable *table, struct aesd_conn *conn);
+
+/**
+ * Returns @param slot to the free list of @param table. Owner only.
+ */
+extern void aesd_conntable_free(struct aesd_conntable *table, struct aesd_conn_slot *slot);
+
+/**
+ * Called by the thread serving @param slot once it is done with it: the slot must not
+ * be touched afterwards. Safe from any thread.
+ */
+extern void aesd_conntable_complete(struct aesd_conntable *table, struct aesd_conn_slot *slot);
+
+/**
+ * Takes every slot completed so far off @param table. Owner only.
+ * @return the first slot, the rest follow through next
+ */
+extern struct aesd_conn_slot *aesd_conntable_take_completed(struct aesd_conntable *table);
+
+/**
+ * @return slot @param index of @param table, which has nslabs * AESD_CONNTABLE_SLAB_SLOTS of them
+ */
+static inline struct aesd_conn_slot *aesd_conntable_slot(const struct aesd_conntable *table, size_t index) {
+    return &table->slabs[index / AESD_CONNTABLE_SLAB_SLOTS][index % AESD_CONNTABLE_SLAB_SLOTS];
+}
+
+/**
+ * @return the id of @param slot for its current user
+ */
+extern aesd_conn_slot_id aesd_conntable_id(const struct aesd_conn_slot *slot);
+
+/**
+ * @return the slot @param id refers to, or NULL if it has been freed since
+ */
+extern struct aesd_conn_slot *aesd_conntable_lookup(const struct aesd_conntable *table, aesd_conn_slot_id id);
+
+#endif /* AESD_CONNTABLE_H */
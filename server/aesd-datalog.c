@@ -0,0 +1,957 @@
+#define _GNU_SOURCE // splice(), F_SETPIPE_SZ
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include <time.h>
+
+#include "aesdsocket.h"
+#include "aesd-datalog.h"
+#include "aesd-metrics.h"
+
+// iovecs gathered per sendmsg() call
+#define REPLAY_IOV_COUNT 64
+
+// iovecs handed to one writev() by the commit leader
+#define COMMIT_IOV_COUNT 64
+
+// Largest chunk handed to sendfile()/splice() at once
+#define REPLAY_CHUNK_SIZE (1024 * 1024)
+
+static struct aesd_segment *aesd_segment_new(size_t capacity) {
+    struct aesd_segment *segment = malloc(sizeof(struct aesd_segment) + capacity);
+    if (segment != NULL) {
+        atomic_init(&segment->refs, 1);
+        segment->next = NULL;
+        atomic_init(&segment->len, 0);
+        segment->capacity = capacity;
+    }
+    return segment;
+}
+
+static void aesd_segment_get(struct aesd_segment *segment) {
+    atomic_fetch_add_explicit(&segment->refs, 1, memory_order_relaxed);
+}
+
+// Drops a reference, freeing every segment of the chain that is no longer referenced
+static void aesd_segment_put(struct aesd_segment *segment) {
+    while (segment != NULL && atomic_fetch_sub_explicit(&segment->refs, 1, memory_order_acq_rel) == 1) {
+        struct aesd_segment *next = segment->next;
+        free(segment);
+        segment = next;
+    }
+}
+
+// Drops a reference, punching every rotation segment of the chain that is no longer
+// referenced out of DATA_FILE. The file keeps its size and reads back zeros there.
+static void aesd_logseg_put(struct aesd_logseg *logseg) {
+    while (logseg != NULL && atomic_fetch_sub_explicit(&logseg->refs, 1, memory_order_acq_rel) == 1) {
+        struct aesd_logseg *next = logseg->next;
+        if (logseg->fd != -1 && logseg->end > logseg->start
+            && fallocate(logseg->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, logseg->start,
+                         logseg->end - logseg->start) != 0
+            && errno != EOPNOTSUPP) {
+            syslog(LOG_ERR, "Could not punch dropped history out of data file: %s", strerror(errno));
+        }
+        free(logseg);
+        logseg = next;
+    }
+}
+
+void aesd_datalog_init(struct aesd_datalog *log, pthread_mutex_t *mutex, enum aesd_datalog_backend backend,
+                       size_t cache_limit, enum aesd_sync_policy sync_policy, unsigned int sync_interval_ms) {
+    pthread_rwlockattr_t attr;
+
+    memset(log, 0, sizeof(*log));
+    log->mutex = mutex;
+    pthread_cond_init(&log->committed, NULL);
+    log->file_fd = -1;
+    log->read_fd = -1;
+    log->sync_policy = sync_policy;
+    log->sync_interval_ms = sync_interval_ms;
+    log->cache_limit = cache_limit;
+    log->backend = backend;
+
+    // Snapshots are short and frequent, do not let them starve the appends
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&log->view_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+}
+
+void aesd_datalog_set_retention(struct aesd_datalog *log, const struct aesd_retention *retention) {
+    log->retention = *retention;
+}
+
+void aesd_datalog_destroy(struct aesd_datalog *log) {
+    // DATA_FILE is unlinked or kept as it is, no point punching the history out of it
+    for (struct aesd_logseg *logseg = log->logseg_head; logseg != NULL; logseg = logseg->next) {
+        logseg->fd = -1;
+    }
+    aesd_logseg_put(log->logseg_head);
+    log->logseg_head = NULL;
+    log->logseg_tail = NULL;
+    log->start = 0;
+    log->packets = 0;
+    if (log->map != NULL) {
+        munmap(log->map, AESD_MAP_RESERVE);
+        log->map = NULL;
+        log->map_size = 0;
+        // Extents are allocated ahead, the file only keeps what was appended
+        if (ftruncate(log->file_fd, log->size) != 0) {
+            syslog(LOG_ERR, "Could not trim data file: %s", strerror(errno));
+        }
+    }
+    if (log->file_fd != -1) {
+        close(log->file_fd);
+        log->file_fd = -1;
+    }
+    if (log->read_fd != -1) {
+        close(log->read_fd);
+        log->read_fd = -1;
+    }
+    pthread_cond_destroy(&log->committed);
+    pthread_rwlock_destroy(&log->view_lock);
+    aesd_segment_put(log->head);
+    log->head = NULL;
+    log->tail = NULL;
+    log->cache_start = 0;
+    log->size = 0;
+}
+
+#if !USE_AESD_CHAR_DEVICE
+
+// Only reserves the address space, aesd_datalog_map_grow() maps the file into it
+static int aesd_datalog_open_mapped(struct aesd_datalog *log) {
+    log->file_fd = open(DATA_FILE, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (log->file_fd == -1) {
+        syslog(LOG_ERR, "Could not open data file: %s", strerror(errno));
+        return -1;
+    }
+
+    void *map = mmap(NULL, AESD_MAP_RESERVE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED) {
+        syslog(LOG_ERR, "Could not reserve the data file mapping: %s", strerror(errno));
+        close(log->file_fd);
+        log->file_fd = -1;
+        return -1;
+    }
+    log->map = map;
+    log->map_size = 0;
+    return 0;
+}
+
+// Maps whole extents of the file until the first @param len bytes are covered. Extents are
+// mapped over the reservation at fixed addresses, so nothing already mapped ever moves.
+static int aesd_datalog_map_grow(struct aesd_datalog *log, size_t len) {
+    while (log->map_size < len) {
+        if (log->map_size + AESD_MAP_EXTENT > AESD_MAP_RESERVE) {
+            syslog(LOG_ERR, "History outgrew the %llu byte mapping", (unsigned long long)AESD_MAP_RESERVE);
+            return -1;
+        }
+        // Allocated up front, a full disk fails the append instead of faulting the memcpy()
+        int rc = fallocate(log->file_fd, 0, log->map_size, AESD_MAP_EXTENT);
+        if (rc != 0 && errno == EOPNOTSUPP) {
+            rc = ftruncate(log->file_fd, log->map_size + AESD_MAP_EXTENT);
+        }
+        if (rc != 0) {
+            syslog(LOG_ERR, "Could not extend data file: %s", strerror(errno));
+            return -1;
+        }
+        if (mmap(log->map + log->map_size, AESD_MAP_EXTENT, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                 log->file_fd, log->map_size) == MAP_FAILED) {
+            syslog(LOG_ERR, "Could not map data file: %s", strerror(errno));
+            return -1;
+        }
+        log->map_size += AESD_MAP_EXTENT;
+    }
+    return 0;
+}
+
+#endif
+
+// Lazy open. The file is only opened on the first append, then kept open.
+static int aesd_datalog_open(struct aesd_datalog *log) {
+    if (log->file_fd != -1) {
+        return 0;
+    }
+
+#if !USE_AESD_CHAR_DEVICE
+    if (log->backend == AESD_DATALOG_MMAP) {
+        return aesd_datalog_open_mapped(log);
+    }
+#endif
+
+    log->file_fd = open(DATA_FILE, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log->file_fd == -1) {
+        syslog(LOG_ERR, "Could not open data file: %s", strerror(errno));
+        return -1;
+    }
+#if !USE_AESD_CHAR_DEVICE
+    // Replays sendfile() from it with their own offsets, so one descriptor serves them all
+    log->read_fd = open(DATA_FILE, O_RDONLY | O_CLOEXEC);
+    if (log->read_fd == -1) {
+        syslog(LOG_ERR, "Could not open data file: %s", strerror(errno));
+        close(log->file_fd);
+        log->file_fd = -1;
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+#if USE_AESD_CHAR_DEVICE
+
+// Reads what is left of the device into a private segment (used when it cannot be spliced)
+static struct aesd_segment *aesd_datalog_copy_device(int file_fd) {
+    struct aesd_segment *copy = aesd_segment_new(BUFFER_SIZE * 4);
+    if (copy == NULL) {
+        syslog(LOG_ERR, "Malloc for reply failed");
+        return NULL;
+    }
+
+    ssize_t bytes_read;
+    do {
+        if (copy->capacity - copy->len < BUFFER_SIZE) {
+            size_t capacity = copy->capacity * 2;
+            struct aesd_segment *temp = realloc(copy, sizeof(struct aesd_segment) + capacity);
+            if (temp == NULL) {
+                syslog(LOG_ERR, "Malloc for reply failed");
+                break;
+            }
+            copy = temp;
+            copy->capacity = capacity;
+        }
+        // The driver fills as much of a read as its entries allow, offer it all the room there is
+        bytes_read = read(file_fd, copy->data + copy->len, copy->capacity - copy->len);
+        if (bytes_read > 0) {
+            copy->len += bytes_read;
+        }
+    } while (bytes_read > 0);
+
+    return copy;
+}
+
+// The device only keeps the most recent commands, so its contents cannot be
+// mirrored in memory. Right after our append they are spliced into a pipe,
+// which the replay later splices to the socket without the lock held. Drivers
+// without splice support, or contents larger than the pipe, fall back to a copy.
+static void aesd_datalog_snapshot_device(struct aesd_replay *snapshot) {
+    int pipe_fds[2];
+    int file_fd = open(DATA_FILE, O_RDONLY);
+    if (file_fd == -1) {
+        syslog(LOG_ERR, "Could not open data file: %s", strerror(errno));
+        return;
+    }
+
+    if (pipe2(pipe_fds, O_NONBLOCK | O_CLOEXEC) == 0) {
+        fcntl(pipe_fds[1], F_SETPIPE_SZ, REPLAY_PIPE_SIZE);
+
+        for (;;) {
+            ssize_t moved = splice(file_fd, NULL, pipe_fds[1], NULL, REPLAY_CHUNK_SIZE, SPLICE_F_NONBLOCK);
+            if (moved > 0) {
+                snapshot->pipe_remaining += moved;
+                continue;
+            }
+            if (moved == -1 && errno == EINTR) continue;
+            break;
+        }
+        close(pipe_fds[1]);
+
+        if (snapshot->pipe_remaining > 0) {
+            snapshot->pipe_fd = pipe_fds[0];
+        } else {
+            close(pipe_fds[0]);
+        }
+    }
+
+    // Whatever did not make it into the pipe (EOF leaves nothing to copy)
+    struct aesd_segment *copy = aesd_datalog_copy_device(file_fd);
+    if (copy != NULL) {
+        if (copy->len > 0) {
+            snapshot->segment = copy;
+            snapshot->remaining = copy->len;
+        } else {
+            aesd_segment_put(copy);
+        }
+    }
+    close(file_fd);
+}
+
+#else
+
+static unsigned long long aesd_datalog_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Copies @param len bytes from @param buf past the published end of the cache.
+// Caller is the commit leader; snapshots never look at these bytes until they are published.
+static int aesd_datalog_cache(struct aesd_datalog *log, const char *buf, size_t len) {
+    while (len > 0) {
+        struct aesd_segment *tail = log->tail;
+
+        size_t used = tail != NULL ? atomic_load_explicit(&tail->len, memory_order_relaxed) : 0;
+        if (tail == NULL || used == tail->capacity) {
+            // The new segment starts with one reference, owned by its predecessor (or the log)
+            tail = aesd_segment_new(len > AESD_SEGMENT_SIZE ? len : AESD_SEGMENT_SIZE);
+            if (tail == NULL) {
+                syslog(LOG_ERR, "Malloc for history segment failed");
+                return -1;
+            }
+            if (log->tail == NULL) {
+                log->head = tail;
+            } else {
+                log->tail->next = tail;
+            }
+            log->tail = tail;
+            used = 0;
+        }
+
+        size_t chunk = tail->capacity - used;
+        if (chunk > len) {
+            chunk = len;
+        }
+        memcpy(tail->data + used, buf, chunk);
+        atomic_store_explicit(&tail->len, used + chunk, memory_order_relaxed);
+        buf += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+static void aesd_logseg_get(struct aesd_logseg *logseg) {
+    atomic_fetch_add_explicit(&logseg->refs, 1, memory_order_relaxed);
+}
+
+// The share of a retention limit one rotation segment holds, at least 1
+static unsigned long long aesd_retain_share(unsigned long long limit) {
+    return (limit + AESD_RETAIN_SEGMENTS - 1) / AESD_RETAIN_SEGMENTS;
+}
+
+static bool aesd_datalog_logseg_full(const struct aesd_datalog *log, const struct aesd_logseg *logseg,
+                                     unsigned long long now_ms) {
+    const struct aesd_retention *retention = &log->retention;
+
+    if (logseg->end == logseg->start) {
+        return false;
+    }
+    return (retention->max_bytes > 0 && logseg->end - logseg->start >= aesd_retain_share(retention->max_bytes))
+        || (retention->max_packets > 0 && logseg->packets >= aesd_retain_share(retention->max_packets))
+        || (retention->max_age_sec > 0
+            && now_ms - logseg->first_ms >= aesd_retain_share(retention->max_age_sec * 1000ULL));
+}
+
+// Starts a new rotation segment at the end of the history, caller holds view_lock for writing
+static bool aesd_datalog_rotate(struct aesd_datalog *log, unsigned long long now_ms) {
+    struct aesd_logseg *logseg = calloc(1, sizeof(*logseg));
+    if (logseg == NULL) {
+        syslog(LOG_ERR, "Malloc for rotation segment failed");
+        return false;
+    }
+    // The new segment starts with one reference, owned by its predecessor (or the log)
+    atomic_init(&logseg->refs, 1);
+    logseg->fd = log->file_fd;
+    logseg->start = log->size;
+    logseg->end = log->size;
+    logseg->first_ms = now_ms;
+    logseg->last_ms = now_ms;
+
+    if (log->logseg_tail == NULL) {
+        log->logseg_head = logseg;
+    } else {
+        log->logseg_tail->next = logseg;
+    }
+    log->logseg_tail = logseg;
+    return true;
+}
+
+// Moves the start of the history past the oldest rotation segments while it is outside
+// the retention window. The tail holds the latest appends, it is only dropped once all of
+// it aged out. Caller holds view_lock for writing.
+// @return the reference on the old head to drop once view_lock is released, or NULL
+static struct aesd_logseg *aesd_datalog_retain(struct aesd_datalog *log, unsigned long long now_ms) {
+    const struct aesd_retention *retention = &log->retention;
+    struct aesd_logseg *dropped = log->logseg_head;
+
+    while (log->logseg_head != NULL) {
+        struct aesd_logseg *old = log->logseg_head;
+        bool aged = retention->max_age_sec > 0 && now_ms - old->last_ms >= retention->max_age_sec * 1000ULL;
+
+        if (old == log->logseg_tail) {
+            if (!aged || old->end == old->start || !aesd_datalog_rotate(log, now_ms)) {
+                break;
+            }
+        } else if (!aged && !(retention->max_bytes > 0 && log->size - log->start > retention->max_bytes)
+                   && !(retention->max_packets > 0 && log->packets > retention->max_packets)) {
+            break;
+        }
+
+        aesd_metrics_add(AESD_METRIC_HISTORY_SEGMENTS_DROPPED, 1);
+        aesd_metrics_add(AESD_METRIC_HISTORY_BYTES_DROPPED, old->end - log->start);
+        log->start = old->end;
+        log->packets -= old->packets;
+        log->logseg_head = old->next;
+    }
+
+    if (log->logseg_head == dropped) {
+        return NULL;
+    }
+    // Putting the old head releases every segment up to the new one, which the log keeps
+    aesd_logseg_get(log->logseg_head);
+    return dropped;
+}
+
+// Drops the oldest cache segments once the rest alone covers the cache limit,
+// and those the start of the history moved past. Caller holds view_lock for writing.
+static void aesd_datalog_trim_cache(struct aesd_datalog *log) {
+    while (log->head != log->tail
+           && (log->size - log->cache_start - log->head->len >= log->cache_limit
+               || log->cache_start + log->head->len <= log->start)) {
+        struct aesd_segment *old = log->head;
+        log->cache_start += old->len;
+        log->head = old->next;
+        aesd_segment_get(log->head);
+        aesd_segment_put(old);
+    }
+}
+
+// Makes @param len freshly written bytes holding @param packets appends visible to snapshots,
+// then drops what fell out of the retention window. Caller is the commit leader.
+static void aesd_datalog_publish(struct aesd_datalog *log, size_t len, size_t packets, bool cached) {
+    unsigned long long now_ms = aesd_datalog_now_ms();
+    struct aesd_logseg *dropped;
+
+    pthread_rwlock_wrlock(&log->view_lock);
+
+    // The tail took its share of the retention window, rotate before appending to it
+    if (log->logseg_tail == NULL || aesd_datalog_logseg_full(log, log->logseg_tail, now_ms)) {
+        aesd_datalog_rotate(log, now_ms);
+    }
+
+    log->size += len;
+    log->packets += packets;
+    if (log->logseg_tail != NULL) {
+        struct aesd_logseg *tail = log->logseg_tail;
+        if (tail->end == tail->start) {
+            tail->first_ms = now_ms;
+        }
+        tail->end = log->size;
+        tail->packets += packets;
+        tail->last_ms = now_ms;
+    }
+    if (!cached) {
+        // The file is ahead of the cache now: serve everything from the file
+        aesd_segment_put(log->head);
+        log->head = NULL;
+        log->tail = NULL;
+        log->cache_start = log->size;
+    }
+
+    dropped = aesd_datalog_retain(log, now_ms);
+    aesd_datalog_trim_cache(log);
+
+    pthread_rwlock_unlock(&log->view_lock);
+
+    // Punching the dropped history out of the file waits for no snapshot
+    aesd_logseg_put(dropped);
+}
+
+#endif
+
+#if USE_AESD_CHAR_DEVICE
+
+// Every command is written on its own and the device snapshotted right after
+// it, so each reply still shows the device as of that command
+static void aesd_datalog_commit(struct aesd_datalog *log, struct aesd_commit *batch) {
+    for (struct aesd_commit *commit = batch; commit != NULL; commit = commit->next) {
+        commit->rc = aesd_datalog_open(log);
+        if (commit->rc == 0 && write(log->file_fd, commit->buf, commit->len) == -1) {
+            syslog(LOG_ERR, "File write failed: %s", strerror(errno));
+            commit->rc = -1;
+        }
+        if (commit->snapshot != NULL) {
+            aesd_datalog_snapshot_device(commit->snapshot);
+        }
+    }
+}
+
+#else
+
+static void aesd_datalog_sync(struct aesd_datalog *log) {
+    if (log->sync_policy == AESD_SYNC_NONE) {
+        return;
+    }
+    if (log->sync_policy == AESD_SYNC_INTERVAL) {
+        unsigned long long now = aesd_datalog_now_ms();
+        if (now - log->last_sync_ms < log->sync_interval_ms) {
+            log->unsynced = true;
+            return;
+        }
+        log->last_sync_ms = now;
+        log->unsynced = false;
+    }
+    if (fdatasync(log->file_fd) != 0) {
+        syslog(LOG_ERR, "fdatasync failed: %s", strerror(errno));
+    }
+}
+
+// Writes all of @param iov, returning how many bytes made it to the file
+static size_t aesd_datalog_writev(int fd, struct iovec *iov, int count) {
+    size_t written = 0;
+
+    while (count > 0) {
+        ssize_t rc = writev(fd, iov, count);
+        if (rc == -1) {
+            if (errno == EINTR) continue;
+            syslog(LOG_ERR, "File write failed: %s", strerror(errno));
+            break;
+        }
+        written += rc;
+        // Skip what a short write already covered
+        while (count > 0 && (size_t)rc >= iov->iov_len) {
+            rc -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
+    return written;
+}
+
+// Copies a whole batch into the mapping past the published size, then publishes it
+static void aesd_datalog_commit_mapped(struct aesd_datalog *log, struct aesd_commit *batch) {
+    size_t total = 0;
+    size_t packets = 0;
+    size_t end = log->size;
+
+    for (struct aesd_commit *commit = batch; commit != NULL; commit = commit->next) {
+        total += commit->len;
+        packets++;
+    }
+    if (aesd_datalog_open(log) != 0 || aesd_datalog_map_grow(log, log->size + total) != 0) {
+        for (struct aesd_commit *commit = batch; commit != NULL; commit = commit->next) {
+            commit->rc = -1;
+            commit->end = log->size;
+        }
+        return;
+    }
+
+    for (struct aesd_commit *commit = batch; commit != NULL; commit = commit->next) {
+        memcpy(log->map + end, commit->buf, commit->len);
+        end += commit->len;
+        commit->rc = 0;
+        commit->end = end;
+    }
+    aesd_datalog_sync(log);
+    aesd_datalog_publish(log, total, packets, true);
+}
+
+// Writes a whole batch with as few writev() calls as possible, then caches and
+// publishes it. Only the leader gets here, so no lock is needed but view_lock.
+static void aesd_datalog_commit(struct aesd_datalog *log, struct aesd_commit *batch) {
+    struct iovec iov[COMMIT_IOV_COUNT];
+    size_t total = 0;
+    size_t written = 0;
+    size_t packets = 0;
+    bool cached = true;
+
+    if (log->backend == AESD_DATALOG_MMAP) {
+        aesd_datalog_commit_mapped(log, batch);
+        return;
+    }
+
+    if (aesd_datalog_open(log) != 0) {
+        for (struct aesd_commit *commit = batch; commit != NULL; commit = commit->next) {
+            commit->rc = -1;
+            commit->end = log->size;
+        }
+        return;
+    }
+
+    for (struct aesd_commit *first = batch; first != NULL && written == total; ) {
+        int count = 0;
+        size_t group = 0;
+        while (first != NULL && count < COMMIT_IOV_COUNT) {
+            iov[count].iov_base = (void *)first->buf;
+            iov[count].iov_len = first->len;
+            group += first->len;
+            count++;
+            first = first->next;
+        }
+        total += group;
+        written += aesd_datalog_writev(log->file_fd, iov, count);
+    }
+    aesd_datalog_sync(log);
+
+    // Only what reached the file is replayed, so the cache never diverges from it.
+    // A torn batch leaves a partial append in the file: replay it from there too.
+    size_t end = log->size;
+    for (struct aesd_commit *commit = batch; commit != NULL; commit = commit->next) {
+        if (end - log->size + commit->len <= written) {
+            commit->rc = 0;
+            packets++;
+            if (cached && written == total && aesd_datalog_cache(log, commit->buf, commit->len) != 0) {
+                cached = false;
+            }
+            end += commit->len;
+        } else {
+            commit->rc = -1;
+            cached = false;
+        }
+        commit->end = end;
+    }
+    aesd_datalog_publish(log, written, packets, cached);
+}
+
+#endif
+
+int aesd_datalog_append(struct aesd_datalog *log, const char *buf, size_t len,
+                        struct aesd_replay *snapshot_rtn) {
+    struct aesd_commit commit;
+
+    memset(&commit, 0, sizeof(commit));
+    commit.buf = buf;
+    commit.len = len;
+    commit.snapshot = snapshot_rtn;
+    if (snapshot_rtn != NULL) {
+        aesd_replay_init(snapshot_rtn);
+    }
+
+    // --- CRITICAL SECTION START ---
+    if (aesd_metrics_mutex_lock(log->mutex) != 0) {
+        syslog(LOG_ERR, "Mutex lock failed");
+        return -1;
+    }
+
+    if (log->queue_tail != NULL) {
+        log->queue_tail->next = &commit;
+    } else {
+        log->queue_head = &commit;
+    }
+    log->queue_tail = &commit;
+
+    // Wait for a leader to pick our append up, or for the chance to lead
+    while (!commit.done && log->committing) {
+        pthread_cond_wait(&log->committed, log->mutex);
+    }
+
+    if (!commit.done) {
+        // Lead: take everything queued so far, ours included, and write it without the lock
+        struct aesd_commit *batch = log->queue_head;
+        log->queue_head = NULL;
+        log->queue_tail = NULL;
+        log->committing = true;
+        pthread_mutex_unlock(log->mutex);
+
+        aesd_datalog_commit(log, batch);
+        aesd_metrics_add(AESD_METRIC_COMMIT_BATCHES, 1);
+
+        aesd_metrics_mutex_lock(log->mutex);
+        while (batch != NULL) {
+            struct aesd_commit *next = batch->next;
+            batch->done = true;
+            batch = next;
+        }
+        log->committing = false;
+        // Wakes the followers of this batch and whoever leads the next one
+        pthread_cond_broadcast(&log->committed);
+    }
+
+    pthread_mutex_unlock(log->mutex);
+    // --- CRITICAL SECTION END ---
+
+#if !USE_AESD_CHAR_DEVICE
+    // Later appends may already be published, the snapshot still ends right after ours
+    if (snapshot_rtn != NULL) {
+        aesd_datalog_snapshot(log, commit.end, snapshot_rtn);
+    }
+#endif
+
+    return commit.rc;
+}
+
+#if !USE_AESD_CHAR_DEVICE
+
+// Takes the lead with an empty batch, which keeps commits off the file until aesd_datalog_unlead()
+static void aesd_datalog_lead(struct aesd_datalog *log) {
+    aesd_metrics_mutex_lock(log->mutex);
+    while (log->committing) {
+        pthread_cond_wait(&log->committed, log->mutex);
+    }
+    log->committing = true;
+    pthread_mutex_unlock(log->mutex);
+}
+
+static void aesd_datalog_unlead(struct aesd_datalog *log) {
+    aesd_metrics_mutex_lock(log->mutex);
+    log->committing = false;
+    pthread_cond_broadcast(&log->committed);
+    pthread_mutex_unlock(log->mutex);
+}
+
+#endif
+
+void aesd_datalog_flush(struct aesd_datalog *log) {
+#if USE_AESD_CHAR_DEVICE
+    (void)log;
+#else
+    if (log->sync_policy != AESD_SYNC_INTERVAL) {
+        return;
+    }
+
+    aesd_datalog_lead(log);
+    if (log->unsynced) {
+        log->last_sync_ms = aesd_datalog_now_ms();
+        log->unsynced = false;
+        if (fdatasync(log->file_fd) != 0) {
+            syslog(LOG_ERR, "fdatasync failed: %s", strerror(errno));
+        }
+    }
+    aesd_datalog_unlead(log);
+#endif
+}
+
+void aesd_datalog_expire(struct aesd_datalog *log) {
+#if USE_AESD_CHAR_DEVICE
+    (void)log;
+#else
+    struct aesd_logseg *dropped;
+
+    if (log->retention.max_age_sec == 0) {
+        return;
+    }
+
+    // As the leader, the tail rotation segment is ours to replace
+    aesd_datalog_lead(log);
+    pthread_rwlock_wrlock(&log->view_lock);
+    dropped = aesd_datalog_retain(log, aesd_datalog_now_ms());
+    aesd_datalog_trim_cache(log);
+    pthread_rwlock_unlock(&log->view_lock);
+    aesd_logseg_put(dropped);
+    aesd_datalog_unlead(log);
+#endif
+}
+
+int aesd_datalog_snapshot(struct aesd_datalog *log, size_t end, struct aesd_replay *replay_rtn) {
+    aesd_replay_init(replay_rtn);
+
+#if USE_AESD_CHAR_DEVICE
+    (void)log;
+    (void)end;
+    errno = ENOTSUP;
+    return -1;
+#else
+    pthread_rwlock_rdlock(&log->view_lock);
+
+    // History that fell out of the retention window is not replayed anymore
+    size_t start = log->start;
+    if (end > log->size) {
+        end = log->size;
+    }
+    if (end < start) {
+        end = start;
+    }
+
+    // Bytes below log->size are never rewritten, so the snapshot stays valid after
+    // the lock is dropped; the references keep its segments from being freed and
+    // its part of DATA_FILE from being punched out
+    replay_rtn->file_fd = log->read_fd;
+    replay_rtn->file_offset = start;
+    if (log->backend == AESD_DATALOG_MMAP) {
+        replay_rtn->map = log->map + start;
+        replay_rtn->map_remaining = end - start;
+    } else if (end <= log->cache_start) {
+        replay_rtn->file_remaining = end - start;
+    } else if (start < log->cache_start) {
+        replay_rtn->file_remaining = log->cache_start - start;
+        aesd_segment_get(log->head);
+        replay_rtn->segment = log->head;
+        replay_rtn->remaining = end - log->cache_start;
+    } else if (end > start) {
+        // The cache reaches further back than the retention window
+        aesd_segment_get(log->head);
+        replay_rtn->segment = log->head;
+        replay_rtn->offset = start - log->cache_start;
+        replay_rtn->remaining = end - start;
+    }
+    if ((replay_rtn->file_remaining > 0 || replay_rtn->map_remaining > 0) && log->logseg_head != NULL) {
+        aesd_logseg_get(log->logseg_head);
+        replay_rtn->logseg = log->logseg_head;
+    }
+
+    pthread_rwlock_unlock(&log->view_lock);
+    return 0;
+#endif
+}
+
+void aesd_replay_init(struct aesd_replay *replay) {
+    memset(replay, 0, sizeof(*replay));
+    replay->file_fd = -1;
+    replay->pipe_fd = -1;
+}
+
+size_t aesd_replay_pending(const struct aesd_replay *replay) {
+    return replay->file_remaining + replay->pipe_remaining + replay->map_remaining + replay->remaining;
+}
+
+int aesd_replay_gather(const struct aesd_replay *replay, struct iovec *iov, int max_iov) {
+    struct aesd_segment *segment = replay->segment;
+    size_t offset = replay->offset;
+    size_t remaining = replay->remaining;
+    int count = 0;
+
+    if (replay->map_remaining > 0 && max_iov > 0) {
+        iov[count].iov_base = (void *)replay->map;
+        iov[count].iov_len = replay->map_remaining;
+        count++;
+    }
+
+    // Gather the next run of segments, never looking past the snapshot end
+    while (count < max_iov && remaining > 0) {
+        size_t chunk = atomic_load_explicit(&segment->len, memory_order_relaxed) - offset;
+        if (chunk > remaining) {
+            chunk = remaining;
+        }
+        iov[count].iov_base = segment->data + offset;
+        iov[count].iov_len = chunk;
+        count++;
+        remaining -= chunk;
+        offset = 0;
+        if (remaining > 0) {
+            segment = segment->next;
+        }
+    }
+    return count;
+}
+
+// Moves the segment cursor past @param advance sent bytes, moving the reference along
+static void aesd_replay_advance_segments(struct aesd_replay *replay, size_t advance) {
+    replay->remaining -= advance;
+    while (advance > 0) {
+        size_t chunk = atomic_load_explicit(&replay->segment->len, memory_order_relaxed) - replay->offset;
+        if (advance < chunk) {
+            replay->offset += advance;
+            break;
+        }
+        advance -= chunk;
+        replay->offset = 0;
+        if (replay->remaining > 0) {
+            struct aesd_segment *done = replay->segment;
+            replay->segment = done->next;
+            aesd_segment_get(replay->segment);
+            aesd_segment_put(done);
+        }
+    }
+}
+
+void aesd_replay_advance(struct aesd_replay *replay, size_t len) {
+    if (replay->file_remaining > 0) {
+        replay->file_offset += len;
+        replay->file_remaining -= len;
+        aesd_metrics_add(AESD_METRIC_REPLAY_FILE_BYTES, len);
+        if (replay->file_remaining == 0) {
+            aesd_logseg_put(replay->logseg);
+            replay->logseg = NULL;
+        }
+    } else if (replay->pipe_remaining > 0) {
+        replay->pipe_remaining -= len;
+        aesd_metrics_add(AESD_METRIC_REPLAY_PIPE_BYTES, len);
+        if (replay->pipe_remaining == 0) {
+            close(replay->pipe_fd);
+            replay->pipe_fd = -1;
+        }
+    } else {
+        // One sendmsg() may cover the end of the mapped part and the first segments
+        size_t mapped = len < replay->map_remaining ? len : replay->map_remaining;
+        if (mapped > 0) {
+            replay->map += mapped;
+            replay->map_remaining -= mapped;
+            len -= mapped;
+            aesd_metrics_add(AESD_METRIC_REPLAY_MAP_BYTES, mapped);
+            if (replay->map_remaining == 0) {
+                aesd_logseg_put(replay->logseg);
+                replay->logseg = NULL;
+            }
+        }
+        if (len > 0) {
+            aesd_replay_advance_segments(replay, len);
+            aesd_metrics_add(AESD_METRIC_REPLAY_CACHE_BYTES, len);
+        }
+    }
+}
+
+// Streams the part of the history that is no longer cached straight from the page cache
+static ssize_t aesd_replay_send_file(struct aesd_replay *replay, int fd) {
+    size_t chunk = replay->file_remaining > REPLAY_CHUNK_SIZE ? REPLAY_CHUNK_SIZE : replay->file_remaining;
+    off_t offset = replay->file_offset;
+    ssize_t sent = sendfile(fd, replay->file_fd, &offset, chunk);
+    if (sent == 0) {
+        // The file is shorter than the snapshot, nothing more can be sent
+        errno = EIO;
+        return -1;
+    }
+    return sent;
+}
+
+static ssize_t aesd_replay_send_pipe(struct aesd_replay *replay, int fd) {
+    size_t chunk = replay->pipe_remaining > REPLAY_CHUNK_SIZE ? REPLAY_CHUNK_SIZE : replay->pipe_remaining;
+    // No SPLICE_F_MORE on the last chunk, the socket would hold the tail back until the cork timer fires
+    unsigned int flags = SPLICE_F_MOVE | (chunk < replay->pipe_remaining ? SPLICE_F_MORE : 0);
+    ssize_t sent = splice(replay->pipe_fd, NULL, fd, NULL, chunk, flags);
+    if (sent == 0) {
+        errno = EIO;
+        return -1;
+    }
+    return sent;
+}
+
+// Sends the mapped part and the cached segments, both are plain memory
+static ssize_t aesd_replay_send_memory(struct aesd_replay *replay, int fd) {
+    struct iovec iov[REPLAY_IOV_COUNT];
+    struct msghdr msg;
+
+    // sendmsg() is writev() for sockets, plus MSG_NOSIGNAL
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = aesd_replay_gather(replay, iov, REPLAY_IOV_COUNT);
+    return sendmsg(fd, &msg, MSG_NOSIGNAL);
+}
+
+ssize_t aesd_replay_send(struct aesd_replay *replay, int fd) {
+    ssize_t sent = 0;
+
+    if (replay->file_remaining > 0) {
+        sent = aesd_replay_send_file(replay, fd);
+    } else if (replay->pipe_remaining > 0) {
+        sent = aesd_replay_send_pipe(replay, fd);
+    } else if (replay->map_remaining > 0 || replay->remaining > 0) {
+        sent = aesd_replay_send_memory(replay, fd);
+    }
+
+    if (sent > 0) {
+        aesd_replay_advance(replay, sent);
+    }
+    return sent;
+}
+
+void aesd_replay_release(struct aesd_replay *replay) {
+    if (replay->pipe_fd != -1) {
+        close(replay->pipe_fd);
+    }
+    aesd_segment_put(replay->segment);
+    aesd_logseg_put(replay->logseg);
+    aesd_replay_init(replay);
+}
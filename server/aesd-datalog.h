@@ -0,0 +1,334 @@
+/*
+ * aesd-datalog.h
+ *
+ *  The history every client gets replayed. DATA_FILE is only ever appended
+ *  to; with the regular file backend the most recent part of its contents is
+ *  also kept in memory as a chain of segments, so small replies are gathered
+ *  straight from memory and only older history is streamed from the file
+ *  with sendfile(). A retention window bounds the history: DATA_FILE is
+ *  split into rotation segments and the oldest ones are punched out of it.
+ */
+
+#ifndef AESD_DATALOG_H
+#define AESD_DATALOG_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Default size of a cache segment, larger appends get a segment of their own size
+#define AESD_SEGMENT_SIZE (64 * 1024)
+
+/**
+ * Segments form a reference counted list: the log holds a reference on its
+ * head, every segment holds one on its successor and every replay holds one
+ * on the segment it is sending from. Dropping the last reference frees a
+ * segment and releases its successor, so a replay keeps alive exactly the
+ * part of the chain it still has to walk.
+ */
+struct aesd_segment
+{
+    atomic_int refs;
+    struct aesd_segment *next;
+    /**
+     * Bytes used in data, only ever grows while the segment is the tail.
+     * Replays read it without the mutex, they never look past their snapshot.
+     */
+    atomic_size_t len;
+    size_t capacity;
+    char data[];
+};
+
+/**
+ * A run of whole appends to DATA_FILE, the unit history is dropped in once it falls out
+ * of the retention window. Rotation segments are reference counted like aesd_segment:
+ * the log holds a reference on the oldest one it retains, every rotation segment on its
+ * successor and every replay sending from DATA_FILE on the one it starts in. Dropping
+ * the last reference punches the bytes of the segment out of DATA_FILE.
+ */
+struct aesd_logseg
+{
+    atomic_int refs;
+    struct aesd_logseg *next;
+    /**
+     * Descriptor the bytes are punched out of, -1 once the log is gone
+     */
+    int fd;
+    /**
+     * Offsets of the first byte and past the last, end only grows while the segment is the tail
+     */
+    size_t start;
+    size_t end;
+    size_t packets;
+    /**
+     * CLOCK_MONOTONIC times of the first and the last append, in milliseconds
+     */
+    unsigned long long first_ms;
+    unsigned long long last_ms;
+};
+
+// The retention window is split into about this many rotation segments
+#define AESD_RETAIN_SEGMENTS 8
+
+/**
+ * How much history is kept, 0 leaving that dimension unbounded. The newest rotation
+ * segment is always kept, the rest are dropped oldest first as soon as the history
+ * goes past any of the limits, so it never exceeds a limit by more than the newest one.
+ */
+struct aesd_retention
+{
+    size_t max_bytes;
+    size_t max_packets;
+    unsigned int max_age_sec;
+};
+
+/**
+ * When appended data is forced to disk with fdatasync()
+ */
+enum aesd_sync_policy
+{
+    AESD_SYNC_NONE,      /* leave it to the kernel */
+    AESD_SYNC_BATCH,     /* after every group commit */
+    AESD_SYNC_INTERVAL,  /* after a group commit once sync_interval_ms have passed */
+};
+
+/**
+ * Where the regular file backend keeps the history it appends to DATA_FILE
+ */
+enum aesd_datalog_backend
+{
+    AESD_DATALOG_FILE,  /* written with writev(), recent history cached, the rest sent with sendfile() */
+    AESD_DATALOG_MMAP,  /* copied into a shared mapping of the file, every replay sent from it */
+};
+
+// Address space reserved for the mapping of DATA_FILE from offset 0. Everything ever written
+// has to fit, history dropped by retention still takes its part, see aesd_config_check().
+#define AESD_MAP_RESERVE (sizeof(void *) > 4 ? (64ULL << 30) : (512ULL << 20))
+
+// DATA_FILE is allocated and mapped this much at a time
+#define AESD_MAP_EXTENT (64 * 1024 * 1024)
+
+/**
+ * An append waiting in the group commit queue, lives on the appender's stack
+ */
+struct aesd_commit
+{
+    const char *buf;
+    size_t len;
+    /**
+     * Char device snapshot, taken by whichever thread commits the append
+     */
+    struct aesd_replay *snapshot;
+    /**
+     * History length right after this append
+     */
+    size_t end;
+    int rc;
+    bool done;
+    struct aesd_commit *next;
+};
+
+/**
+ * Appends are group committed: appenders queue themselves under mutex and the
+ * first one to find no commit in progress becomes the leader, writing every
+ * queued append with a single writev() on the long-lived file descriptor while
+ * the others wait. The leader also fills the cache past the published size.
+ * Snapshots only take view_lock for reading to pin the published history, so
+ * they never wait for a file write; the leader takes it for writing just long
+ * enough to publish a batch.
+ */
+struct aesd_datalog
+{
+    /**
+     * Guards the commit queue
+     */
+    pthread_mutex_t *mutex;
+    struct aesd_commit *queue_head;
+    struct aesd_commit *queue_tail;
+    /**
+     * Set while a leader is writing a batch, followers wait on committed
+     */
+    bool committing;
+    pthread_cond_t committed;
+    /**
+     * DATA_FILE opened once for appending, and once for replays to sendfile() from
+     */
+    int file_fd;
+    int read_fd;
+    enum aesd_sync_policy sync_policy;
+    unsigned int sync_interval_ms;
+    /**
+     * CLOCK_MONOTONIC time of the last fdatasync(), in milliseconds
+     */
+    unsigned long long last_sync_ms;
+    /**
+     * Set while committed bytes are waiting for the next interval to be synced
+     */
+    bool unsynced;
+    /**
+     * Guards head, cache_start, size and the retained history as seen by snapshots
+     */
+    pthread_rwlock_t view_lock;
+    /**
+     * Cached tail of DATA_FILE, oldest segment first
+     */
+    struct aesd_segment *head;
+    /**
+     * Segment appends copy into, only used by the commit leader
+     */
+    struct aesd_segment *tail;
+    /**
+     * File offset of the first cached byte, everything before it is only on disk
+     */
+    size_t cache_start;
+    /**
+     * Most bytes kept in the cache
+     */
+    size_t cache_limit;
+    /**
+     * Total bytes appended and published
+     */
+    size_t size;
+    struct aesd_retention retention;
+    /**
+     * Retained rotation segments, oldest first. Appends go to the tail, only the leader
+     * (or aesd_datalog_expire()) moves the head.
+     */
+    struct aesd_logseg *logseg_head;
+    struct aesd_logseg *logseg_tail;
+    /**
+     * Offset of the first retained byte, and how many packets are retained
+     */
+    size_t start;
+    size_t packets;
+    enum aesd_datalog_backend backend;
+    /**
+     * AESD_DATALOG_MMAP: AESD_MAP_RESERVE bytes of address space, the first map_size of
+     * them mapping DATA_FILE. The mapping only ever grows in place, so replays point into it.
+     */
+    char *map;
+    size_t map_size;
+};
+
+/**
+ * A consistent view of the history up to the moment it was captured, consumed
+ * by aesd_replay_send() in order: the file part, the pipe part, the mapped part,
+ * then the cached segments. Bytes appended later are never part of the replay.
+ */
+struct aesd_replay
+{
+    /**
+     * History older than the cache, streamed from DATA_FILE with sendfile().
+     * The descriptor belongs to the log.
+     */
+    int file_fd;
+    off_t file_offset;
+    size_t file_remaining;
+    /**
+     * Keeps the file or mapped part from being punched out of DATA_FILE while it is sent
+     */
+    struct aesd_logseg *logseg;
+    /**
+     * Char device contents spliced into a pipe while the lock was held
+     */
+    int pipe_fd;
+    size_t pipe_remaining;
+    /**
+     * History still to be sent straight from the mapping of DATA_FILE
+     */
+    const char *map;
+    size_t map_remaining;
+    /**
+     * In-memory history, the replay holds a reference on segment
+     */
+    struct aesd_segment *segment;
+    size_t offset;
+    size_t remaining;
+};
+
+/**
+ * Prepares @param log, whose commit queue is guarded by @param mutex, for an empty DATA_FILE
+ * kept as @param backend says, caching at most @param cache_limit bytes of it in memory and
+ * syncing it to disk as @param sync_policy says (@param sync_interval_ms only matters for
+ * AESD_SYNC_INTERVAL). The char device backend ignores @param backend.
+ */
+extern void aesd_datalog_init(struct aesd_datalog *log, pthread_mutex_t *mutex, enum aesd_datalog_backend backend,
+                              size_t cache_limit, enum aesd_sync_policy sync_policy, unsigned int sync_interval_ms);
+
+/**
+ * Bounds the history of @param log to @param retention from its next append on
+ */
+extern void aesd_datalog_set_retention(struct aesd_datalog *log, const struct aesd_retention *retention);
+
+/**
+ * Drops the history of @param log that aged out of its retention window, so a quiet log
+ * does not keep it until the next append. A no-op without max_age_sec.
+ */
+extern void aesd_datalog_expire(struct aesd_datalog *log);
+
+/**
+ * Drops the cached history of @param log and closes its descriptors. DATA_FILE itself is left
+ * alone, but for trimming what its last mapped extent did not use.
+ */
+extern void aesd_datalog_destroy(struct aesd_datalog *log);
+
+/**
+ * Appends @param len bytes from @param buf to DATA_FILE, possibly batched with concurrent appends.
+ * If @param snapshot_rtn is not NULL it receives the history up to and including this append.
+ * @return 0 on success, -1 on failure
+ */
+extern int aesd_datalog_append(struct aesd_datalog *log, const char *buf, size_t len,
+                               struct aesd_replay *snapshot_rtn);
+
+/**
+ * Syncs what AESD_SYNC_INTERVAL held back from the last commits of @param log, so a quiet
+ * log does not leave its tail unsynced until the next append. A no-op under other policies.
+ */
+extern void aesd_datalog_flush(struct aesd_datalog *log);
+
+/**
+ * Captures the retained history of @param log up to offset @param end into @param replay_rtn
+ * without waiting for appends in progress. Not supported by the char device backend,
+ * whose snapshots can only be taken by aesd_datalog_append().
+ * @return 0 on success, -1 on failure (@param replay_rtn is then empty)
+ */
+extern int aesd_datalog_snapshot(struct aesd_datalog *log, size_t end, struct aesd_replay *replay_rtn);
+
+/**
+ * Initializes @param replay to an empty replay
+ */
+extern void aesd_replay_init(struct aesd_replay *replay);
+
+/**
+ * @return the number of bytes @param replay still has to send
+ */
+extern size_t aesd_replay_pending(const struct aesd_replay *replay);
+
+/**
+ * Sends as much of @param replay to socket @param fd as it accepts
+ * @return the number of bytes sent, or -1 with errno set (EAGAIN on a full non-blocking socket)
+ */
+extern ssize_t aesd_replay_send(struct aesd_replay *replay, int fd);
+
+/**
+ * Fills up to @param max_iov entries of @param iov with the cached part of @param replay,
+ * for callers that send it themselves. Only meaningful once the file and pipe parts are sent.
+ * @return the number of entries filled
+ */
+extern int aesd_replay_gather(const struct aesd_replay *replay, struct iovec *iov, int max_iov);
+
+/**
+ * Marks @param len bytes at the front of @param replay as sent by the caller. The bytes
+ * must all come from the part aesd_replay_send() would be sending from.
+ */
+extern void aesd_replay_advance(struct aesd_replay *replay, size_t len);
+
+/**
+ * Drops whatever @param replay still holds, it is empty afterwards
+ */
+extern void aesd_replay_release(struct aesd_replay *replay);
+
+#endif /* AESD_DATALOG_H */
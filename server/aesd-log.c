@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
+
+#include "aesd-log.h"
+#include "aesd-metrics.h"
+
+atomic_int aesd_log_level = LOG_INFO;
+
+static __thread struct aesd_log_ring *local_ring;
+
+// Every ring ever handed out, only rings are added and only under registry_lock
+static struct aesd_log_ring *registry;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Returns the ring of an exiting thread to the registry
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+// The logger thread sleeps on flush until a producer sets flush_requested
+static pthread_t logger_thread_id;
+static atomic_bool running;
+static bool stopping;
+static atomic_bool flush_requested;
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush = PTHREAD_COND_INITIALIZER;
+
+static void aesd_log_thread_exit(void *arg) {
+    struct aesd_log_ring *ring = arg;
+
+    // Whatever it still holds is drained all the same
+    pthread_mutex_lock(&registry_lock);
+    ring->in_use = false;
+    pthread_mutex_unlock(&registry_lock);
+}
+
+static void aesd_log_key_init(void) {
+    pthread_key_create(&ring_key, aesd_log_thread_exit);
+}
+
+static struct aesd_log_ring *aesd_log_attach(void) {
+    struct aesd_log_ring *ring;
+
+    pthread_once(&ring_once, aesd_log_key_init);
+
+    pthread_mutex_lock(&registry_lock);
+    for (ring = registry; ring != NULL && ring->in_use; ring = ring->next)
+        ;
+    if (ring == NULL) {
+        ring = calloc(1, sizeof(struct aesd_log_ring));
+        if (ring != NULL) {
+            ring->next = registry;
+            registry = ring;
+        }
+    }
+    if (ring != NULL) {
+        ring->in_use = true;
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    if (ring != NULL) {
+        pthread_setspecific(ring_key, ring);
+        local_ring = ring;
+    }
+    return ring;
+}
+
+void aesd_log_set_level(int priority) {
+    atomic_store(&aesd_log_level, priority);
+    setlogmask(LOG_UPTO(priority));
+}
+
+static void aesd_log_wake(void) {
+    // One wakeup per batch: the flag stays set until the logger starts draining
+    if (!atomic_exchange(&flush_requested, true)) {
+        pthread_mutex_lock(&flush_lock);
+        pthread_cond_signal(&flush);
+        pthread_mutex_unlock(&flush_lock);
+    }
+}
+
+void aesd_log_queue(int priority, const char *format, ...) {
+    struct aesd_log_ring *ring = local_ring;
+    va_list args;
+
+    if (!atomic_load_explicit(&running, memory_order_acquire)
+        || (ring == NULL && (ring = aesd_log_attach()) == NULL)) {
+        va_start(args, format);
+        vsyslog(priority, format, args);
+        va_end(args);
+        return;
+    }
+
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail == AESD_LOG_RING_SLOTS) {
+        // Never wait for syslog on the connection path
+        atomic_store_explicit(&ring->dropped, atomic_load_explicit(&ring->dropped, memory_order_relaxed) + 1,
+                              memory_order_relaxed);
+        aesd_metrics_add(AESD_METRIC_LOG_DROPS, 1);
+        return;
+    }
+
+    struct aesd_log_entry *entry = &ring->entries[head & (AESD_LOG_RING_SLOTS - 1)];
+    entry->priority = priority;
+    va_start(args, format);
+    vsnprintf(entry->message, sizeof(entry->message), format, args);
+    va_end(args);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    aesd_log_wake();
+}
+
+// Hands everything queued so far to syslog(), ring by ring
+static void aesd_log_drain(void) {
+    pthread_mutex_lock(&registry_lock);
+    struct aesd_log_ring *rings = registry;
+    pthread_mutex_unlock(&registry_lock);
+
+    // Rings are only ever pushed at the front, the list from rings on never changes
+    for (struct aesd_log_ring *ring = rings; ring != NULL; ring = ring->next) {
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+        for (; tail != head; tail++) {
+            struct aesd_log_entry *entry = &ring->entries[tail & (AESD_LOG_RING_SLOTS - 1)];
+            syslog(entry->priority, "%s", entry->message);
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+        unsigned long dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+        if (dropped != ring->dropped_reported) {
+            syslog(LOG_WARNING, "Log ring full, %lu messages dropped", dropped - ring->dropped_reported);
+            ring->dropped_reported = dropped;
+        }
+    }
+}
+
+static void *aesd_log_thread_func(void *arg) {
+    bool stop;
+    (void)arg;
+
+    do {
+        pthread_mutex_lock(&flush_lock);
+        while (!atomic_load(&flush_requested) && !stopping) {
+            pthread_cond_wait(&flush, &flush_lock);
+        }
+        stop = stopping;
+        pthread_mutex_unlock(&flush_lock);
+
+        // Cleared first, so messages queued while draining wake us again
+        atomic_store(&flush_requested, false);
+        aesd_log_drain();
+    } while (!stop);
+    return NULL;
+}
+
+int aesd_log_start(void) {
+    stopping = false;
+    atomic_store(&running, true);
+    if (pthread_create(&logger_thread_id, NULL, aesd_log_thread_func, NULL) != 0) {
+        atomic_store(&running, false);
+        syslog(LOG_ERR, "Failed to create logger thread");
+        return -1;
+    }
+    return 0;
+}
+
+void aesd_log_stop(void) {
+    if (!atomic_load(&running)) {
+        return;
+    }
+    // Later messages go straight to syslog(), the final drain picks up the rest
+    atomic_store(&running, false);
+
+    pthread_mutex_lock(&flush_lock);
+    stopping = true;
+    pthread_cond_signal(&flush);
+    pthread_mutex_unlock(&flush_lock);
+    pthread_join(logger_thread_id, NULL);
+}
@@ -0,0 +1,87 @@
+/*
+ * aesd-log.h
+ *
+ *  Asynchronous logging for the connection path. aesd_log() formats the
+ *  message into a lock-free ring owned by the calling thread and returns;
+ *  a background thread drains every ring and hands the messages to syslog()
+ *  in batches. Messages above the configured level are dropped before they
+ *  are even formatted, and a full ring drops the message and counts it
+ *  instead of blocking the connection.
+ */
+
+#ifndef AESD_LOG_H
+#define AESD_LOG_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <syslog.h>
+
+// Messages each thread can have waiting for the logger thread, a power of two
+#define AESD_LOG_RING_SLOTS 256
+
+// Longer messages are truncated
+#define AESD_LOG_MESSAGE_SIZE 120
+
+struct aesd_log_entry
+{
+    int priority;
+    char message[AESD_LOG_MESSAGE_SIZE];
+};
+
+/**
+ * Single producer, single consumer ring. Only the owning thread advances head
+ * and only the logger thread advances tail. Like the metrics shards, a ring
+ * outlives its thread and is handed to the next thread starting up.
+ */
+struct aesd_log_ring
+{
+    atomic_size_t head;
+    atomic_size_t tail;
+    /**
+     * Messages lost to a full ring, written by the owner only
+     */
+    atomic_ulong dropped;
+    /**
+     * Part of dropped already reported, only used by the logger thread
+     */
+    unsigned long dropped_reported;
+    bool in_use;
+    struct aesd_log_ring *next;
+    struct aesd_log_entry entries[AESD_LOG_RING_SLOTS];
+};
+
+/**
+ * Most verbose priority logged, LOG_INFO unless changed by aesd_log_set_level()
+ */
+extern atomic_int aesd_log_level;
+
+/**
+ * Drops every message less important than @param priority, the direct syslog() calls included
+ */
+extern void aesd_log_set_level(int priority);
+
+/**
+ * Starts the logger thread. Until it runs, and after aesd_log_stop(), aesd_log() calls syslog() itself.
+ * @return 0 on success, -1 on failure
+ */
+extern int aesd_log_start(void);
+
+/**
+ * Flushes every message still queued and joins the logger thread
+ */
+extern void aesd_log_stop(void);
+
+extern void aesd_log_queue(int priority, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/**
+ * syslog() replacement for the connection path, see above
+ */
+#define aesd_log(priority, ...) \
+    do { \
+        if ((priority) <= atomic_load_explicit(&aesd_log_level, memory_order_relaxed)) { \
+            aesd_log_queue((priority), __VA_ARGS__); \
+        } \
+    } while (0)
+
+#endif /* AESD_LOG_H */
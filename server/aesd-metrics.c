@@ -0,0 +1,305 @@
+#define _GNU_SOURCE // open_memstream()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netdb.h>
+
+#include "aesd-metrics.h"
+
+// How long a scraper gets to send its request before it is answered anyway
+#define METRICS_REQUEST_TIMEOUT_SEC 1
+
+__thread struct aesd_metrics_shard *aesd_metrics_local;
+
+// Every shard ever handed out, only shards are added and only under registry_lock
+static struct aesd_metrics_shard *registry;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Returns the shard of an exiting thread to the registry
+static pthread_key_t shard_key;
+static pthread_once_t shard_once = PTHREAD_ONCE_INIT;
+
+static void aesd_metrics_thread_exit(void *arg) {
+    struct aesd_metrics_shard *shard = arg;
+
+    pthread_mutex_lock(&registry_lock);
+    shard->in_use = false;
+    pthread_mutex_unlock(&registry_lock);
+}
+
+static void aesd_metrics_key_init(void) {
+    pthread_key_create(&shard_key, aesd_metrics_thread_exit);
+}
+
+struct aesd_metrics_shard *aesd_metrics_attach(void) {
+    struct aesd_metrics_shard *shard;
+
+    pthread_once(&shard_once, aesd_metrics_key_init);
+
+    // Connection threads come and go, reuse what they left behind
+    pthread_mutex_lock(&registry_lock);
+    for (shard = registry; shard != NULL && shard->in_use; shard = shard->next)
+        ;
+    if (shard == NULL) {
+        shard = aligned_alloc(_Alignof(struct aesd_metrics_shard), sizeof(struct aesd_metrics_shard));
+        if (shard != NULL) {
+            memset(shard, 0, sizeof(*shard));
+            shard->next = registry;
+            registry = shard;
+        }
+    }
+    if (shard != NULL) {
+        shard->in_use = true;
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    if (shard == NULL) {
+        syslog(LOG_ERR, "Malloc for metrics failed");
+        return NULL;
+    }
+    pthread_setspecific(shard_key, shard);
+    aesd_metrics_local = shard;
+    return shard;
+}
+
+static unsigned long long aesd_metrics_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void aesd_metrics_record_wait(unsigned long long wait_ns) {
+    struct aesd_metrics_shard *shard = aesd_metrics_local;
+    unsigned long long bound = AESD_METRICS_WAIT_FIRST_NS;
+    unsigned int bucket = 0;
+
+    if (shard == NULL && (shard = aesd_metrics_attach()) == NULL) {
+        return;
+    }
+    while (bucket < AESD_METRICS_WAIT_BUCKETS - 1 && wait_ns > bound) {
+        bound *= 4;
+        bucket++;
+    }
+    atomic_store_explicit(&shard->wait_buckets[bucket],
+                          atomic_load_explicit(&shard->wait_buckets[bucket], memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    atomic_store_explicit(&shard->wait_sum_ns,
+                          atomic_load_explicit(&shard->wait_sum_ns, memory_order_relaxed) + wait_ns,
+                          memory_order_relaxed);
+}
+
+int aesd_metrics_mutex_lock(pthread_mutex_t *mutex) {
+    // Only contended locks pay for reading the clock
+    if (pthread_mutex_trylock(mutex) == 0) {
+        aesd_metrics_record_wait(0);
+        return 0;
+    }
+
+    unsigned long long start = aesd_metrics_now_ns();
+    int rc = pthread_mutex_lock(mutex);
+    aesd_metrics_record_wait(aesd_metrics_now_ns() - start);
+    return rc;
+}
+
+struct aesd_metrics_totals
+{
+    unsigned long counters[AESD_METRIC_COUNT];
+    unsigned long wait_buckets[AESD_METRICS_WAIT_BUCKETS];
+    unsigned long wait_sum_ns;
+};
+
+static void aesd_metrics_sum(struct aesd_metrics_totals *totals) {
+    memset(totals, 0, sizeof(*totals));
+
+    pthread_mutex_lock(&registry_lock);
+    for (struct aesd_metrics_shard *shard = registry; shard != NULL; shard = shard->next) {
+        for (int i = 0; i < AESD_METRIC_COUNT; i++) {
+            totals->counters[i] += atomic_load_explicit(&shard->counters[i], memory_order_relaxed);
+        }
+        for (int i = 0; i < AESD_METRICS_WAIT_BUCKETS; i++) {
+            totals->wait_buckets[i] += atomic_load_explicit(&shard->wait_buckets[i], memory_order_relaxed);
+        }
+        totals->wait_sum_ns += atomic_load_explicit(&shard->wait_sum_ns, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+static void aesd_metrics_counter(FILE *out, const char *name, const char *help, unsigned long value) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n", name, help, name, name, value);
+}
+
+void aesd_metrics_render(FILE *out) {
+    struct aesd_metrics_totals totals;
+    unsigned long *c = totals.counters;
+
+    aesd_metrics_sum(&totals);
+
+    aesd_metrics_counter(out, "aesd_connections_accepted_total", "Client connections accepted.",
+                         c[AESD_METRIC_CONNECTIONS_ACCEPTED]);
+    // Shards are summed one after the other, never report more closed than accepted
+    unsigned long active = c[AESD_METRIC_CONNECTIONS_ACCEPTED] > c[AESD_METRIC_CONNECTIONS_CLOSED]
+                         ? c[AESD_METRIC_CONNECTIONS_ACCEPTED] - c[AESD_METRIC_CONNECTIONS_CLOSED] : 0;
+    fprintf(out, "# HELP aesd_connections_active Client connections currently open.\n"
+                 "# TYPE aesd_connections_active gauge\naesd_connections_active %lu\n", active);
+    aesd_metrics_counter(out, "aesd_connections_refused_total",
+                         "Connections closed right away because the connection limit was reached.",
+                         c[AESD_METRIC_CONNECTIONS_REFUSED]);
+    aesd_metrics_counter(out, "aesd_connections_expired_total",
+                         "Connections closed for missing their idle, read or write deadline.",
+                         c[AESD_METRIC_CONNECTIONS_EXPIRED]);
+    aesd_metrics_counter(out, "aesd_packets_oversized_total",
+                         "Connections closed for sending a packet longer than the packet size cap.",
+                         c[AESD_METRIC_PACKETS_OVERSIZED]);
+    aesd_metrics_counter(out, "aesd_bytes_received_total", "Bytes received from clients.",
+                         c[AESD_METRIC_BYTES_RECEIVED]);
+    aesd_metrics_counter(out, "aesd_bytes_sent_total", "Bytes sent to clients, all of it replayed history.",
+                         c[AESD_METRIC_REPLAY_FILE_BYTES] + c[AESD_METRIC_REPLAY_PIPE_BYTES]
+                         + c[AESD_METRIC_REPLAY_MAP_BYTES] + c[AESD_METRIC_REPLAY_CACHE_BYTES]);
+    aesd_metrics_counter(out, "aesd_packets_total", "Packets stored and answered.", c[AESD_METRIC_PACKETS]);
+    aesd_metrics_counter(out, "aesd_append_errors_total",
+                         "Connections closed because their packet could not be stored.",
+                         c[AESD_METRIC_APPEND_ERRORS]);
+    aesd_metrics_counter(out, "aesd_timestamp_writes_total", "Timestamp lines appended.",
+                         c[AESD_METRIC_TIMESTAMP_WRITES]);
+    aesd_metrics_counter(out, "aesd_commit_batches_total", "Group commits written to the data file.",
+                         c[AESD_METRIC_COMMIT_BATCHES]);
+    aesd_metrics_counter(out, "aesd_log_dropped_total", "Log messages dropped because a log ring was full.",
+                         c[AESD_METRIC_LOG_DROPS]);
+    aesd_metrics_counter(out, "aesd_history_segments_dropped_total",
+                         "Rotation segments of the data file dropped by the retention window.",
+                         c[AESD_METRIC_HISTORY_SEGMENTS_DROPPED]);
+    aesd_metrics_counter(out, "aesd_history_bytes_dropped_total",
+                         "History bytes dropped by the retention window.",
+                         c[AESD_METRIC_HISTORY_BYTES_DROPPED]);
+
+    fprintf(out, "# HELP aesd_replay_bytes_total Replayed history bytes by where they were sent from.\n"
+                 "# TYPE aesd_replay_bytes_total counter\n"
+                 "aesd_replay_bytes_total{source=\"file\"} %lu\n"
+                 "aesd_replay_bytes_total{source=\"pipe\"} %lu\n"
+                 "aesd_replay_bytes_total{source=\"map\"} %lu\n"
+                 "aesd_replay_bytes_total{source=\"cache\"} %lu\n",
+            c[AESD_METRIC_REPLAY_FILE_BYTES], c[AESD_METRIC_REPLAY_PIPE_BYTES], c[AESD_METRIC_REPLAY_MAP_BYTES],
+            c[AESD_METRIC_REPLAY_CACHE_BYTES]);
+
+    fprintf(out, "# HELP aesd_file_mutex_wait_seconds Time spent waiting for file_mutex.\n"
+                 "# TYPE aesd_file_mutex_wait_seconds histogram\n");
+    unsigned long long bound = AESD_METRICS_WAIT_FIRST_NS;
+    unsigned long count = 0;
+    for (int i = 0; i < AESD_METRICS_WAIT_BUCKETS; i++) {
+        count += totals.wait_buckets[i];
+        if (i < AESD_METRICS_WAIT_BUCKETS - 1) {
+            fprintf(out, "aesd_file_mutex_wait_seconds_bucket{le=\"%g\"} %lu\n", bound / 1e9, count);
+            bound *= 4;
+        } else {
+            fprintf(out, "aesd_file_mutex_wait_seconds_bucket{le=\"+Inf\"} %lu\n", count);
+        }
+    }
+    fprintf(out, "aesd_file_mutex_wait_seconds_sum %.9f\naesd_file_mutex_wait_seconds_count %lu\n",
+            totals.wait_sum_ns / 1e9, count);
+}
+
+// Answers one scraper: whatever it asked for, it gets the metrics
+static void aesd_metrics_answer(int fd) {
+    char request[1024];
+    char *body = NULL;
+    size_t body_len = 0;
+    char header[128];
+
+    struct timeval timeout = { METRICS_REQUEST_TIMEOUT_SEC, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (recv(fd, request, sizeof(request), 0) == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        return;
+    }
+
+    FILE *out = open_memstream(&body, &body_len);
+    if (out == NULL) {
+        syslog(LOG_ERR, "Metrics buffer allocation failed");
+        return;
+    }
+    aesd_metrics_render(out);
+    fclose(out);
+
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: %zu\r\n\r\n", body_len);
+    if (send(fd, header, header_len, MSG_NOSIGNAL) == header_len) {
+        for (size_t sent = 0; sent < body_len; ) {
+            ssize_t n = send(fd, body + sent, body_len - sent, MSG_NOSIGNAL);
+            if (n <= 0) {
+                break;
+            }
+            sent += n;
+        }
+    }
+    free(body);
+}
+
+static void *aesd_metrics_server_func(void *arg) {
+    struct aesd_metrics_server *server = arg;
+
+    // Scrapes are rare and tiny, one at a time is plenty
+    for (;;) {
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            // shutdown() by aesd_metrics_server_stop()
+            break;
+        }
+        aesd_metrics_answer(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+int aesd_metrics_server_start(struct aesd_metrics_server *server, const char *port) {
+    struct addrinfo hints, *res;
+    int status;
+    int yes = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    // Loopback only, the counters are nobody else's business
+    if ((status = getaddrinfo("127.0.0.1", port, &hints, &res)) != 0) {
+        syslog(LOG_ERR, "Metrics getaddrinfo error: %s", gai_strerror(status));
+        return -1;
+    }
+
+    server->listen_fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (server->listen_fd == -1) {
+        syslog(LOG_ERR, "Metrics socket creation failed: %s", strerror(errno));
+        freeaddrinfo(res);
+        return -1;
+    }
+    setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+    if (bind(server->listen_fd, res->ai_addr, res->ai_addrlen) == -1 || listen(server->listen_fd, 4) == -1) {
+        syslog(LOG_ERR, "Metrics bind failed: %s", strerror(errno));
+        freeaddrinfo(res);
+        close(server->listen_fd);
+        return -1;
+    }
+    freeaddrinfo(res);
+
+    if (pthread_create(&server->thread_id, NULL, aesd_metrics_server_func, server) != 0) {
+        syslog(LOG_ERR, "Failed to create metrics thread");
+        close(server->listen_fd);
+        return -1;
+    }
+    return 0;
+}
+
+void aesd_metrics_server_stop(struct aesd_metrics_server *server) {
+    // Breaks the blocking accept(), as the signal handler does for the main socket
+    shutdown(server->listen_fd, SHUT_RDWR);
+    pthread_join(server->thread_id, NULL);
+    close(server->listen_fd);
+}
@@ -0,0 +1,111 @@
+/*
+ * aesd-metrics.h
+ *
+ *  Runtime counters of aesdsocket. Every thread updates a shard of its own,
+ *  so the hot path is a plain load and store on a cache line no other thread
+ *  writes; the shards are only summed up when somebody asks. The totals are
+ *  served in the Prometheus text format on a second, loopback only port.
+ */
+
+#ifndef AESD_METRICS_H
+#define AESD_METRICS_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+enum aesd_metric
+{
+    AESD_METRIC_CONNECTIONS_ACCEPTED,
+    AESD_METRIC_CONNECTIONS_CLOSED,
+    AESD_METRIC_CONNECTIONS_REFUSED,
+    AESD_METRIC_CONNECTIONS_EXPIRED,
+    AESD_METRIC_PACKETS_OVERSIZED,
+    AESD_METRIC_BYTES_RECEIVED,
+    AESD_METRIC_PACKETS,
+    AESD_METRIC_APPEND_ERRORS,
+    AESD_METRIC_TIMESTAMP_WRITES,
+    AESD_METRIC_COMMIT_BATCHES,
+    AESD_METRIC_LOG_DROPS,
+    AESD_METRIC_HISTORY_SEGMENTS_DROPPED,
+    AESD_METRIC_HISTORY_BYTES_DROPPED,
+    /* replayed bytes by where they were sent from, together the bytes sent */
+    AESD_METRIC_REPLAY_FILE_BYTES,
+    AESD_METRIC_REPLAY_PIPE_BYTES,
+    AESD_METRIC_REPLAY_MAP_BYTES,
+    AESD_METRIC_REPLAY_CACHE_BYTES,
+    AESD_METRIC_COUNT,
+};
+
+// file_mutex wait histogram: 1us, 4us, ... 65.5ms and +Inf
+#define AESD_METRICS_WAIT_BUCKETS 10
+#define AESD_METRICS_WAIT_FIRST_NS 1000ULL
+
+/**
+ * Counters of one thread. Only the owning thread writes them, relaxed atomics
+ * just keep the concurrent reads of a scrape well defined. A shard outlives its
+ * thread and is handed to the next thread starting up, so the counters never
+ * go back and the sum over every shard is always the process total.
+ */
+struct aesd_metrics_shard
+{
+    atomic_ulong counters[AESD_METRIC_COUNT];
+    atomic_ulong wait_buckets[AESD_METRICS_WAIT_BUCKETS];
+    atomic_ulong wait_sum_ns;
+    bool in_use;
+    struct aesd_metrics_shard *next;
+} __attribute__((aligned(64)));
+
+extern __thread struct aesd_metrics_shard *aesd_metrics_local;
+
+/**
+ * Gives the calling thread a shard, only called on its first update
+ * @return the shard, or NULL if memory ran out (the update is then dropped)
+ */
+extern struct aesd_metrics_shard *aesd_metrics_attach(void);
+
+/**
+ * Adds @param n to @param metric in the shard of the calling thread
+ */
+static inline void aesd_metrics_add(enum aesd_metric metric, unsigned long n) {
+    struct aesd_metrics_shard *shard = aesd_metrics_local;
+    if (__builtin_expect(shard == NULL, 0) && (shard = aesd_metrics_attach()) == NULL) {
+        return;
+    }
+    atomic_ulong *counter = &shard->counters[metric];
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+/**
+ * pthread_mutex_lock() on @param mutex, recording how long the caller waited for it.
+ * An uncontended lock is taken with a single trylock and counted as no wait at all.
+ * @return what pthread_mutex_lock() returned
+ */
+extern int aesd_metrics_mutex_lock(pthread_mutex_t *mutex);
+
+/**
+ * Writes the totals over every shard to @param out in the Prometheus text format
+ */
+extern void aesd_metrics_render(FILE *out);
+
+struct aesd_metrics_server
+{
+    pthread_t thread_id;
+    int listen_fd;
+};
+
+/**
+ * Starts answering every connection to 127.0.0.1 port @param port with the current metrics,
+ * wrapped in a minimal HTTP response so Prometheus, curl and nc can all read them
+ * @return 0 on success, -1 on failure (nothing is left running)
+ */
+extern int aesd_metrics_server_start(struct aesd_metrics_server *server, const char *port);
+
+/**
+ * Stops and joins the thread of @param server
+ */
+extern void aesd_metrics_server_stop(struct aesd_metrics_server *server);
+
+#endif /* AESD_METRICS_H */
@@ -0,0 +1,59 @@
+/*
+ * aesd-mpmc.h
+ *
+ *  Bounded lock-free multi-producer/multi-consumer queue of pointers,
+ *  after Dmitry Vyukov's array based design. Each cell carries a sequence
+ *  number telling producers and consumers whose turn it is, so push and
+ *  pop only contend on a single compare-and-swap of their own position.
+ */
+
+#ifndef AESD_MPMC_H
+#define AESD_MPMC_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#define AESD_CACHELINE_SIZE 64
+
+struct aesd_mpmc_cell
+{
+    atomic_size_t sequence;
+    void *data;
+};
+
+struct aesd_mpmc_queue
+{
+    struct aesd_mpmc_cell *cells;
+    /**
+     * Capacity - 1, the capacity is always a power of two
+     */
+    size_t mask;
+    /**
+     * Producer and consumer positions live on separate cache lines
+     */
+    _Alignas(AESD_CACHELINE_SIZE) atomic_size_t enqueue_pos;
+    _Alignas(AESD_CACHELINE_SIZE) atomic_size_t dequeue_pos;
+};
+
+/**
+ * Initializes @param queue with room for at least @param capacity pointers
+ * @return 0 on success, -1 if the cells could not be allocated
+ */
+extern int aesd_mpmc_init(struct aesd_mpmc_queue *queue, size_t capacity);
+
+extern void aesd_mpmc_destroy(struct aesd_mpmc_queue *queue);
+
+/**
+ * Appends @param data to @param queue without blocking
+ * @return false if the queue is full
+ */
+extern bool aesd_mpmc_push(struct aesd_mpmc_queue *queue, void *data);
+
+/**
+ * Removes the oldest pointer of @param queue into @param data_rtn without blocking
+ * @return false if the queue is empty
+ */
+extern bool aesd_mpmc_pop(struct aesd_mpmc_queue *queue, void **data_rtn);
+
+#endif /* AESD_MPMC_H */
@@ -0,0 +1,78 @@
+/*
+ * aesd-newline-bench.c
+ *
+ *  Microbenchmark for the newline scanner. Every implementation the CPU
+ *  supports, the memchr() loop included, finds all newlines of a buffer
+ *  for several line lengths; throughput is reported in MiB/s.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "aesd-newline.h"
+
+#define BENCH_BUFFER_BYTES (16 * 1024 * 1024)
+#define BENCH_POSITIONS 4096
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Finds every newline of @param buf, resuming after each full batch
+static size_t scan_all(aesd_newline_scan_fn scan, const char *buf, size_t len) {
+    static size_t positions[BENCH_POSITIONS];
+    size_t total = 0;
+    size_t offset = 0;
+
+    for (;;) {
+        size_t found = scan(buf + offset, len - offset, positions, BENCH_POSITIONS);
+        total += found;
+        if (found < BENCH_POSITIONS) {
+            return total;
+        }
+        offset += positions[found - 1] + 1;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    static const size_t line_lengths[] = { 8, 64, 1024, 65536, 0 };
+    int rounds = argc > 1 ? atoi(argv[1]) : 20;
+
+    char *buf = malloc(BENCH_BUFFER_BYTES);
+    if (buf == NULL || rounds <= 0) {
+        fprintf(stderr, "Usage: %s [rounds]\n", argv[0]);
+        return 1;
+    }
+    printf("dispatch: %s\n", aesd_newline_impl_name());
+
+    // A line length of 0 stands for a buffer without any newline
+    for (size_t l = 0; l < sizeof(line_lengths) / sizeof(line_lengths[0]); l++) {
+        size_t line = line_lengths[l];
+        size_t expected = line > 0 ? BENCH_BUFFER_BYTES / line : 0;
+
+        memset(buf, 'x', BENCH_BUFFER_BYTES);
+        for (size_t i = 0; line > 0 && i < expected; i++) {
+            buf[(i + 1) * line - 1] = '\n';
+        }
+
+        for (const struct aesd_newline_impl *impl = aesd_newline_impls(); impl->scan != NULL; impl++) {
+            size_t found = 0;
+            double start = now_seconds();
+            for (int r = 0; r < rounds; r++) {
+                found = scan_all(impl->scan, buf, BENCH_BUFFER_BYTES);
+            }
+            double elapsed = now_seconds() - start;
+
+            printf("line=%-6zu impl=%-7s %9.1f MiB/s%s\n", line, impl->name,
+                   (double)BENCH_BUFFER_BYTES * rounds / elapsed / (1024 * 1024),
+                   found == expected ? "" : "  WRONG COUNT");
+        }
+    }
+
+    free(buf);
+    return 0;
+}
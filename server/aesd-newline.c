@@ -0,0 +1,145 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "aesd-newline.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define AESD_NEWLINE_X86 1
+#include <immintrin.h>
+#endif
+
+static size_t aesd_newline_scan_scalar(const char *buf, size_t len, size_t *positions, size_t max_positions) {
+    size_t found = 0;
+    const char *cursor = buf;
+    const char *end = buf + len;
+
+    // memchr() is already word-at-a-time in any libc worth its name
+    while (found < max_positions && cursor < end) {
+        const char *newline = memchr(cursor, '\n', end - cursor);
+        if (newline == NULL) {
+            break;
+        }
+        positions[found++] = newline - buf;
+        cursor = newline + 1;
+    }
+    return found;
+}
+
+#if AESD_NEWLINE_X86
+
+// Reports the set bits of a compare mask as offsets from @param base
+static inline size_t aesd_newline_collect(uint32_t mask, size_t base, size_t *positions,
+                                          size_t found, size_t max_positions) {
+    while (mask != 0 && found < max_positions) {
+        positions[found++] = base + __builtin_ctz(mask);
+        mask &= mask - 1;
+    }
+    return found;
+}
+
+__attribute__((target("sse2")))
+static size_t aesd_newline_scan_sse2(const char *buf, size_t len, size_t *positions, size_t max_positions) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t found = 0;
+    size_t offset = 0;
+
+    // Four blocks per test, so long lines skip 64 bytes per branch
+    for (; offset + 64 <= len && found < max_positions; offset += 64) {
+        __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + offset)), newline);
+        __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + offset + 16)), newline);
+        __m128i c = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + offset + 32)), newline);
+        __m128i d = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + offset + 48)), newline);
+        if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d))) == 0) {
+            continue;
+        }
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(a) | (uint32_t)_mm_movemask_epi8(b) << 16;
+        found = aesd_newline_collect(mask, offset, positions, found, max_positions);
+        mask = (uint32_t)_mm_movemask_epi8(c) | (uint32_t)_mm_movemask_epi8(d) << 16;
+        found = aesd_newline_collect(mask, offset + 32, positions, found, max_positions);
+    }
+    for (; offset + 16 <= len && found < max_positions; offset += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(buf + offset));
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+        found = aesd_newline_collect(mask, offset, positions, found, max_positions);
+    }
+    if (found == max_positions) {
+        return found;
+    }
+
+    size_t tail = aesd_newline_scan_scalar(buf + offset, len - offset, positions + found, max_positions - found);
+    for (size_t i = found; i < found + tail; i++) {
+        positions[i] += offset;
+    }
+    return found + tail;
+}
+
+__attribute__((target("avx2")))
+static size_t aesd_newline_scan_avx2(const char *buf, size_t len, size_t *positions, size_t max_positions) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t found = 0;
+    size_t offset = 0;
+
+    // Two blocks per test, so long lines skip 64 bytes per branch
+    for (; offset + 64 <= len && found < max_positions; offset += 64) {
+        __m256i low = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + offset)), newline);
+        __m256i high = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + offset + 32)), newline);
+        if (_mm256_testz_si256(_mm256_or_si256(low, high), _mm256_or_si256(low, high))) {
+            continue;
+        }
+        found = aesd_newline_collect((uint32_t)_mm256_movemask_epi8(low), offset, positions, found, max_positions);
+        found = aesd_newline_collect((uint32_t)_mm256_movemask_epi8(high), offset + 32, positions, found, max_positions);
+    }
+    for (; offset + 32 <= len && found < max_positions; offset += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(buf + offset));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline));
+        found = aesd_newline_collect(mask, offset, positions, found, max_positions);
+    }
+    if (found == max_positions) {
+        return found;
+    }
+
+    // Less than 32 bytes left, the SSE2 loop takes most of them
+    size_t tail = aesd_newline_scan_sse2(buf + offset, len - offset, positions + found, max_positions - found);
+    for (size_t i = found; i < found + tail; i++) {
+        positions[i] += offset;
+    }
+    return found + tail;
+}
+
+#endif
+
+static const struct aesd_newline_impl *selected;
+static struct aesd_newline_impl available[4];
+
+// Runs before main(), so the dispatch never races with the threads using it
+__attribute__((constructor))
+static void aesd_newline_select(void) {
+    size_t count = 0;
+
+    available[count++] = (struct aesd_newline_impl){ "memchr", aesd_newline_scan_scalar };
+#if AESD_NEWLINE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        available[count++] = (struct aesd_newline_impl){ "sse2", aesd_newline_scan_sse2 };
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        available[count++] = (struct aesd_newline_impl){ "avx2", aesd_newline_scan_avx2 };
+    }
+#endif
+    available[count] = (struct aesd_newline_impl){ NULL, NULL };
+
+    // The last one added is the widest
+    selected = &available[count - 1];
+}
+
+size_t aesd_newline_scan(const char *buf, size_t len, size_t *positions, size_t max_positions) {
+    return selected->scan(buf, len, positions, max_positions);
+}
+
+const char *aesd_newline_impl_name(void) {
+    return selected->name;
+}
+
+const struct aesd_newline_impl *aesd_newline_impls(void) {
+    return available;
+}
@@ -0,0 +1,45 @@
+/*
+ * aesd-newline.h
+ *
+ *  Packet delimiter scanner. One pass over a chunk reports every newline
+ *  in it, comparing 32 (AVX2) or 16 (SSE2) bytes at a time where the CPU
+ *  supports it. The implementation is picked once at startup, other
+ *  architectures use the portable scalar loop.
+ */
+
+#ifndef AESD_NEWLINE_H
+#define AESD_NEWLINE_H
+
+#include <stddef.h>
+
+/**
+ * Stores the offsets of the newlines in the @param len bytes at @param buf into
+ * @param positions, in order. Scanning stops early once @param max_positions have
+ * been found, the caller resumes just past the last one.
+ * @return the number of offsets stored
+ */
+typedef size_t (*aesd_newline_scan_fn)(const char *buf, size_t len, size_t *positions, size_t max_positions);
+
+/**
+ * Best implementation for the running CPU, see aesd_newline_scan_fn
+ */
+extern size_t aesd_newline_scan(const char *buf, size_t len, size_t *positions, size_t max_positions);
+
+/**
+ * @return the name of the implementation behind aesd_newline_scan()
+ */
+extern const char *aesd_newline_impl_name(void);
+
+/**
+ * Every implementation built in, for benchmarks and tests. The table ends with an
+ * entry whose scan is NULL; entries the running CPU cannot execute are left out.
+ */
+struct aesd_newline_impl
+{
+    const char *name;
+    aesd_newline_scan_fn scan;
+};
+
+extern const struct aesd_newline_impl *aesd_newline_impls(void);
+
+#endif /* AESD_NEWLINE_H */
@@ -0,0 +1,341 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "aesdsocket.h"
+#include "aesd-pool.h"
+#include "aesd-log.h"
+
+#define POOL_MAX_EVENTS 64
+
+// How often a submit blocked on a full queue looks for a pending stop signal
+#define POOL_STOP_CHECK_MS 100
+
+// Semaphore waits are restarted when a signal interrupts them
+static int aesd_pool_wait(sem_t *sem) {
+    while (sem_wait(sem) != 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Waits for a free queue cell, giving up once SIGINT or SIGTERM is pending. The main thread
+// only unblocks them in ppoll(), so they never interrupt the wait itself.
+static int aesd_pool_wait_slot(struct aesd_pool *pool) {
+    for (;;) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += POOL_STOP_CHECK_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        if (sem_timedwait(&pool->slots, &deadline) == 0) {
+            return 0;
+        }
+        if (errno != ETIMEDOUT && errno != EINTR) {
+            return -1;
+        }
+
+        sigset_t pending;
+        sigpending(&pending);
+        if (sigismember(&pending, SIGINT) || sigismember(&pending, SIGTERM)) {
+            return -1;
+        }
+    }
+}
+
+static void aesd_pool_push(struct aesd_pool *pool, void *item) {
+    while (!aesd_mpmc_push(&pool->queue, item)) {
+        sched_yield();
+    }
+    sem_post(&pool->items);
+}
+
+static void aesd_pool_wake(struct aesd_pool *pool) {
+    uint64_t one = 1;
+    if (write(pool->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        aesd_log(LOG_ERR, "Pool wakeup failed: %s", strerror(errno));
+    }
+}
+
+// Hands a connection whose socket would block to the poller, or closes it once the poller is gone
+static void aesd_pool_park(struct aesd_pool *pool, struct aesd_conn *conn) {
+    pthread_mutex_lock(&pool->parking_lock);
+    bool stopping = pool->stopping;
+    if (!stopping) {
+        LIST_INSERT_HEAD(&pool->parking, conn, entries);
+    }
+    pthread_mutex_unlock(&pool->parking_lock);
+
+    if (stopping) {
+        aesd_conn_free(conn);
+        return;
+    }
+    aesd_pool_wake(pool);
+}
+
+static void *aesd_pool_worker(void *arg) {
+    struct aesd_pool *pool = arg;
+
+    for (;;) {
+        void *item;
+
+        aesd_pool_wait(&pool->items);
+        // The semaphores guarantee an item, but a concurrent pop may still be publishing it
+        while (!aesd_mpmc_pop(&pool->queue, &item)) {
+            sched_yield();
+        }
+        sem_post(&pool->slots);
+
+        // A NULL entry is the stop request queued by aesd_pool_stop()
+        struct aesd_conn *conn = item;
+        if (conn == NULL) {
+            break;
+        }
+
+        // Served until its socket would block, then the worker moves on to the next connection
+        if (aesd_conn_handle(conn) == AESD_CONN_WANT_CLOSE) {
+            aesd_conn_free(conn);
+        } else {
+            aesd_pool_park(pool, conn);
+        }
+    }
+    return NULL;
+}
+
+// Takes a parked connection off the poller
+static void aesd_pool_unpark(struct aesd_pool *pool, struct aesd_conn *conn) {
+    aesd_timer_cancel(&pool->timers, &conn->deadline_timer);
+    epoll_ctl(pool->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    LIST_REMOVE(conn, entries);
+}
+
+// Closes the parked connection once it missed its deadline, otherwise waits for the one it has by now
+static void aesd_pool_deadline(struct aesd_timer *timer, void *arg) {
+    struct aesd_pool *pool = arg;
+    struct aesd_conn *conn = (struct aesd_conn *)((char *)timer - offsetof(struct aesd_conn, deadline_timer));
+
+    if (!aesd_conn_expired(conn, pool->now_ms)) {
+        aesd_timer_arm(&pool->timers, timer, conn->deadline_ms);
+        return;
+    }
+    aesd_pool_unpark(pool, conn);
+    aesd_conn_free(conn);
+}
+
+static void aesd_pool_register(struct aesd_pool *pool, struct aesd_conn *conn) {
+    LIST_INSERT_HEAD(&pool->parked, conn, entries);
+    aesd_timer_init(&conn->deadline_timer, aesd_pool_deadline, pool);
+    aesd_timer_arm(&pool->timers, &conn->deadline_timer, conn->deadline_ms);
+
+    // Level-triggered and registered afresh every time it is parked: a reply waits for
+    // room in the socket buffer, anything else for bytes or the peer closing
+    struct epoll_event ev;
+    ev.events = conn->state == AESD_CONN_REPLAY ? EPOLLOUT : EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = conn;
+    if (epoll_ctl(pool->epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev) == -1) {
+        aesd_log(LOG_ERR, "epoll_ctl add failed: %s", strerror(errno));
+        aesd_timer_cancel(&pool->timers, &conn->deadline_timer);
+        LIST_REMOVE(conn, entries);
+        aesd_conn_free(conn);
+    }
+}
+
+// Registers the connections parked by the workers. Returns true once stop was requested.
+static bool aesd_pool_drain_parking(struct aesd_pool *pool) {
+    uint64_t count;
+    struct aesd_conn_list parking;
+    bool stopping;
+
+    if (read(pool->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        aesd_log(LOG_ERR, "Pool wakeup read failed: %s", strerror(errno));
+    }
+
+    LIST_INIT(&parking);
+    pthread_mutex_lock(&pool->parking_lock);
+    while (!LIST_EMPTY(&pool->parking)) {
+        struct aesd_conn *conn = LIST_FIRST(&pool->parking);
+        LIST_REMOVE(conn, entries);
+        LIST_INSERT_HEAD(&parking, conn, entries);
+    }
+    stopping = pool->stopping;
+    pthread_mutex_unlock(&pool->parking_lock);
+
+    while (!LIST_EMPTY(&parking)) {
+        struct aesd_conn *conn = LIST_FIRST(&parking);
+        LIST_REMOVE(conn, entries);
+        aesd_pool_register(pool, conn);
+    }
+
+    return stopping;
+}
+
+static void *aesd_pool_poller(void *arg) {
+    struct aesd_pool *pool = arg;
+    struct epoll_event events[POOL_MAX_EVENTS];
+    bool stopping = false;
+
+    while (!stopping) {
+        int timeout = aesd_timer_wheel_timeout(&pool->timers, aesd_timer_now_ms());
+        int n = epoll_wait(pool->epoll_fd, events, POOL_MAX_EVENTS, timeout);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            aesd_log(LOG_ERR, "epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+        pool->now_ms = aesd_timer_now_ms();
+
+        for (int i = 0; i < n; i++) {
+            struct aesd_conn *conn = events[i].data.ptr;
+
+            if (conn == NULL) {
+                stopping = aesd_pool_drain_parking(pool);
+                continue;
+            }
+
+            // Ready again, back in line for a worker. The workers keep draining the
+            // queue until the poller stopped, so a queue cell always frees up.
+            aesd_pool_unpark(pool, conn);
+            aesd_pool_wait(&pool->slots);
+            aesd_pool_push(pool, conn);
+        }
+        aesd_timer_wheel_advance(&pool->timers, pool->now_ms);
+    }
+
+    // --- POLLER CLEANUP ---
+    aesd_pool_drain_parking(pool);
+    while (!LIST_EMPTY(&pool->parked)) {
+        struct aesd_conn *conn = LIST_FIRST(&pool->parked);
+        aesd_pool_unpark(pool, conn);
+        aesd_conn_free(conn);
+    }
+    return NULL;
+}
+
+static int aesd_pool_poller_init(struct aesd_pool *pool) {
+    LIST_INIT(&pool->parking);
+    LIST_INIT(&pool->parked);
+    pthread_mutex_init(&pool->parking_lock, NULL);
+    pool->now_ms = aesd_timer_now_ms();
+    aesd_timer_wheel_init(&pool->timers, pool->now_ms);
+
+    pool->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (pool->epoll_fd == -1) {
+        syslog(LOG_ERR, "epoll_create1 failed: %s", strerror(errno));
+        return -1;
+    }
+
+    pool->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pool->wake_fd == -1) {
+        syslog(LOG_ERR, "eventfd failed: %s", strerror(errno));
+        return -1;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(pool->epoll_fd, EPOLL_CTL_ADD, pool->wake_fd, &ev) == -1) {
+        syslog(LOG_ERR, "epoll_ctl add failed: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int aesd_pool_start(struct aesd_pool *pool, unsigned int nworkers, unsigned int queue_depth) {
+    memset(pool, 0, sizeof(*pool));
+    pool->epoll_fd = -1;
+    pool->wake_fd = -1;
+
+    // Leave room for the stop entries queued behind the last connections
+    if (aesd_mpmc_init(&pool->queue, queue_depth + nworkers) != 0) {
+        syslog(LOG_ERR, "Malloc for worker queue failed");
+        return -1;
+    }
+    pool->threads = calloc(nworkers, sizeof(pthread_t));
+    if (pool->threads == NULL) {
+        syslog(LOG_ERR, "Malloc for worker threads failed");
+        aesd_mpmc_destroy(&pool->queue);
+        return -1;
+    }
+    sem_init(&pool->items, 0, 0);
+    sem_init(&pool->slots, 0, queue_depth);
+
+    if (aesd_pool_poller_init(pool) != 0) {
+        aesd_pool_stop(pool);
+        return -1;
+    }
+
+    for (pool->nthreads = 0; pool->nthreads < nworkers; pool->nthreads++) {
+        if (pthread_create(&pool->threads[pool->nthreads], NULL, aesd_pool_worker, pool) != 0) {
+            syslog(LOG_ERR, "Worker thread creation failed");
+            aesd_pool_stop(pool);
+            return -1;
+        }
+    }
+
+    if (pthread_create(&pool->poller, NULL, aesd_pool_poller, pool) != 0) {
+        syslog(LOG_ERR, "Poller thread creation failed");
+        aesd_pool_stop(pool);
+        return -1;
+    }
+    pool->poller_started = true;
+    return 0;
+}
+
+int aesd_pool_submit(struct aesd_pool *pool, struct aesd_conn *conn) {
+    // Backpressure: stop accepting while every queue cell is taken
+    if (sem_trywait(&pool->slots) != 0) {
+        aesd_log(LOG_DEBUG, "Worker queue full, delaying accept");
+        if (aesd_pool_wait_slot(pool) != 0) {
+            return -1;
+        }
+    }
+
+    aesd_pool_push(pool, conn);
+    return 0;
+}
+
+void aesd_pool_stop(struct aesd_pool *pool) {
+    // The poller goes first and closes what is parked, the workers close what they park afterwards
+    pthread_mutex_lock(&pool->parking_lock);
+    pool->stopping = true;
+    pthread_mutex_unlock(&pool->parking_lock);
+    if (pool->poller_started) {
+        aesd_pool_wake(pool);
+        pthread_join(pool->poller, NULL);
+        pool->poller_started = false;
+    }
+
+    // Stop entries bypass the slot count, the queue was sized for them
+    for (unsigned int i = 0; i < pool->nthreads; i++) {
+        aesd_pool_push(pool, NULL);
+    }
+    for (unsigned int i = 0; i < pool->nthreads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    if (pool->wake_fd != -1) {
+        close(pool->wake_fd);
+    }
+    if (pool->epoll_fd != -1) {
+        close(pool->epoll_fd);
+    }
+    pthread_mutex_destroy(&pool->parking_lock);
+    sem_destroy(&pool->items);
+    sem_destroy(&pool->slots);
+    aesd_mpmc_destroy(&pool->queue);
+    free(pool->threads);
+    pool->threads = NULL;
+    pool->nthreads = 0;
+}
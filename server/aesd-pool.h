@@ -0,0 +1,93 @@
+/*
+ * aesd-pool.h
+ *
+ *  Pre-spawned worker pool for aesdsocket. The accept loop hands accepted
+ *  connections to the workers through a bounded lock-free queue and waits
+ *  for a free slot when the queue is full, leaving further clients in the
+ *  kernel listen queue instead of piling up threads.
+ *
+ *  Workers only hold a connection while it has work: its non-blocking
+ *  socket is served until it would block, then the connection is parked
+ *  with the poller thread, which queues it again once the socket is ready
+ *  and closes it if it misses its deadline while parked. Idle clients
+ *  therefore never tie up a worker.
+ */
+
+#ifndef AESD_POOL_H
+#define AESD_POOL_H
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "aesd-conn.h"
+#include "aesd-mpmc.h"
+#include "aesd-timer.h"
+
+struct aesd_pool
+{
+    pthread_t *threads;
+    unsigned int nthreads;
+    struct aesd_mpmc_queue queue;
+    /**
+     * Counts queued connections, workers sleep on it while the queue is empty
+     */
+    sem_t items;
+    /**
+     * Counts free queue cells, the accept loop and the poller sleep on it while the queue is full
+     */
+    sem_t slots;
+    /**
+     * Thread waiting for parked connections to become ready
+     */
+    pthread_t poller;
+    bool poller_started;
+    int epoll_fd;
+    /**
+     * eventfd used to wake the poller for newly parked connections or shutdown
+     */
+    int wake_fd;
+    /**
+     * Connections parked by the workers, protected by parking_lock
+     */
+    struct aesd_conn_list parking;
+    pthread_mutex_t parking_lock;
+    /**
+     * Set once the poller is asked to stop, connections parked afterwards are closed
+     */
+    bool stopping;
+    /**
+     * Connections registered with epoll_fd, only touched by the poller
+     */
+    struct aesd_conn_list parked;
+    /**
+     * Deadlines of parked, epoll_wait() sleeps until the next one is due
+     */
+    struct aesd_timer_wheel timers;
+    /**
+     * Time of the last wakeup of the poller
+     */
+    uint64_t now_ms;
+};
+
+/**
+ * Starts @param nworkers worker threads fed by a queue of @param queue_depth connections,
+ * and the poller thread
+ * @return 0 on success, -1 on failure (nothing is left running)
+ */
+extern int aesd_pool_start(struct aesd_pool *pool, unsigned int nworkers, unsigned int queue_depth);
+
+/**
+ * Queues @param conn, whose socket must already be non-blocking, for the next idle worker,
+ * waiting while the queue is full. The pool owns the connection afterwards.
+ * @return 0 on success, -1 if SIGINT or SIGTERM arrived while waiting (the caller still owns @param conn)
+ */
+extern int aesd_pool_submit(struct aesd_pool *pool, struct aesd_conn *conn);
+
+/**
+ * Stops the poller, closing the parked connections, lets the workers finish the queued
+ * connections, then joins them and frees @param pool
+ */
+extern void aesd_pool_stop(struct aesd_pool *pool);
+
+#endif /* AESD_POOL_H */
@@ -0,0 +1,283 @@
+#define _GNU_SOURCE // accept4()
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "aesd-reactor.h"
+#include "aesd-affinity.h"
+#include "aesd-log.h"
+
+#define MAX_EVENTS 64
+
+// Connections a sharded loop accepts before serving the ones it already has
+#define MAX_ACCEPTS_PER_WAKEUP 64
+
+static void aesd_reactor_wake(struct aesd_reactor_loop *loop) {
+    uint64_t one = 1;
+    if (write(loop->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        aesd_log(LOG_ERR, "Reactor wakeup failed: %s", strerror(errno));
+    }
+}
+
+static void aesd_reactor_close(struct aesd_reactor_loop *loop, struct aesd_conn *conn) {
+    aesd_timer_cancel(&loop->timers, &conn->deadline_timer);
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    LIST_REMOVE(conn, entries);
+    aesd_conn_free(conn);
+}
+
+// Closes the connection once it missed its deadline, otherwise waits for the one it has by now
+static void aesd_reactor_deadline(struct aesd_timer *timer, void *arg) {
+    struct aesd_reactor_loop *loop = arg;
+    struct aesd_conn *conn = (struct aesd_conn *)((char *)timer - offsetof(struct aesd_conn, deadline_timer));
+
+    if (!aesd_conn_expired(conn, loop->now_ms)) {
+        aesd_timer_arm(&loop->timers, timer, conn->deadline_ms);
+        return;
+    }
+    aesd_reactor_close(loop, conn);
+}
+
+static void aesd_reactor_register(struct aesd_reactor_loop *loop, struct aesd_conn *conn) {
+    LIST_INSERT_HEAD(&loop->conns, conn, entries);
+    aesd_timer_init(&conn->deadline_timer, aesd_reactor_deadline, loop);
+    aesd_timer_arm(&loop->timers, &conn->deadline_timer, conn->deadline_ms);
+
+    // Edge-triggered with both directions armed: the state machine always runs
+    // until EAGAIN, so the interest set never needs to be modified afterwards.
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = conn;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev) == -1) {
+        aesd_log(LOG_ERR, "epoll_ctl add failed: %s", strerror(errno));
+        aesd_timer_cancel(&loop->timers, &conn->deadline_timer);
+        LIST_REMOVE(conn, entries);
+        aesd_conn_free(conn);
+    }
+}
+
+// Registers the connections queued by aesd_reactor_add(). Returns true once stop was requested.
+static bool aesd_reactor_drain_pending(struct aesd_reactor_loop *loop) {
+    uint64_t count;
+    struct aesd_conn_list pending;
+    bool stopping;
+
+    if (read(loop->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        aesd_log(LOG_ERR, "Reactor wakeup read failed: %s", strerror(errno));
+    }
+
+    LIST_INIT(&pending);
+    pthread_mutex_lock(&loop->pending_lock);
+    while (!LIST_EMPTY(&loop->pending)) {
+        struct aesd_conn *conn = LIST_FIRST(&loop->pending);
+        LIST_REMOVE(conn, entries);
+        LIST_INSERT_HEAD(&pending, conn, entries);
+    }
+    stopping = loop->stopping;
+    pthread_mutex_unlock(&loop->pending_lock);
+
+    while (!LIST_EMPTY(&pending)) {
+        struct aesd_conn *conn = LIST_FIRST(&pending);
+        LIST_REMOVE(conn, entries);
+        aesd_reactor_register(loop, conn);
+    }
+
+    return stopping;
+}
+
+// Accepts what is waiting on the listener of a sharded loop, serving the new
+// connections right here. The listener is level-triggered, leftovers come back.
+static void aesd_reactor_accept(struct aesd_reactor_loop *loop) {
+    struct sockaddr_storage addr;
+    socklen_t addr_size;
+
+    for (int i = 0; i < MAX_ACCEPTS_PER_WAKEUP; i++) {
+        addr_size = sizeof(addr);
+        int fd = accept4(loop->listen_fd, (struct sockaddr *)&addr, &addr_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                aesd_log(LOG_ERR, "Accept failed: %s", strerror(errno));
+            }
+            return;
+        }
+
+        struct aesd_conn *conn = aesd_conn_new(fd, &addr);
+        if (conn == NULL) {
+            close(fd);
+            continue;
+        }
+        aesd_reactor_register(loop, conn);
+    }
+}
+
+static void *aesd_reactor_loop_func(void *arg) {
+    struct aesd_reactor_loop *loop = arg;
+    struct epoll_event events[MAX_EVENTS];
+    bool stopping = false;
+
+    while (!stopping) {
+        int timeout = aesd_timer_wheel_timeout(&loop->timers, aesd_timer_now_ms());
+        int n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, timeout);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            aesd_log(LOG_ERR, "epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+        loop->now_ms = aesd_timer_now_ms();
+
+        for (int i = 0; i < n; i++) {
+            struct aesd_conn *conn = events[i].data.ptr;
+
+            if (conn == NULL) {
+                stopping = aesd_reactor_drain_pending(loop);
+                continue;
+            }
+            // The loop itself stands for its listener
+            if (events[i].data.ptr == loop) {
+                aesd_reactor_accept(loop);
+                continue;
+            }
+
+            if (aesd_conn_handle(conn) == AESD_CONN_WANT_CLOSE) {
+                aesd_reactor_close(loop, conn);
+            }
+        }
+        aesd_timer_wheel_advance(&loop->timers, loop->now_ms);
+    }
+
+    // --- LOOP CLEANUP ---
+    aesd_reactor_drain_pending(loop);
+    while (!LIST_EMPTY(&loop->conns)) {
+        aesd_reactor_close(loop, LIST_FIRST(&loop->conns));
+    }
+    return NULL;
+}
+
+static int aesd_reactor_loop_init(struct aesd_reactor_loop *loop, int listen_fd) {
+    LIST_INIT(&loop->pending);
+    LIST_INIT(&loop->conns);
+    pthread_mutex_init(&loop->pending_lock, NULL);
+    loop->stopping = false;
+    loop->listen_fd = listen_fd;
+    loop->now_ms = aesd_timer_now_ms();
+    aesd_timer_wheel_init(&loop->timers, loop->now_ms);
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd == -1) {
+        syslog(LOG_ERR, "epoll_create1 failed: %s", strerror(errno));
+        return -1;
+    }
+
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->wake_fd == -1) {
+        syslog(LOG_ERR, "eventfd failed: %s", strerror(errno));
+        close(loop->epoll_fd);
+        return -1;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &ev) == -1) {
+        syslog(LOG_ERR, "epoll_ctl add failed: %s", strerror(errno));
+        close(loop->wake_fd);
+        close(loop->epoll_fd);
+        return -1;
+    }
+
+    if (listen_fd != -1) {
+        ev.events = EPOLLIN;
+        ev.data.ptr = loop;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) == -1) {
+            syslog(LOG_ERR, "epoll_ctl add failed: %s", strerror(errno));
+            close(loop->wake_fd);
+            close(loop->epoll_fd);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void aesd_reactor_loop_destroy(struct aesd_reactor_loop *loop) {
+    close(loop->wake_fd);
+    close(loop->epoll_fd);
+    pthread_mutex_destroy(&loop->pending_lock);
+}
+
+int aesd_reactor_start(struct aesd_reactor *reactor, unsigned int nloops, const int *listen_fds,
+                       bool pin_cpus) {
+    unsigned int started = 0;
+
+    reactor->loops = calloc(nloops, sizeof(struct aesd_reactor_loop));
+    if (reactor->loops == NULL) {
+        syslog(LOG_ERR, "Malloc for reactor loops failed");
+        return -1;
+    }
+    reactor->nloops = nloops;
+    reactor->next_loop = 0;
+
+    for (started = 0; started < nloops; started++) {
+        struct aesd_reactor_loop *loop = &reactor->loops[started];
+        if (aesd_reactor_loop_init(loop, listen_fds != NULL ? listen_fds[started] : -1) != 0) {
+            break;
+        }
+        if (pthread_create(&loop->thread_id, NULL, aesd_reactor_loop_func, loop) != 0) {
+            syslog(LOG_ERR, "Reactor thread creation failed");
+            aesd_reactor_loop_destroy(loop);
+            break;
+        }
+        if (pin_cpus) {
+            aesd_affinity_pin(loop->thread_id, started);
+        }
+    }
+
+    if (started < nloops) {
+        reactor->nloops = started;
+        aesd_reactor_stop(reactor);
+        return -1;
+    }
+    return 0;
+}
+
+int aesd_reactor_add(struct aesd_reactor *reactor, struct aesd_conn *conn) {
+    struct aesd_reactor_loop *loop = &reactor->loops[reactor->next_loop];
+    reactor->next_loop = (reactor->next_loop + 1) % reactor->nloops;
+
+    pthread_mutex_lock(&loop->pending_lock);
+    if (loop->stopping) {
+        pthread_mutex_unlock(&loop->pending_lock);
+        return -1;
+    }
+    LIST_INSERT_HEAD(&loop->pending, conn, entries);
+    pthread_mutex_unlock(&loop->pending_lock);
+
+    aesd_reactor_wake(loop);
+    return 0;
+}
+
+void aesd_reactor_stop(struct aesd_reactor *reactor) {
+    for (unsigned int i = 0; i < reactor->nloops; i++) {
+        struct aesd_reactor_loop *loop = &reactor->loops[i];
+        pthread_mutex_lock(&loop->pending_lock);
+        loop->stopping = true;
+        pthread_mutex_unlock(&loop->pending_lock);
+        aesd_reactor_wake(loop);
+    }
+
+    for (unsigned int i = 0; i < reactor->nloops; i++) {
+        pthread_join(reactor->loops[i].thread_id, NULL);
+        aesd_reactor_loop_destroy(&reactor->loops[i]);
+    }
+
+    free(reactor->loops);
+    reactor->loops = NULL;
+    reactor->nloops = 0;
+}
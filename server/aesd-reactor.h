@@ -0,0 +1,83 @@
+/*
+ * aesd-reactor.h
+ *
+ *  Edge-triggered epoll reactor: a small fixed set of event loop threads
+ *  multiplexing every client connection. Connections are either handed over
+ *  by the accept loop of main(), or, with sharded listeners, accepted by
+ *  every loop from a SO_REUSEPORT socket of its own.
+ */
+
+#ifndef AESD_REACTOR_H
+#define AESD_REACTOR_H
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/queue.h>
+
+#include "aesd-conn.h"
+#include "aesd-timer.h"
+
+struct aesd_reactor_loop
+{
+    pthread_t thread_id;
+    int epoll_fd;
+    /**
+     * eventfd used to wake the loop for new connections or shutdown
+     */
+    int wake_fd;
+    /**
+     * Connections handed over by the accept loop, protected by pending_lock
+     */
+    struct aesd_conn_list pending;
+    pthread_mutex_t pending_lock;
+    bool stopping;
+    /**
+     * Listener this loop accepts from itself, -1 if it is fed by aesd_reactor_add()
+     */
+    int listen_fd;
+    /**
+     * Connections registered with epoll_fd, only touched by the loop thread
+     */
+    struct aesd_conn_list conns;
+    /**
+     * Deadlines of conns, epoll_wait() sleeps until the next one is due
+     */
+    struct aesd_timer_wheel timers;
+    /**
+     * Time of the last wakeup
+     */
+    uint64_t now_ms;
+};
+
+struct aesd_reactor
+{
+    struct aesd_reactor_loop *loops;
+    unsigned int nloops;
+    /**
+     * Round-robin cursor used by aesd_reactor_add()
+     */
+    unsigned int next_loop;
+};
+
+/**
+ * Starts @param nloops event loop threads for @param reactor. If @param listen_fds is not
+ * NULL, loop i accepts on its own from the non-blocking listener listen_fds[i], which stays
+ * owned by the caller. With @param pin_cpus loop i is pinned to the i-th CPU.
+ * @return 0 on success, -1 on failure (nothing is left running)
+ */
+extern int aesd_reactor_start(struct aesd_reactor *reactor, unsigned int nloops, const int *listen_fds,
+                              bool pin_cpus);
+
+/**
+ * Hands @param conn, whose socket must already be non-blocking, to one of the loops.
+ * The reactor owns the connection afterwards.
+ * @return 0 on success, -1 if the connection could not be queued (the caller still owns it)
+ */
+extern int aesd_reactor_add(struct aesd_reactor *reactor, struct aesd_conn *conn);
+
+/**
+ * Stops and joins every loop of @param reactor, freeing the connections it still owns
+ */
+extern void aesd_reactor_stop(struct aesd_reactor *reactor);
+
+#endif /* AESD_REACTOR_H */
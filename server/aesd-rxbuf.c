@@ -0,0 +1,144 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "aesd-rxbuf.h"
+
+// Pooled storage always has exactly AESD_RXBUF_POOL_MAX_CAPACITY bytes, so a
+// recycled buffer never needs to grow for small packets
+struct aesd_rxbuf_pool
+{
+    char *entries[AESD_RXBUF_POOL_DEPTH];
+    size_t count;
+    pthread_mutex_t lock;
+};
+
+static struct aesd_rxbuf_pool global_pool = {
+    .count = 0,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// Reactor loops and pool workers live for the whole run and recycle without
+// locking; short lived connection threads mostly go through the global pool
+static __thread char *thread_cache[AESD_RXBUF_THREAD_CACHE];
+static __thread size_t thread_cache_count;
+
+// Hands the cache of an exiting thread over to the global pool
+static pthread_key_t thread_cache_key;
+static pthread_once_t thread_cache_once = PTHREAD_ONCE_INIT;
+
+static void aesd_rxbuf_global_put(char *data) {
+    pthread_mutex_lock(&global_pool.lock);
+    if (global_pool.count < AESD_RXBUF_POOL_DEPTH) {
+        global_pool.entries[global_pool.count++] = data;
+        data = NULL;
+    }
+    pthread_mutex_unlock(&global_pool.lock);
+
+    free(data);
+}
+
+static void aesd_rxbuf_thread_exit(void *arg) {
+    (void)arg;
+    while (thread_cache_count > 0) {
+        aesd_rxbuf_global_put(thread_cache[--thread_cache_count]);
+    }
+}
+
+static void aesd_rxbuf_key_init(void) {
+    pthread_key_create(&thread_cache_key, aesd_rxbuf_thread_exit);
+}
+
+static char *aesd_rxbuf_pool_get(void) {
+    char *data = NULL;
+
+    if (thread_cache_count > 0) {
+        return thread_cache[--thread_cache_count];
+    }
+
+    pthread_mutex_lock(&global_pool.lock);
+    if (global_pool.count > 0) {
+        data = global_pool.entries[--global_pool.count];
+    }
+    pthread_mutex_unlock(&global_pool.lock);
+
+    if (data == NULL) {
+        data = malloc(AESD_RXBUF_POOL_MAX_CAPACITY);
+    }
+    return data;
+}
+
+static void aesd_rxbuf_pool_put(char *data) {
+    if (thread_cache_count < AESD_RXBUF_THREAD_CACHE) {
+        if (thread_cache_count == 0) {
+            // The destructor only runs for threads with a non-NULL value
+            pthread_once(&thread_cache_once, aesd_rxbuf_key_init);
+            pthread_setspecific(thread_cache_key, thread_cache);
+        }
+        thread_cache[thread_cache_count++] = data;
+        return;
+    }
+    aesd_rxbuf_global_put(data);
+}
+
+int aesd_rxbuf_reserve(struct aesd_rxbuf *buf, size_t min_free) {
+    if (buf->capacity - buf->len >= min_free) {
+        return 0;
+    }
+
+    if (buf->data == NULL && min_free <= AESD_RXBUF_POOL_MAX_CAPACITY) {
+        buf->data = aesd_rxbuf_pool_get();
+        if (buf->data == NULL) {
+            return -1;
+        }
+        buf->capacity = AESD_RXBUF_POOL_MAX_CAPACITY;
+        return 0;
+    }
+
+    // Consumed packets leave room at the front, reuse it before growing
+    if (buf->start > 0) {
+        buf->len -= buf->start;
+        memmove(buf->data, buf->data + buf->start, buf->len);
+        buf->start = 0;
+        if (buf->capacity - buf->len >= min_free) {
+            return 0;
+        }
+    }
+
+    // Doubling keeps the copying linear in the packet size
+    size_t capacity = buf->capacity > 0 ? buf->capacity : AESD_RXBUF_MIN_CAPACITY;
+    while (capacity - buf->len < min_free) {
+        capacity *= 2;
+    }
+
+    char *data = realloc(buf->data, capacity);
+    if (data == NULL) {
+        return -1;
+    }
+    buf->data = data;
+    buf->capacity = capacity;
+    return 0;
+}
+
+void aesd_rxbuf_consume(struct aesd_rxbuf *buf, size_t len) {
+    buf->start += len;
+    if (buf->start == buf->len) {
+        buf->start = 0;
+        buf->len = 0;
+    }
+}
+
+void aesd_rxbuf_release(struct aesd_rxbuf *buf) {
+    if (buf->data != NULL) {
+        // Storage that grew past the pooled size is not worth keeping around
+        if (buf->capacity == AESD_RXBUF_POOL_MAX_CAPACITY) {
+            aesd_rxbuf_pool_put(buf->data);
+        } else {
+            free(buf->data);
+        }
+    }
+    buf->data = NULL;
+    buf->start = 0;
+    buf->len = 0;
+    buf->capacity = 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * aesd-rxbuf.h
+ *
+ *  Receive buffer of a connection. recv() writes straight into its free
+ *  tail and complete packets are consumed from its front, so pipelined
+ *  packets are carried over without copying each time. The storage doubles
+ *  whenever it runs out, and storage of idle or finished connections is
+ *  recycled, first through a per-thread cache and then through a small
+ *  process-wide free list.
+ */
+
+#ifndef AESD_RXBUF_H
+#define AESD_RXBUF_H
+
+#include <stddef.h>
+
+// Smallest storage handed out, and the most any pooled buffer keeps
+#define AESD_RXBUF_MIN_CAPACITY (4 * 1024)
+#define AESD_RXBUF_POOL_MAX_CAPACITY (64 * 1024)
+
+// Buffers kept per thread and process-wide
+#define AESD_RXBUF_THREAD_CACHE 4
+#define AESD_RXBUF_POOL_DEPTH 64
+
+struct aesd_rxbuf
+{
+    char *data;
+    /**
+     * Offset of the first byte not consumed yet
+     */
+    size_t start;
+    /**
+     * Offset just past the last byte received, data[start, len) is pending
+     */
+    size_t len;
+    size_t capacity;
+};
+
+/**
+ * Makes sure @param buf has room for at least @param min_free more bytes past len,
+ * taking pooled storage for an empty buffer, moving pending bytes to the front or
+ * doubling the capacity otherwise
+ * @return 0 on success, -1 if memory ran out (@param buf is left untouched)
+ */
+extern int aesd_rxbuf_reserve(struct aesd_rxbuf *buf, size_t min_free);
+
+/**
+ * @return a pointer to the free tail of @param buf, capacity - len bytes long
+ */
+static inline char *aesd_rxbuf_tail(struct aesd_rxbuf *buf) {
+    return buf->data + buf->len;
+}
+
+/**
+ * @return the number of bytes received into @param buf and not consumed yet
+ */
+static inline size_t aesd_rxbuf_pending(const struct aesd_rxbuf *buf) {
+    return buf->len - buf->start;
+}
+
+/**
+ * Drops the first @param len pending bytes of @param buf
+ */
+extern void aesd_rxbuf_consume(struct aesd_rxbuf *buf, size_t len);
+
+/**
+ * Returns the storage of @param buf to the pool (or the allocator if it is too big
+ * or the pool is full), @param buf is empty afterwards
+ */
+extern void aesd_rxbuf_release(struct aesd_rxbuf *buf);
+
+#endif /* AESD_RXBUF_H */
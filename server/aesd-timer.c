@@ -0,0 +1,188 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
+#include "aesd-timer.h"
+
+uint64_t aesd_timer_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void aesd_timer_wheel_init(struct aesd_timer_wheel *wheel, uint64_t now_ms) {
+    for (size_t i = 0; i < AESD_TIMER_WHEEL_SLOTS; i++) {
+        LIST_INIT(&wheel->slots[i]);
+    }
+    memset(wheel->busy, 0, sizeof(wheel->busy));
+    wheel->now = now_ms / AESD_TIMER_TICK_MS;
+    wheel->armed = 0;
+}
+
+void aesd_timer_init(struct aesd_timer *timer, aesd_timer_fn fn, void *arg) {
+    timer->expires = 0;
+    timer->fn = fn;
+    timer->arg = arg;
+    timer->armed = false;
+}
+
+static void aesd_timer_unlink(struct aesd_timer_wheel *wheel, struct aesd_timer *timer) {
+    size_t slot = timer->expires % AESD_TIMER_WHEEL_SLOTS;
+
+    LIST_REMOVE(timer, entries);
+    if (LIST_EMPTY(&wheel->slots[slot])) {
+        wheel->busy[slot / 64] &= ~(1ULL << (slot % 64));
+    }
+    timer->armed = false;
+    wheel->armed--;
+}
+
+void aesd_timer_arm(struct aesd_timer_wheel *wheel, struct aesd_timer *timer, uint64_t expires_ms) {
+    // Rounded up, a timer never fires early; one already due fires on the next advance
+    uint64_t expires = (expires_ms + AESD_TIMER_TICK_MS - 1) / AESD_TIMER_TICK_MS;
+    if (expires <= wheel->now) {
+        expires = wheel->now + 1;
+    }
+
+    if (timer->armed) {
+        aesd_timer_unlink(wheel, timer);
+    }
+    size_t slot = expires % AESD_TIMER_WHEEL_SLOTS;
+    timer->expires = expires;
+    timer->armed = true;
+    LIST_INSERT_HEAD(&wheel->slots[slot], timer, entries);
+    wheel->busy[slot / 64] |= 1ULL << (slot % 64);
+    wheel->armed++;
+}
+
+void aesd_timer_cancel(struct aesd_timer_wheel *wheel, struct aesd_timer *timer) {
+    if (timer->armed) {
+        aesd_timer_unlink(wheel, timer);
+    }
+}
+
+// Ticks from wheel->now to the next slot holding a timer, at most one turn
+static uint64_t aesd_timer_next_busy(const struct aesd_timer_wheel *wheel) {
+    size_t start = (wheel->now + 1) % AESD_TIMER_WHEEL_SLOTS;
+    size_t words = AESD_TIMER_WHEEL_SLOTS / 64;
+
+    // One extra word, the first one is looked at again for the bits below start
+    for (size_t i = 0; i <= words; i++) {
+        size_t word = (start / 64 + i) % words;
+        uint64_t bits = wheel->busy[word];
+        if (i == 0) {
+            bits &= ~0ULL << (start % 64);
+        } else if (i == words) {
+            bits &= (1ULL << (start % 64)) - 1;
+        }
+        if (bits != 0) {
+            size_t slot = word * 64 + __builtin_ctzll(bits);
+            return (slot + AESD_TIMER_WHEEL_SLOTS - start) % AESD_TIMER_WHEEL_SLOTS + 1;
+        }
+    }
+    return AESD_TIMER_WHEEL_SLOTS;
+}
+
+int aesd_timer_wheel_timeout(const struct aesd_timer_wheel *wheel, uint64_t now_ms) {
+    if (wheel->armed == 0) {
+        return -1;
+    }
+
+    // The slot may only hold timers of a later turn, waking up for nothing then is cheap
+    uint64_t due_ms = (wheel->now + aesd_timer_next_busy(wheel)) * AESD_TIMER_TICK_MS;
+    return due_ms > now_ms ? (int)(due_ms - now_ms) : 0;
+}
+
+void aesd_timer_wheel_advance(struct aesd_timer_wheel *wheel, uint64_t now_ms) {
+    uint64_t target = now_ms / AESD_TIMER_TICK_MS;
+    struct aesd_timer_list expired;
+
+    if (target <= wheel->now) {
+        return;
+    }
+
+    // Collected first, callbacks are free to arm and cancel timers of this wheel
+    LIST_INIT(&expired);
+    uint64_t ticks = target - wheel->now;
+    if (ticks > AESD_TIMER_WHEEL_SLOTS) {
+        ticks = AESD_TIMER_WHEEL_SLOTS;
+    }
+    for (uint64_t tick = target - ticks + 1; tick <= target && wheel->armed > 0; tick++) {
+        struct aesd_timer *timer = LIST_FIRST(&wheel->slots[tick % AESD_TIMER_WHEEL_SLOTS]);
+        while (timer != NULL) {
+            struct aesd_timer *next = LIST_NEXT(timer, entries);
+            if (timer->expires <= target) {
+                aesd_timer_unlink(wheel, timer);
+                LIST_INSERT_HEAD(&expired, timer, entries);
+            }
+            timer = next;
+        }
+    }
+    wheel->now = target;
+
+    while (!LIST_EMPTY(&expired)) {
+        struct aesd_timer *timer = LIST_FIRST(&expired);
+        LIST_REMOVE(timer, entries);
+        timer->fn(timer, timer->arg);
+    }
+}
+
+static void *aesd_timer_service_func(void *arg) {
+    struct aesd_timer_service *service = arg;
+    struct pollfd wake = { .fd = service->wake_fd, .events = POLLIN };
+
+    while (!atomic_load(&service->stopping)) {
+        int timeout = aesd_timer_wheel_timeout(&service->wheel, aesd_timer_now_ms());
+        if (poll(&wake, 1, timeout) == -1 && errno != EINTR) {
+            syslog(LOG_ERR, "Timer poll failed: %s", strerror(errno));
+            break;
+        }
+        if (atomic_load(&service->stopping)) {
+            break;
+        }
+        aesd_timer_wheel_advance(&service->wheel, aesd_timer_now_ms());
+    }
+    return NULL;
+}
+
+int aesd_timer_service_init(struct aesd_timer_service *service) {
+    aesd_timer_wheel_init(&service->wheel, aesd_timer_now_ms());
+    atomic_init(&service->stopping, false);
+    service->started = false;
+
+    service->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (service->wake_fd == -1) {
+        syslog(LOG_ERR, "eventfd failed: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int aesd_timer_service_start(struct aesd_timer_service *service) {
+    if (pthread_create(&service->thread_id, NULL, aesd_timer_service_func, service) != 0) {
+        syslog(LOG_ERR, "Failed to create timer thread");
+        return -1;
+    }
+    service->started = true;
+    return 0;
+}
+
+void aesd_timer_service_stop(struct aesd_timer_service *service) {
+    uint64_t one = 1;
+
+    if (service->started) {
+        atomic_store(&service->stopping, true);
+        if (write(service->wake_fd, &one, sizeof(one)) == -1) {
+            syslog(LOG_ERR, "Timer wakeup failed: %s", strerror(errno));
+        }
+        pthread_join(service->thread_id, NULL);
+        service->started = false;
+    }
+    close(service->wake_fd);
+    service->wake_fd = -1;
+}
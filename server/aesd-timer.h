@@ -0,0 +1,136 @@
+/*
+ * aesd-timer.h
+ *
+ *  Hashed timer wheel and the thread driving the server-wide timers.
+ *  A wheel belongs to a single thread, which asks it how long it may sleep
+ *  and advances it after waking up: arming, re-arming and cancelling a
+ *  timer are O(1), so an event loop can keep one per connection. Timers
+ *  further out than one turn of the wheel are simply skipped until their
+ *  turn comes.
+ */
+
+#ifndef AESD_TIMER_H
+#define AESD_TIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/queue.h>
+
+// Resolution of every timer, expiry times are rounded up to a whole tick
+#define AESD_TIMER_TICK_MS 10
+
+// Slots of a wheel, one turn covers AESD_TIMER_WHEEL_SLOTS * AESD_TIMER_TICK_MS
+#define AESD_TIMER_WHEEL_SLOTS 512
+
+struct aesd_timer;
+
+/**
+ * Called by aesd_timer_wheel_advance() once @param timer expired. It is disarmed
+ * by then and may be armed again, or freed, right away.
+ */
+typedef void (*aesd_timer_fn)(struct aesd_timer *timer, void *arg);
+
+struct aesd_timer
+{
+    /**
+     * Tick the timer fires at, only valid while armed
+     */
+    uint64_t expires;
+    aesd_timer_fn fn;
+    void *arg;
+    bool armed;
+    LIST_ENTRY(aesd_timer) entries;
+};
+
+LIST_HEAD(aesd_timer_list, aesd_timer);
+
+struct aesd_timer_wheel
+{
+    struct aesd_timer_list slots[AESD_TIMER_WHEEL_SLOTS];
+    /**
+     * Bit i is set while slots[i] is not empty, so the next busy slot is found
+     * without walking the empty ones
+     */
+    uint64_t busy[AESD_TIMER_WHEEL_SLOTS / 64];
+    /**
+     * Every tick up to here has been handled
+     */
+    uint64_t now;
+    size_t armed;
+};
+
+/**
+ * @return the CLOCK_MONOTONIC time in milliseconds, the clock every wheel runs on
+ */
+extern uint64_t aesd_timer_now_ms(void);
+
+/**
+ * Initializes @param wheel empty, as of @param now_ms
+ */
+extern void aesd_timer_wheel_init(struct aesd_timer_wheel *wheel, uint64_t now_ms);
+
+/**
+ * Initializes @param timer disarmed, to call @param fn with @param arg once it expires
+ */
+extern void aesd_timer_init(struct aesd_timer *timer, aesd_timer_fn fn, void *arg);
+
+/**
+ * Arms @param timer on @param wheel to fire at @param expires_ms, moving it if it was armed already
+ */
+extern void aesd_timer_arm(struct aesd_timer_wheel *wheel, struct aesd_timer *timer, uint64_t expires_ms);
+
+/**
+ * Disarms @param timer if it is armed on @param wheel
+ */
+extern void aesd_timer_cancel(struct aesd_timer_wheel *wheel, struct aesd_timer *timer);
+
+/**
+ * @return how many milliseconds after @param now_ms the owner of @param wheel has to call
+ * aesd_timer_wheel_advance() again, or -1 if no timer is armed
+ */
+extern int aesd_timer_wheel_timeout(const struct aesd_timer_wheel *wheel, uint64_t now_ms);
+
+/**
+ * Fires every timer of @param wheel that expired by @param now_ms
+ */
+extern void aesd_timer_wheel_advance(struct aesd_timer_wheel *wheel, uint64_t now_ms);
+
+/**
+ * Thread running the timers that are not tied to a connection
+ */
+struct aesd_timer_service
+{
+    pthread_t thread_id;
+    /**
+     * Timers are armed here before aesd_timer_service_start(), afterwards only from their callbacks
+     */
+    struct aesd_timer_wheel wheel;
+    /**
+     * eventfd aesd_timer_service_stop() wakes the thread with
+     */
+    int wake_fd;
+    atomic_bool stopping;
+    bool started;
+};
+
+/**
+ * Initializes @param service with an empty wheel
+ * @return 0 on success, -1 on failure
+ */
+extern int aesd_timer_service_init(struct aesd_timer_service *service);
+
+/**
+ * Starts the thread firing the timers armed on @param service
+ * @return 0 on success, -1 on failure
+ */
+extern int aesd_timer_service_start(struct aesd_timer_service *service);
+
+/**
+ * Wakes and joins the thread of @param service, if it was started, without waiting for its
+ * next timer, then releases what aesd_timer_service_init() set up
+ */
+extern void aesd_timer_service_stop(struct aesd_timer_service *service);
+
+#endif /* AESD_TIMER_H */
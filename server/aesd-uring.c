@@ -0,0 +1,781 @@
+#define _GNU_SOURCE // F_SETPIPE_SZ, SPLICE_F_MOVE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <syslog.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/queue.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <linux/io_uring.h>
+
+#include "aesdsocket.h"
+#include "aesd-conn.h"
+#include "aesd-uring.h"
+#include "aesd-affinity.h"
+#include "aesd-timer.h"
+#include "aesd-metrics.h"
+#include "aesd-log.h"
+
+// Multishot accept and provided buffer rings need Linux 5.19 headers
+#ifdef IORING_ACCEPT_MULTISHOT
+
+// Submission queue entries per ring, completions get twice as many
+#define AESD_URING_ENTRIES 256
+
+// Provided receive buffers per ring, the count must be a power of two
+#define AESD_URING_BUF_COUNT 256
+#define AESD_URING_BUF_SIZE (16 * 1024)
+
+struct aesd_uring_conn;
+LIST_HEAD(aesd_uring_conn_list, aesd_uring_conn);
+
+struct aesd_uring_loop
+{
+    pthread_t thread_id;
+    int ring_fd;
+    /**
+     * Submission queue shared with the kernel; sq_local counts the entries
+     * prepared so far, they are published to sq_tail when the loop enters the kernel
+     */
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    unsigned int sq_local;
+    struct io_uring_sqe *sqes;
+    /**
+     * Completion queue shared with the kernel
+     */
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    /**
+     * Provided buffer ring the kernel picks receive buffers from
+     */
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    char *buf_data;
+    uint16_t buf_tail;
+    int listen_fd;
+    bool accept_armed;
+    /**
+     * eventfd read by the ring, written by aesd_uring_stop()
+     */
+    int wake_fd;
+    uint64_t wake_value;
+    atomic_bool stopping;
+    /**
+     * Connections accepted by this ring, only touched by the loop thread
+     */
+    struct aesd_uring_conn_list conns;
+    /**
+     * Deadlines of conns, the ring is entered with a timeout until the next one is due
+     */
+    struct aesd_timer_wheel timers;
+};
+
+// iovecs gathered per sendmsg() submission
+#define URING_IOV_COUNT 64
+
+// Largest chunk spliced at once from the data log
+#define URING_SPLICE_CHUNK (1024 * 1024)
+
+// The only buffer group of a ring
+#define URING_BUF_GROUP 0
+
+// What a completion belongs to, kept in the low bits of user_data. Connection
+// operations carry the connection pointer above them (malloc() aligns to 8).
+enum aesd_uring_op
+{
+    URING_OP_ACCEPT = 1,
+    URING_OP_WAKE,
+    URING_OP_RECV,
+    URING_OP_SEND,
+    URING_OP_SPLICE_IN,     /* data log into the connection pipe, linked to the next one */
+    URING_OP_SPLICE_OUT,    /* connection pipe into the socket */
+    URING_OP_SPLICE_REPLAY, /* char device snapshot pipe into the socket */
+    URING_OP_CANCEL,
+};
+#define URING_OP_MASK 7
+
+struct aesd_uring_conn
+{
+    struct aesd_conn *conn;
+    struct aesd_uring_loop *loop;
+    /**
+     * Operations submitted and not completed yet; the connection only moves on,
+     * or is freed, once this drops to zero
+     */
+    unsigned int inflight;
+    bool closing;
+    /**
+     * Must stay valid until the sendmsg() completes
+     */
+    struct msghdr msg;
+    struct iovec iov[URING_IOV_COUNT];
+    /**
+     * Pipe the history older than the cache is spliced through, created on first use.
+     * pipe_fill counts the bytes spliced in and not out yet.
+     */
+    int pipe_fds[2];
+    size_t pipe_size;
+    size_t pipe_fill;
+    LIST_ENTRY(aesd_uring_conn) entries;
+};
+
+static int aesd_uring_setup(unsigned int entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int aesd_uring_enter(int ring_fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags,
+                            struct io_uring_getevents_arg *arg) {
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, arg, arg != NULL ? sizeof(*arg) : 0);
+}
+
+static int aesd_uring_register(int ring_fd, unsigned int opcode, void *arg, unsigned int nr_args) {
+    return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+// Publishes the prepared entries and lets the kernel consume them, optionally
+// waiting for @param min_complete completions, but no longer than @param timeout_ms
+// unless that is -1
+static int aesd_uring_submit(struct aesd_uring_loop *loop, unsigned int min_complete, int timeout_ms) {
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    unsigned int flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+
+    __atomic_store_n(loop->sq_tail, loop->sq_local, __ATOMIC_RELEASE);
+    unsigned int to_submit = loop->sq_local - __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE);
+
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+    int rc = aesd_uring_enter(loop->ring_fd, to_submit, min_complete, flags, timeout_ms >= 0 ? &arg : NULL);
+    if (rc == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY && errno != ETIME) {
+        aesd_log(LOG_ERR, "io_uring_enter failed: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static struct io_uring_sqe *aesd_uring_get_sqe(struct aesd_uring_loop *loop) {
+    // A full queue is pushed to the kernel first, it always frees up room
+    while (loop->sq_local - __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE) >= loop->sq_entries) {
+        aesd_uring_submit(loop, 0, -1);
+    }
+
+    struct io_uring_sqe *sqe = &loop->sqes[loop->sq_local & loop->sq_mask];
+    loop->sq_local++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static uint64_t aesd_uring_tag(struct aesd_uring_conn *uconn, enum aesd_uring_op op) {
+    return (uint64_t)(uintptr_t)uconn | op;
+}
+
+static void aesd_uring_arm_accept(struct aesd_uring_loop *loop) {
+    struct io_uring_sqe *sqe = aesd_uring_get_sqe(loop);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = URING_OP_ACCEPT;
+    loop->accept_armed = true;
+}
+
+static void aesd_uring_arm_wake(struct aesd_uring_loop *loop) {
+    struct io_uring_sqe *sqe = aesd_uring_get_sqe(loop);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = loop->wake_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&loop->wake_value;
+    sqe->len = sizeof(loop->wake_value);
+    sqe->user_data = URING_OP_WAKE;
+}
+
+// Hands receive buffer @param bid back to the kernel
+static void aesd_uring_recycle_buffer(struct aesd_uring_loop *loop, uint16_t bid) {
+    struct io_uring_buf *buf = &loop->buf_ring->bufs[loop->buf_tail & (AESD_URING_BUF_COUNT - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(loop->buf_data + (size_t)bid * AESD_URING_BUF_SIZE);
+    buf->len = AESD_URING_BUF_SIZE;
+    buf->bid = bid;
+    loop->buf_tail++;
+    __atomic_store_n(&loop->buf_ring->tail, loop->buf_tail, __ATOMIC_RELEASE);
+}
+
+static void aesd_uring_prep_recv(struct aesd_uring_loop *loop, struct aesd_uring_conn *uconn) {
+    struct io_uring_sqe *sqe = aesd_uring_get_sqe(loop);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = uconn->conn->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = aesd_uring_tag(uconn, URING_OP_RECV);
+    uconn->inflight++;
+}
+
+static void aesd_uring_prep_splice(struct aesd_uring_loop *loop, struct aesd_uring_conn *uconn,
+                                   enum aesd_uring_op op, int fd_in, int64_t off_in, int fd_out,
+                                   size_t len, unsigned int flags) {
+    struct io_uring_sqe *sqe = aesd_uring_get_sqe(loop);
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->fd = fd_out;
+    sqe->off = (uint64_t)-1;
+    sqe->splice_fd_in = fd_in;
+    sqe->splice_off_in = (uint64_t)off_in;
+    sqe->len = len;
+    sqe->splice_flags = SPLICE_F_MOVE;
+    sqe->flags = flags;
+    sqe->user_data = aesd_uring_tag(uconn, op);
+    uconn->inflight++;
+}
+
+static int aesd_uring_conn_pipe(struct aesd_uring_conn *uconn) {
+    if (uconn->pipe_fds[0] != -1) {
+        return 0;
+    }
+    if (pipe2(uconn->pipe_fds, O_CLOEXEC) != 0) {
+        aesd_log(LOG_ERR, "pipe2 failed: %s", strerror(errno));
+        return -1;
+    }
+    int size = fcntl(uconn->pipe_fds[1], F_SETPIPE_SZ, REPLAY_PIPE_SIZE);
+    if (size == -1) {
+        size = fcntl(uconn->pipe_fds[1], F_GETPIPE_SZ);
+    }
+    uconn->pipe_size = size > 0 ? (size_t)size : 4096;
+    return 0;
+}
+
+// Submits the next step of the reply, or returns false once it is complete
+static bool aesd_uring_prep_replay(struct aesd_uring_loop *loop, struct aesd_uring_conn *uconn) {
+    struct aesd_conn *conn = uconn->conn;
+    struct aesd_replay *replay = &conn->replay;
+
+    // Bytes a short splice left in the pipe go out before anything else
+    if (uconn->pipe_fill > 0) {
+        aesd_uring_prep_splice(loop, uconn, URING_OP_SPLICE_OUT, uconn->pipe_fds[0], -1, conn->fd,
+                               uconn->pipe_fill, 0);
+        return true;
+    }
+
+    if (replay->file_remaining > 0) {
+        if (aesd_uring_conn_pipe(uconn) != 0) {
+            uconn->closing = true;
+            return true;
+        }
+        size_t chunk = replay->file_remaining;
+        if (chunk > uconn->pipe_size) {
+            chunk = uconn->pipe_size;
+        }
+        // One submission, two splices: the second only starts once the first filled the pipe
+        aesd_uring_prep_splice(loop, uconn, URING_OP_SPLICE_IN, replay->file_fd, replay->file_offset,
+                               uconn->pipe_fds[1], chunk, IOSQE_IO_LINK);
+        aesd_uring_prep_splice(loop, uconn, URING_OP_SPLICE_OUT, uconn->pipe_fds[0], -1, conn->fd, chunk, 0);
+        return true;
+    }
+
+    if (replay->pipe_remaining > 0) {
+        size_t chunk = replay->pipe_remaining > URING_SPLICE_CHUNK ? URING_SPLICE_CHUNK : replay->pipe_remaining;
+        aesd_uring_prep_splice(loop, uconn, URING_OP_SPLICE_REPLAY, replay->pipe_fd, -1, conn->fd, chunk, 0);
+        return true;
+    }
+
+    if (replay->map_remaining > 0 || replay->remaining > 0) {
+        memset(&uconn->msg, 0, sizeof(uconn->msg));
+        uconn->msg.msg_iov = uconn->iov;
+        uconn->msg.msg_iovlen = aesd_replay_gather(replay, uconn->iov, URING_IOV_COUNT);
+
+        struct io_uring_sqe *sqe = aesd_uring_get_sqe(loop);
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = conn->fd;
+        sqe->addr = (uint64_t)(uintptr_t)&uconn->msg;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = aesd_uring_tag(uconn, URING_OP_SEND);
+        uconn->inflight++;
+        return true;
+    }
+    return false;
+}
+
+// Advances a connection with nothing in flight: answers every complete packet
+// received so far, one reply at a time, then waits for more bytes
+static void aesd_uring_drive(struct aesd_uring_loop *loop, struct aesd_uring_conn *uconn) {
+    struct aesd_conn *conn = uconn->conn;
+
+    while (!uconn->closing) {
+        if (conn->state == AESD_CONN_REPLAY) {
+            if (aesd_uring_prep_replay(loop, uconn)) {
+                return;
+            }
+            aesd_conn_packet_done(conn);
+            continue;
+        }
+
+        if (aesd_conn_next_packet(conn)) {
+            continue;
+        }
+        if (conn->state == AESD_CONN_CLOSED) {
+            uconn->closing = true;
+            return;
+        }
+        // Idle connections hold no memory, the ring's buffers serve them all
+        if (aesd_rxbuf_pending(&conn->rx) == 0) {
+            aesd_rxbuf_release(&conn->rx);
+        }
+        aesd_uring_prep_recv(loop, uconn);
+        return;
+    }
+}
+
+static void aesd_uring_conn_free(struct aesd_uring_conn *uconn) {
+    aesd_timer_cancel(&uconn->loop->timers, &uconn->conn->deadline_timer);
+    LIST_REMOVE(uconn, entries);
+    if (uconn->pipe_fds[0] != -1) {
+        close(uconn->pipe_fds[0]);
+        close(uconn->pipe_fds[1]);
+    }
+    aesd_conn_free(uconn->conn);
+    free(uconn);
+}
+
+// Closes the connection once it missed its deadline, otherwise waits for the one it has by now.
+// Operations in flight are failed by shutting the socket down, the last completion frees it.
+static void aesd_uring_deadline(struct aesd_timer *timer, void *arg) {
+    struct aesd_uring_conn *uconn = arg;
+    struct aesd_uring_loop *loop = uconn->loop;
+
+    if (!aesd_conn_expired(uconn->conn, aesd_timer_now_ms())) {
+        aesd_timer_arm(&loop->timers, timer, uconn->conn->deadline_ms);
+        return;
+    }
+    uconn->closing = true;
+    if (uconn->inflight == 0) {
+        aesd_uring_conn_free(uconn);
+    } else {
+        shutdown(uconn->conn->fd, SHUT_RDWR);
+    }
+}
+
+static void aesd_uring_handle_accept(struct aesd_uring_loop *loop, struct io_uring_cqe *cqe) {
+    // EINVAL: the listener was shut down for exiting, re-arming would only fail again
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        loop->accept_armed = false;
+        if (!atomic_load(&loop->stopping) && cqe->res != -EINVAL) {
+            aesd_uring_arm_accept(loop);
+        }
+    }
+    if (cqe->res < 0) {
+        if (cqe->res != -ECANCELED && cqe->res != -EINVAL) {
+            aesd_log(LOG_ERR, "Accept failed: %s", strerror(-cqe->res));
+        }
+        return;
+    }
+
+    int fd = cqe->res;
+    if (atomic_load(&loop->stopping)) {
+        close(fd);
+        return;
+    }
+
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    getpeername(fd, (struct sockaddr *)&addr, &addr_len);
+
+    struct aesd_conn *conn = aesd_conn_new(fd, &addr);
+    if (conn == NULL) {
+        close(fd);
+        return;
+    }
+    struct aesd_uring_conn *uconn = calloc(1, sizeof(struct aesd_uring_conn));
+    if (uconn == NULL) {
+        aesd_log(LOG_ERR, "Malloc for connection failed");
+        aesd_conn_free(conn);
+        return;
+    }
+    uconn->conn = conn;
+    uconn->loop = loop;
+    uconn->pipe_fds[0] = -1;
+    uconn->pipe_fds[1] = -1;
+    LIST_INSERT_HEAD(&loop->conns, uconn, entries);
+    aesd_timer_init(&conn->deadline_timer, aesd_uring_deadline, uconn);
+    aesd_timer_arm(&loop->timers, &conn->deadline_timer, conn->deadline_ms);
+
+    aesd_uring_prep_recv(loop, uconn);
+}
+
+static void aesd_uring_handle_conn(struct aesd_uring_loop *loop, struct io_uring_cqe *cqe) {
+    struct aesd_uring_conn *uconn = (struct aesd_uring_conn *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_OP_MASK);
+    struct aesd_conn *conn = uconn->conn;
+    int res = cqe->res;
+
+    uconn->inflight--;
+
+    switch (cqe->user_data & URING_OP_MASK) {
+    case URING_OP_RECV:
+        if (res > 0) {
+            uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            if (aesd_rxbuf_reserve(&conn->rx, res) == 0) {
+                memcpy(aesd_rxbuf_tail(&conn->rx), loop->buf_data + (size_t)bid * AESD_URING_BUF_SIZE, res);
+                aesd_conn_received(conn, res);
+            } else {
+                aesd_log(LOG_ERR, "Malloc failed");
+                uconn->closing = true;
+            }
+            aesd_uring_recycle_buffer(loop, bid);
+        } else if (res != -ENOBUFS) {
+            // Peer closed (or failed): a trailing packet without newline is not stored
+            uconn->closing = true;
+        }
+        // With every buffer taken the receive is simply retried by aesd_uring_drive()
+        break;
+    case URING_OP_SEND:
+    case URING_OP_SPLICE_REPLAY:
+        if (res > 0) {
+            aesd_replay_advance(&conn->replay, res);
+            aesd_conn_sent(conn);
+        } else {
+            uconn->closing = true;
+        }
+        break;
+    case URING_OP_SPLICE_IN:
+        if (res > 0) {
+            aesd_replay_advance(&conn->replay, res);
+            uconn->pipe_fill += res;
+        } else {
+            // The file is shorter than the snapshot, or the read failed
+            uconn->closing = true;
+        }
+        break;
+    case URING_OP_SPLICE_OUT:
+        if (res > 0) {
+            uconn->pipe_fill -= res;
+            aesd_conn_sent(conn);
+        } else if (res != -ECANCELED) {
+            // A short splice in cancels the linked splice out, the pipe is drained next round
+            uconn->closing = true;
+        }
+        break;
+    default:
+        break;
+    }
+
+    if (uconn->inflight > 0) {
+        return;
+    }
+    if (!uconn->closing) {
+        aesd_uring_drive(loop, uconn);
+    }
+    // Drive may have given up too, e.g. when no pipe could be created
+    if (uconn->closing && uconn->inflight == 0) {
+        aesd_uring_conn_free(uconn);
+    }
+}
+
+static void aesd_uring_handle(struct aesd_uring_loop *loop, struct io_uring_cqe *cqe) {
+    switch (cqe->user_data) {
+    case URING_OP_ACCEPT:
+        aesd_uring_handle_accept(loop, cqe);
+        return;
+    case URING_OP_WAKE:
+    case URING_OP_CANCEL:
+        return;
+    default:
+        aesd_uring_handle_conn(loop, cqe);
+        return;
+    }
+}
+
+static void aesd_uring_reap(struct aesd_uring_loop *loop) {
+    unsigned int head = *loop->cq_head;
+    unsigned int tail = __atomic_load_n(loop->cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        // Copy first: handling may submit, and the kernel may reuse the slot once head moves
+        struct io_uring_cqe cqe = loop->cqes[head & loop->cq_mask];
+        head++;
+        __atomic_store_n(loop->cq_head, head, __ATOMIC_RELEASE);
+        aesd_uring_handle(loop, &cqe);
+    }
+}
+
+// Cancels the accept and shuts every socket down, then reaps until nothing the
+// kernel could still write to is left
+static void aesd_uring_drain(struct aesd_uring_loop *loop) {
+    struct aesd_uring_conn *uconn;
+    struct aesd_uring_conn *next;
+
+    if (loop->accept_armed) {
+        struct io_uring_sqe *sqe = aesd_uring_get_sqe(loop);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = URING_OP_ACCEPT;
+        sqe->user_data = URING_OP_CANCEL;
+    }
+
+    for (uconn = LIST_FIRST(&loop->conns); uconn != NULL; uconn = next) {
+        next = LIST_NEXT(uconn, entries);
+        uconn->closing = true;
+        if (uconn->inflight == 0) {
+            aesd_uring_conn_free(uconn);
+        } else {
+            shutdown(uconn->conn->fd, SHUT_RDWR);
+        }
+    }
+
+    while (loop->accept_armed || !LIST_EMPTY(&loop->conns)) {
+        if (aesd_uring_submit(loop, 1, -1) != 0) {
+            break;
+        }
+        aesd_uring_reap(loop);
+    }
+}
+
+static void *aesd_uring_loop_func(void *arg) {
+    struct aesd_uring_loop *loop = arg;
+
+    aesd_uring_arm_accept(loop);
+    aesd_uring_arm_wake(loop);
+
+    while (!atomic_load(&loop->stopping)) {
+        int timeout = aesd_timer_wheel_timeout(&loop->timers, aesd_timer_now_ms());
+        if (aesd_uring_submit(loop, 1, timeout) != 0) {
+            break;
+        }
+        aesd_uring_reap(loop);
+        aesd_timer_wheel_advance(&loop->timers, aesd_timer_now_ms());
+    }
+
+    // --- LOOP CLEANUP ---
+    aesd_uring_drain(loop);
+    return NULL;
+}
+
+static void aesd_uring_loop_destroy(struct aesd_uring_loop *loop) {
+    if (loop->ring_fd != -1) {
+        close(loop->ring_fd);
+    }
+    if (loop->sqes != NULL) {
+        munmap(loop->sqes, loop->sqes_size);
+    }
+    if (loop->cq_ring != NULL && loop->cq_ring != loop->sq_ring) {
+        munmap(loop->cq_ring, loop->cq_ring_size);
+    }
+    if (loop->sq_ring != NULL) {
+        munmap(loop->sq_ring, loop->sq_ring_size);
+    }
+    if (loop->buf_ring != NULL) {
+        munmap(loop->buf_ring, loop->buf_ring_size);
+    }
+    free(loop->buf_data);
+    if (loop->wake_fd != -1) {
+        close(loop->wake_fd);
+    }
+}
+
+static void *aesd_uring_map(int ring_fd, size_t size, off_t offset) {
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+    return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+// Provided buffer rings (Linux 5.19) arrived together with multishot accept,
+// so registering one also tells whether the kernel is recent enough
+static int aesd_uring_buffers_init(struct aesd_uring_loop *loop) {
+    loop->buf_ring_size = AESD_URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    loop->buf_ring = mmap(NULL, loop->buf_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (loop->buf_ring == MAP_FAILED) {
+        loop->buf_ring = NULL;
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)loop->buf_ring;
+    reg.ring_entries = AESD_URING_BUF_COUNT;
+    reg.bgid = URING_BUF_GROUP;
+    if (aesd_uring_register(loop->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        syslog(LOG_WARNING, "io_uring provided buffer rings unsupported: %s", strerror(errno));
+        return -1;
+    }
+
+    loop->buf_data = malloc((size_t)AESD_URING_BUF_COUNT * AESD_URING_BUF_SIZE);
+    if (loop->buf_data == NULL) {
+        syslog(LOG_ERR, "Malloc for receive buffers failed");
+        return -1;
+    }
+    for (unsigned int bid = 0; bid < AESD_URING_BUF_COUNT; bid++) {
+        aesd_uring_recycle_buffer(loop, bid);
+    }
+    return 0;
+}
+
+static int aesd_uring_loop_init(struct aesd_uring_loop *loop, int listen_fd) {
+    struct io_uring_params params;
+
+    memset(loop, 0, sizeof(*loop));
+    LIST_INIT(&loop->conns);
+    aesd_timer_wheel_init(&loop->timers, aesd_timer_now_ms());
+    atomic_init(&loop->stopping, false);
+    loop->listen_fd = listen_fd;
+    loop->wake_fd = -1;
+
+    memset(&params, 0, sizeof(params));
+    loop->ring_fd = aesd_uring_setup(AESD_URING_ENTRIES, &params);
+    if (loop->ring_fd == -1) {
+        syslog(LOG_WARNING, "io_uring_setup failed: %s", strerror(errno));
+        return -1;
+    }
+    // Waiting with a timeout is how connection deadlines are enforced
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        syslog(LOG_WARNING, "io_uring lacks timed waits");
+        return -1;
+    }
+
+    loop->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    loop->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (loop->cq_ring_size > loop->sq_ring_size) {
+            loop->sq_ring_size = loop->cq_ring_size;
+        }
+        loop->cq_ring_size = loop->sq_ring_size;
+    }
+
+    loop->sq_ring = aesd_uring_map(loop->ring_fd, loop->sq_ring_size, IORING_OFF_SQ_RING);
+    if (loop->sq_ring != NULL && (params.features & IORING_FEAT_SINGLE_MMAP)) {
+        loop->cq_ring = loop->sq_ring;
+    } else if (loop->sq_ring != NULL) {
+        loop->cq_ring = aesd_uring_map(loop->ring_fd, loop->cq_ring_size, IORING_OFF_CQ_RING);
+    }
+    loop->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    loop->sqes = aesd_uring_map(loop->ring_fd, loop->sqes_size, IORING_OFF_SQES);
+    if (loop->sq_ring == NULL || loop->cq_ring == NULL || loop->sqes == NULL) {
+        syslog(LOG_ERR, "io_uring mmap failed: %s", strerror(errno));
+        return -1;
+    }
+
+    char *sq = loop->sq_ring;
+    loop->sq_head = (unsigned int *)(sq + params.sq_off.head);
+    loop->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    loop->sq_mask = *(unsigned int *)(sq + params.sq_off.ring_mask);
+    loop->sq_entries = params.sq_entries;
+    loop->sq_local = *loop->sq_tail;
+    // Entry i always sits in slot i, the indirection array never changes
+    unsigned int *sq_array = (unsigned int *)(sq + params.sq_off.array);
+    for (unsigned int i = 0; i < params.sq_entries; i++) {
+        sq_array[i] = i;
+    }
+
+    char *cq = loop->cq_ring;
+    loop->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    loop->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    loop->cq_mask = *(unsigned int *)(cq + params.cq_off.ring_mask);
+    loop->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    if (aesd_uring_buffers_init(loop) != 0) {
+        return -1;
+    }
+
+    loop->wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (loop->wake_fd == -1) {
+        syslog(LOG_ERR, "eventfd failed: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int aesd_uring_start(struct aesd_uring *uring, unsigned int nloops, const int *listen_fds, bool pin_cpus) {
+    unsigned int started;
+    sigset_t all, old;
+
+    uring->loops = calloc(nloops, sizeof(struct aesd_uring_loop));
+    if (uring->loops == NULL) {
+        syslog(LOG_ERR, "Malloc for io_uring loops failed");
+        return -1;
+    }
+    uring->nloops = nloops;
+
+    // Loop threads never take SIGINT/SIGTERM, the main thread waits for them
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (started = 0; started < nloops; started++) {
+        struct aesd_uring_loop *loop = &uring->loops[started];
+        if (aesd_uring_loop_init(loop, listen_fds[started]) != 0) {
+            aesd_uring_loop_destroy(loop);
+            break;
+        }
+        if (pthread_create(&loop->thread_id, NULL, aesd_uring_loop_func, loop) != 0) {
+            syslog(LOG_ERR, "io_uring thread creation failed");
+            aesd_uring_loop_destroy(loop);
+            break;
+        }
+        if (pin_cpus) {
+            aesd_affinity_pin(loop->thread_id, started);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (started < nloops) {
+        uring->nloops = started;
+        aesd_uring_stop(uring);
+        return -1;
+    }
+    return 0;
+}
+
+void aesd_uring_stop(struct aesd_uring *uring) {
+    for (unsigned int i = 0; i < uring->nloops; i++) {
+        struct aesd_uring_loop *loop = &uring->loops[i];
+        uint64_t one = 1;
+
+        atomic_store(&loop->stopping, true);
+        if (write(loop->wake_fd, &one, sizeof(one)) == -1) {
+            aesd_log(LOG_ERR, "io_uring wakeup failed: %s", strerror(errno));
+        }
+    }
+
+    for (unsigned int i = 0; i < uring->nloops; i++) {
+        pthread_join(uring->loops[i].thread_id, NULL);
+        aesd_uring_loop_destroy(&uring->loops[i]);
+    }
+
+    free(uring->loops);
+    uring->loops = NULL;
+    uring->nloops = 0;
+}
+
+#else
+
+int aesd_uring_start(struct aesd_uring *uring, unsigned int nloops, const int *listen_fds, bool pin_cpus) {
+    (void)nloops;
+    (void)listen_fds;
+    (void)pin_cpus;
+    uring->loops = NULL;
+    uring->nloops = 0;
+    syslog(LOG_WARNING, "Built without io_uring support");
+    return -1;
+}
+
+void aesd_uring_stop(struct aesd_uring *uring) {
+    (void)uring;
+}
+
+#endif
@@ -0,0 +1,40 @@
+/*
+ * aesd-uring.h
+ *
+ *  io_uring execution mode, driven through the raw system calls. Every loop
+ *  thread owns a ring with a multishot accept on the listening socket, a
+ *  ring of provided receive buffers shared by its connections, and submits
+ *  the replies as sendmsg() or as linked file-to-pipe-to-socket splices.
+ *  Packets are still appended through the data log, which group commits.
+ */
+
+#ifndef AESD_URING_H
+#define AESD_URING_H
+
+#include <stdbool.h>
+
+// Private to aesd-uring.c, it depends on recent <linux/io_uring.h> headers
+struct aesd_uring_loop;
+
+struct aesd_uring
+{
+    struct aesd_uring_loop *loops;
+    unsigned int nloops;
+};
+
+/**
+ * Starts @param nloops io_uring loop threads for @param uring, loop i accepting from
+ * @param listen_fds[i]; the listeners may all be the same socket or one SO_REUSEPORT
+ * shard each. With @param pin_cpus loop i is pinned to the i-th CPU.
+ * @return 0 on success, -1 if the kernel (or the headers it was built against) lacks the
+ * required io_uring features or the setup failed otherwise. Nothing is left running
+ * then, the caller can fall back to another mode.
+ */
+extern int aesd_uring_start(struct aesd_uring *uring, unsigned int nloops, const int *listen_fds, bool pin_cpus);
+
+/**
+ * Stops and joins every loop of @param uring, closing the connections they still serve
+ */
+extern void aesd_uring_stop(struct aesd_uring *uring);
+
+#endif /* AESD_URING_H */
@@ -0,0 +1,36 @@
+#!/bin/sh
+# Runs aesdsocket-bench against every execution mode over a grid of
+# persistent connection counts and packet sizes, verifying the history of
+# every run, and prints one result line per combination.
+#
+# Usage: aesdsocket-bench-sweep.sh [-t seconds] [mode ...]
+# Run from the server directory after "make all bench". The data file is
+# not cleared between runs, so later runs replay a longer history. Every
+# server accepts packets just as long as the ones of its run, so SIZES may
+# include lines over the 1 MiB default.
+
+SECONDS_PER_RUN=3
+CONNECTIONS="1 4 16 64"
+SIZES="64 4096"
+
+if [ "$1" = "-t" ]; then
+    SECONDS_PER_RUN=$2
+    shift 2
+fi
+MODES=${*:-"thread epoll pool uring"}
+
+status=0
+for mode in $MODES; do
+    for connections in $CONNECTIONS; do
+        for size in $SIZES; do
+            ./aesdsocket -m "$mode" -o max_packet_bytes="$size" &
+            server=$!
+            sleep 1
+            printf "server=%s " "$mode"
+            ./aesdsocket-bench -c "$connections" -l "$size" -t "$SECONDS_PER_RUN" -v || status=1
+            kill -TERM "$server"
+            wait "$server"
+        done
+    done
+done
+exit $status
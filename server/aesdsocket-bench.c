@@ -0,0 +1,563 @@
+/*
+ * aesdsocket-bench.c
+ *
+ *  Load generator and latency benchmark for aesdsocket.
+ *
+ *  By default writer threads repeatedly connect, send one packet and drain
+ *  the replayed history, while an optional slow reader keeps a huge reply in
+ *  flight by reading it at a trickle. The packet rate of the writers shows
+ *  whether one stalled client holds up everyone else.
+ *
+ *  With -c the benchmark instead keeps N persistent connections open, each
+ *  sending packets of -l bytes (at -r packets per second, or back to back)
+ *  and waiting for the reply before the next one. Latency is measured from
+ *  the moment a packet was due, so a stalled server is not hidden by the
+ *  client sending less. With -v the complete history is fetched at the end
+ *  and checked for every packet sent, exactly once and in order. Against a
+ *  server keeping a bounded history (-b) only the packets still retained are
+ *  checked, they have to be the latest ones sent.
+ *
+ *  The server disconnects clients sending lines longer than its
+ *  max_packet_bytes (1 MiB by default), so runs with a larger -l, such as the
+ *  100 MB one, need it raised: aesdsocket -o max_packet_bytes=104857600.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define BENCH_BUFFER_SIZE 65536
+
+// Latency samples are kept per thread and merged once the run is over
+#define BENCH_SAMPLES_INITIAL 4096
+
+struct bench_config {
+    const char *host;
+    const char *port;
+    int writers;
+    int connections;
+    int seconds;
+    bool slow_reader;
+    size_t preload_bytes;
+    size_t line_bytes;
+    double rate;
+    bool verify;
+    bool bounded;
+};
+
+static struct bench_config config = {
+    .host = "127.0.0.1",
+    .port = "9000",
+    .writers = 4,
+    .connections = 0,
+    .seconds = 5,
+    .slow_reader = false,
+    .preload_bytes = 0,
+    .line_bytes = 0,
+    .rate = 0,
+    .verify = false,
+    .bounded = false,
+};
+
+struct bench_thread {
+    pthread_t thread_id;
+    long id;
+    /**
+     * Latency of every completed packet, in nanoseconds
+     */
+    unsigned long long *samples;
+    size_t nsamples;
+    size_t capacity;
+    /**
+     * Packets whose reply arrived, the history must hold exactly these
+     */
+    unsigned long sent;
+};
+
+// Starts every packet line, "conn-<pid>" or "writer-<pid>" so the history of
+// earlier runs against the same server is told apart
+static char packet_kind[32];
+
+static atomic_bool stop_requested;
+static atomic_ulong packets_done;
+static atomic_ulong bytes_sent;
+static atomic_ulong bytes_replayed;
+static atomic_ulong failures;
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void record_sample(struct bench_thread *thread, unsigned long long latency) {
+    if (thread->nsamples == thread->capacity) {
+        size_t capacity = thread->capacity > 0 ? thread->capacity * 2 : BENCH_SAMPLES_INITIAL;
+        unsigned long long *samples = realloc(thread->samples, capacity * sizeof(*samples));
+        if (samples == NULL) {
+            return;
+        }
+        thread->samples = samples;
+        thread->capacity = capacity;
+    }
+    thread->samples[thread->nsamples++] = latency;
+}
+
+static int bench_connect(int rcvbuf) {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(config.host, config.port, &hints, &res) != 0) {
+        return -1;
+    }
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd != -1) {
+        // Must be set before connect() to shrink the advertised window
+        if (rcvbuf > 0) {
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        }
+        if (connect(fd, res->ai_addr, res->ai_addrlen) == -1) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+static int send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(fd, buf, len, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+// One packet on its own connection; the write side is shut so the server
+// closes once the reply is complete. Returns the reply size or -1.
+static ssize_t bench_exchange(const char *packet, size_t len) {
+    char buf[BENCH_BUFFER_SIZE];
+    ssize_t total = 0;
+    ssize_t got;
+
+    int fd = bench_connect(0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (send_all(fd, packet, len) != 0) {
+        close(fd);
+        return -1;
+    }
+    shutdown(fd, SHUT_WR);
+    while ((got = recv(fd, buf, sizeof(buf), 0)) != 0) {
+        if (got == -1) {
+            if (errno == EINTR) continue;
+            close(fd);
+            return -1;
+        }
+        total += got;
+    }
+    close(fd);
+    return total;
+}
+
+// Builds "<packet_kind> <id> packet <seq>" padded with 'l' to line_bytes, newline included.
+// Returns the packet length.
+static size_t format_packet(char *packet, size_t capacity, long id, unsigned long seq) {
+    size_t len = snprintf(packet, capacity, "%s %ld packet %lu\n", packet_kind, id, seq);
+    if (config.line_bytes > len) {
+        // Same header at the front of the big line, the newline stays at its end
+        memset(packet + len - 1, 'l', config.line_bytes - len);
+        len = config.line_bytes;
+        packet[len - 1] = '\n';
+    }
+    return len;
+}
+
+static size_t packet_capacity(void) {
+    return config.line_bytes > 64 ? config.line_bytes : 64;
+}
+
+static void *writer_func(void *arg) {
+    struct bench_thread *thread = arg;
+    unsigned long seq = 0;
+    char *packet = malloc(packet_capacity());
+
+    if (packet == NULL) {
+        fprintf(stderr, "writer %ld: malloc failed\n", thread->id);
+        return NULL;
+    }
+
+    while (!atomic_load(&stop_requested)) {
+        size_t len = format_packet(packet, packet_capacity(), thread->id, seq);
+        unsigned long long start = now_ns();
+        ssize_t replayed = bench_exchange(packet, len);
+        if (replayed < 0) {
+            atomic_fetch_add(&failures, 1);
+            continue;
+        }
+        seq++;
+        record_sample(thread, now_ns() - start);
+        atomic_fetch_add(&packets_done, 1);
+        atomic_fetch_add(&bytes_sent, len);
+        atomic_fetch_add(&bytes_replayed, replayed);
+    }
+
+    thread->sent = seq;
+    free(packet);
+    return NULL;
+}
+
+// Reads one reply: the history up to and including @param packet, which is the
+// last thing in it. Returns the reply size or -1.
+static ssize_t read_reply(int fd, const char *packet, size_t len) {
+    char buf[BENCH_BUFFER_SIZE];
+    char *tail = malloc(len);
+    size_t tail_len = 0;
+    ssize_t total = 0;
+
+    if (tail == NULL) {
+        return -1;
+    }
+    // Only the last len bytes matter: the reply is complete once they equal the packet
+    while (tail_len < len || memcmp(tail, packet, len) != 0) {
+        ssize_t got = recv(fd, buf, sizeof(buf), 0);
+        if (got <= 0) {
+            if (got == -1 && errno == EINTR) continue;
+            free(tail);
+            return -1;
+        }
+        total += got;
+        if ((size_t)got >= len) {
+            memcpy(tail, buf + got - len, len);
+            tail_len = len;
+        } else {
+            size_t keep = tail_len + got > len ? len - got : tail_len;
+            memmove(tail, tail + tail_len - keep, keep);
+            memcpy(tail + keep, buf, got);
+            tail_len = keep + got;
+        }
+    }
+    free(tail);
+    return total;
+}
+
+static void *connection_func(void *arg) {
+    struct bench_thread *thread = arg;
+    unsigned long seq = 0;
+    char *packet = malloc(packet_capacity());
+    unsigned long long interval = config.rate > 0 ? (unsigned long long)(1e9 / config.rate) : 0;
+    ssize_t last_reply = 0;
+
+    int fd = bench_connect(0);
+    if (fd == -1 || packet == NULL) {
+        fprintf(stderr, "connection %ld could not connect\n", thread->id);
+        atomic_fetch_add(&failures, 1);
+        if (fd != -1) close(fd);
+        free(packet);
+        return NULL;
+    }
+
+    unsigned long long due = now_ns();
+    while (!atomic_load(&stop_requested)) {
+        if (interval > 0) {
+            unsigned long long now = now_ns();
+            if (now < due) {
+                struct timespec pause = { (due - now) / 1000000000ULL, (due - now) % 1000000000ULL };
+                nanosleep(&pause, NULL);
+                continue;
+            }
+        } else {
+            due = now_ns();
+        }
+
+        size_t len = format_packet(packet, packet_capacity(), thread->id, seq);
+        if (send_all(fd, packet, len) != 0) {
+            atomic_fetch_add(&failures, 1);
+            break;
+        }
+        ssize_t replayed = read_reply(fd, packet, len);
+        // The history only ever grows, and by at least our own packet, unless old history is dropped
+        if (replayed < 0 || (!config.bounded && replayed < last_reply + (ssize_t)len)) {
+            atomic_fetch_add(&failures, 1);
+            break;
+        }
+        last_reply = replayed;
+        seq++;
+
+        // Measured from when the packet was due, not when it could be sent
+        record_sample(thread, now_ns() - due);
+        atomic_fetch_add(&packets_done, 1);
+        atomic_fetch_add(&bytes_sent, len);
+        atomic_fetch_add(&bytes_replayed, replayed);
+        due += interval;
+    }
+
+    thread->sent = seq;
+    close(fd);
+    free(packet);
+    return NULL;
+}
+
+// Sends a packet, then reads the reply one KiB every 10 ms for the whole run
+static void *slow_reader_func(void *arg) {
+    char buf[1024];
+    const char *packet = "slow reader\n";
+    (void)arg;
+
+    int fd = bench_connect(4096);
+    if (fd == -1 || send_all(fd, packet, strlen(packet)) != 0) {
+        fprintf(stderr, "slow reader could not connect\n");
+        if (fd != -1) close(fd);
+        return NULL;
+    }
+    while (!atomic_load(&stop_requested)) {
+        struct timespec pause = { 0, 10 * 1000 * 1000 };
+        nanosleep(&pause, NULL);
+        if (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) == 0) {
+            break;
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+// Grows the history so a reply no longer fits in the socket buffers
+static int preload_history(size_t bytes) {
+    size_t chunk = 256 * 1024;
+    char *packet = malloc(chunk);
+    if (packet == NULL) {
+        return -1;
+    }
+    memset(packet, 'p', chunk - 1);
+    packet[chunk - 1] = '\n';
+
+    while (bytes > 0) {
+        size_t len = bytes < chunk ? bytes : chunk;
+        packet[len - 1] = '\n';
+        if (bench_exchange(packet, len) < 0) {
+            free(packet);
+            return -1;
+        }
+        bytes -= len;
+    }
+    free(packet);
+    return 0;
+}
+
+// Fetches the complete history and checks that every packet of every thread is in
+// it exactly once and in order. Returns the number of problems found.
+static unsigned long verify_history(struct bench_thread *threads, int nthreads) {
+    const char *marker = "bench verify\n";
+    size_t cap = 1024 * 1024;
+    size_t len = 0;
+    char *history = malloc(cap);
+    unsigned long *next = calloc(nthreads, sizeof(unsigned long));
+    bool *seen = calloc(nthreads, sizeof(bool));
+    unsigned long problems = 0;
+    ssize_t got;
+
+    int fd = bench_connect(0);
+    if (fd == -1 || history == NULL || next == NULL || seen == NULL || send_all(fd, marker, strlen(marker)) != 0) {
+        fprintf(stderr, "verify: could not fetch the history\n");
+        if (fd != -1) close(fd);
+        free(history);
+        free(next);
+        free(seen);
+        return 1;
+    }
+    shutdown(fd, SHUT_WR);
+    for (;;) {
+        if (len == cap) {
+            char *grown = realloc(history, cap * 2);
+            if (grown == NULL) break;
+            history = grown;
+            cap *= 2;
+        }
+        got = recv(fd, history + len, cap - len, 0);
+        if (got <= 0) {
+            if (got == -1 && errno == EINTR) continue;
+            break;
+        }
+        len += got;
+    }
+    close(fd);
+
+    // Walk the lines; other clients and the server's timestamps may be mixed in
+    size_t prefix = strlen(packet_kind);
+    for (char *line = history; line < history + len; ) {
+        char *end = memchr(line, '\n', history + len - line);
+        if (end == NULL) break;
+        long id;
+        unsigned long seq;
+        if ((size_t)(end - line) > prefix && strncmp(line, packet_kind, prefix) == 0 && line[prefix] == ' '
+            && sscanf(line + prefix, " %ld packet %lu", &id, &seq) == 2 && id >= 0 && id < nthreads) {
+            // A bounded history starts wherever the retention window does
+            if (config.bounded && !seen[id]) {
+                next[id] = seq;
+            }
+            seen[id] = true;
+            if (seq != next[id]) {
+                if (problems < 10) {
+                    fprintf(stderr, "verify: %s %ld packet %lu found, expected packet %lu\n", packet_kind, id, seq, next[id]);
+                }
+                problems++;
+            }
+            next[id] = seq + 1;
+        }
+        line = end + 1;
+    }
+    for (int i = 0; i < nthreads; i++) {
+        // The last packet may have been stored before a failed reply, so one extra is fine
+        if (next[i] != threads[i].sent && next[i] != threads[i].sent + 1 && !(config.bounded && !seen[i])) {
+            fprintf(stderr, "verify: %s %d sent %lu packets, history holds %lu\n", packet_kind, i, threads[i].sent, next[i]);
+            problems++;
+        }
+    }
+
+    free(history);
+    free(next);
+    free(seen);
+    return problems;
+}
+
+static int compare_samples(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const unsigned long long *sorted, size_t count, double fraction) {
+    if (count == 0) {
+        return 0;
+    }
+    size_t index = (size_t)(fraction * (count - 1) + 0.5);
+    return sorted[index] / 1000.0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-H host] [-p port] [-t seconds] [-l line_bytes] [-v] [-b]\n"
+                    "          [-w writers] [-s] [-P preload_bytes]\n"
+                    "          [-c connections] [-r packets_per_second]\n"
+                    "  -w  writers opening a new connection for every packet (default mode)\n"
+                    "  -s  add one slow reader that drains its reply at ~100 KiB/s\n"
+                    "  -c  keep this many persistent connections busy instead of writers\n"
+                    "  -r  packets per second per connection with -c, back to back by default\n"
+                    "  -l  send lines of line_bytes bytes instead of short packets, the server\n"
+                    "      needs -o max_packet_bytes of at least line_bytes\n"
+                    "  -v  fetch the history at the end and check every packet sent is in it\n"
+                    "  -b  the server drops old history (aesdsocket -r, -k or -e), replies may shrink\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    pthread_t slow_thread;
+
+    while ((opt = getopt(argc, argv, "H:p:w:t:sP:l:c:r:vb")) != -1) {
+        switch (opt) {
+        case 'H': config.host = optarg; break;
+        case 'p': config.port = optarg; break;
+        case 'w': config.writers = atoi(optarg); break;
+        case 't': config.seconds = atoi(optarg); break;
+        case 's': config.slow_reader = true; break;
+        case 'P': config.preload_bytes = strtoul(optarg, NULL, 10); break;
+        case 'l': config.line_bytes = strtoul(optarg, NULL, 10); break;
+        case 'c': config.connections = atoi(optarg); break;
+        case 'r': config.rate = atof(optarg); break;
+        case 'v': config.verify = true; break;
+        case 'b': config.bounded = true; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (config.writers <= 0 || config.seconds <= 0 || config.connections < 0 || config.rate < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    bool persistent = config.connections > 0;
+    int nthreads = persistent ? config.connections : config.writers;
+    snprintf(packet_kind, sizeof(packet_kind), "%s-%d", persistent ? "conn" : "writer", (int)getpid());
+
+    if (config.preload_bytes > 0 && preload_history(config.preload_bytes) != 0) {
+        fprintf(stderr, "preload failed: is aesdsocket running on %s:%s?\n", config.host, config.port);
+        return 1;
+    }
+
+    if (config.slow_reader) {
+        pthread_create(&slow_thread, NULL, slow_reader_func, NULL);
+        // Let the slow reply get stuck before the writers start
+        sleep(1);
+    }
+
+    struct bench_thread *threads = calloc(nthreads, sizeof(struct bench_thread));
+    unsigned long long start = now_ns();
+    for (int i = 0; i < nthreads; i++) {
+        threads[i].id = i;
+        pthread_create(&threads[i].thread_id, NULL, persistent ? connection_func : writer_func, &threads[i]);
+    }
+
+    sleep(config.seconds);
+    atomic_store(&stop_requested, true);
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i].thread_id, NULL);
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    if (config.slow_reader) {
+        pthread_join(slow_thread, NULL);
+    }
+
+    // Merge the latency samples of every thread
+    size_t nsamples = 0;
+    for (int i = 0; i < nthreads; i++) {
+        nsamples += threads[i].nsamples;
+    }
+    unsigned long long *samples = malloc((nsamples > 0 ? nsamples : 1) * sizeof(*samples));
+    size_t merged = 0;
+    for (int i = 0; samples != NULL && i < nthreads; i++) {
+        memcpy(samples + merged, threads[i].samples, threads[i].nsamples * sizeof(*samples));
+        merged += threads[i].nsamples;
+    }
+    if (samples != NULL) {
+        qsort(samples, merged, sizeof(*samples), compare_samples);
+    }
+
+    const char *verdict = "skipped";
+    if (config.verify) {
+        verdict = verify_history(threads, nthreads) == 0 ? "ok" : "FAIL";
+    }
+
+    unsigned long packets = atomic_load(&packets_done);
+    printf("mode=%s %s=%d slow_reader=%s line_bytes=%zu rate=%.1f seconds=%.2f packets=%lu "
+           "throughput=%.1f pkt/s p50=%.1f us p99=%.1f us p999=%.1f us "
+           "sent=%.1f MiB/s replayed=%.1f MiB/s failures=%lu verify=%s\n",
+           persistent ? "persistent" : "reconnect", persistent ? "connections" : "writers", nthreads,
+           config.slow_reader ? "yes" : "no", config.line_bytes, config.rate, elapsed, packets,
+           packets / elapsed, percentile_us(samples, merged, 0.50), percentile_us(samples, merged, 0.99),
+           percentile_us(samples, merged, 0.999), atomic_load(&bytes_sent) / elapsed / (1024 * 1024),
+           atomic_load(&bytes_replayed) / elapsed / (1024 * 1024), atomic_load(&failures), verdict);
+
+    for (int i = 0; i < nthreads; i++) {
+        free(threads[i].samples);
+    }
+    free(threads);
+    free(samples);
+    return atomic_load(&failures) == 0 && strcmp(verdict, "FAIL") != 0 ? 0 : 1;
+}
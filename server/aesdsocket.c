@@ -1,65 +1,55 @@
+#define _GNU_SOURCE // accept4(), ppoll()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/time.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <syslog.h>
 #include <sys/stat.h>
 #include <signal.h>
+#include <poll.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <errno.h>
 #include <stdbool.h>
 #include <pthread.h>
-#include <sys/queue.h>
 #include <time.h>
-
-// --- MODIFICATION START: Build Switch Configuration ---
-#ifndef USE_AESD_CHAR_DEVICE
-#define USE_AESD_CHAR_DEVICE 1
-#endif
-
-#define PORT "9000"
-
-#if USE_AESD_CHAR_DEVICE
-    #define DATA_FILE "/dev/aesdchar"
-#else
-    #define DATA_FILE "/var/tmp/aesdsocketdata"
-#endif
-
-#define BACKLOG 10
-#define BUFFER_SIZE 1024
+#include <limits.h>
+#include <stdint.h>
+
+#include "aesdsocket.h"
+#include "aesd-conn.h"
+#include "aesd-conntable.h"
+#include "aesd-reactor.h"
+#include "aesd-uring.h"
+#include "aesd-pool.h"
+#include "aesd-metrics.h"
+#include "aesd-log.h"
+#include "aesd-timer.h"
+#include "aesd-config.h"
 
 // Global variables for synchronization and cleanup
 int server_socket_fd = -1;
-bool signal_caught = false;
+volatile sig_atomic_t signal_caught = 0;
 pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER; 
+struct aesd_datalog data_log;
 
-// Structure to pass arguments to the connection thread
-struct thread_data_t {
-    int client_fd;
-    char client_ip[INET6_ADDRSTRLEN];
-    bool thread_complete;
-    pthread_mutex_t *mutex;
-};
+// Effective settings, see aesd-config.h
+static struct aesd_config config;
 
-// Structure for the linked list node containing thread info
-struct slist_data_s {
-    pthread_t thread_id;
-    struct thread_data_t *thread_params;
-    SLIST_ENTRY(slist_data_s) entries;
-};
-
-// Define the head of the singly linked list
-SLIST_HEAD(slisthead, slist_data_s) head;
+// Connection threads of MODE_THREAD, owned by the accept loop
+static struct aesd_conntable conn_table;
 
 // Signal handler for SIGINT and SIGTERM
 void signal_handler(int signo) {
     if (signo == SIGINT || signo == SIGTERM) {
         syslog(LOG_INFO, "Caught signal, exiting");
-        signal_caught = true;
+        signal_caught = 1;
         
         // Shutdown server socket to break out of blocking accept() call
         if (server_socket_fd != -1) {
@@ -68,121 +58,236 @@ void signal_handler(int signo) {
     }
 }
 
-// --- TIMESTAMP THREAD FUNCTION ---
-// Modified: Only compiled/run if NOT using the char device
+// --- TIMERS ---
+// Only the regular file backend gets timestamp records
 #if !USE_AESD_CHAR_DEVICE
-void *timestamp_thread_func(void *arg) {
-    while (!signal_caught) {
-
-        if (signal_caught) break;
+// Timestamps within one local hour only differ in minutes and seconds, the rest
+// of the RFC 2822 string is formatted once per hour
+static time_t timestamp_hour_start = -1;
+static char timestamp_prefix[64];
+static char timestamp_zone[16];
+
+static int format_timestamp(char *buf, size_t size, time_t now) {
+    if (timestamp_hour_start == -1 || now < timestamp_hour_start || now >= timestamp_hour_start + 3600) {
+        struct tm info;
+        localtime_r(&now, &info);
+        strftime(timestamp_prefix, sizeof(timestamp_prefix), "timestamp:%a, %d %b %Y %H:", &info);
+        strftime(timestamp_zone, sizeof(timestamp_zone), " %z\n", &info);
+        timestamp_hour_start = now - info.tm_min * 60 - info.tm_sec;
+    }
 
-        time_t rawtime;
-        struct tm *info;
-        char time_str[100];
-        char output_str[200];
+    unsigned int offset = now - timestamp_hour_start;
+    return snprintf(buf, size, "%s%02u:%02u%s", timestamp_prefix, offset / 60, offset % 60, timestamp_zone);
+}
 
-        // Get current time
-        time(&rawtime);
-        info = localtime(&rawtime);
+// Checked once for every rotation segment the age limit is split into
+static uint64_t retention_check_ms(const struct aesd_retention *retention) {
+    uint64_t interval = retention->max_age_sec * 1000ULL / AESD_RETAIN_SEGMENTS;
+    return interval > 1000 ? interval : 1000;
+}
 
-        // Format time per RFC 2822
-        strftime(time_str, sizeof(time_str), "%a, %d %b %Y %H:%M:%S %z", info);
-        
-        // Prepare final string: "timestamp:time\n"
-        snprintf(output_str, sizeof(output_str), "timestamp:%s\n", time_str);
+static void timestamp_timer_fn(struct aesd_timer *timer, void *arg) {
+    struct aesd_timer_wheel *wheel = arg;
+    char record[128];
+    int len = format_timestamp(record, sizeof(record), time(NULL));
 
-        // --- CRITICAL SECTION START ---
-        if (pthread_mutex_lock(&file_mutex) != 0) {
-            syslog(LOG_ERR, "Timestamp thread: Mutex lock failed");
-        } else {
-            // Open file for appending
-            int file_fd = open(DATA_FILE, O_WRONLY | O_CREAT | O_APPEND, 0644);
-            if (file_fd != -1) {
-                if (write(file_fd, output_str, strlen(output_str)) == -1) {
-                    syslog(LOG_ERR, "Timestamp thread: File write failed: %s", strerror(errno));
-                }
-                close(file_fd);
-            } else {
-                syslog(LOG_ERR, "Timestamp thread: Could not open file: %s", strerror(errno));
-            }
-            
-            pthread_mutex_unlock(&file_mutex);
-        }
-        // --- CRITICAL SECTION END ---
-        
-        sleep(10);
+    // Appended like any packet, so it shows up in later replays
+    if (aesd_datalog_append(&data_log, record, len, NULL) != 0) {
+        syslog(LOG_ERR, "Timestamp timer: append failed");
+    } else {
+        aesd_metrics_add(AESD_METRIC_TIMESTAMP_WRITES, 1);
     }
-    return NULL;
+
+    // From the previous due time rather than now, so the records do not drift
+    aesd_timer_arm(wheel, timer, timer->expires * AESD_TIMER_TICK_MS + config.timestamp_interval_sec * 1000ULL);
+}
+#endif
+
+// Syncs what -f <ms> left unsynced once appends stopped coming in
+static void flush_timer_fn(struct aesd_timer *timer, void *arg) {
+    struct aesd_timer_wheel *wheel = arg;
+
+    aesd_datalog_flush(&data_log);
+    aesd_timer_arm(wheel, timer, aesd_timer_now_ms() + data_log.sync_interval_ms);
+}
+
+#if !USE_AESD_CHAR_DEVICE
+// Drops the history that aged out of the retention window while no appends came in
+static void retention_timer_fn(struct aesd_timer *timer, void *arg) {
+    struct aesd_timer_wheel *wheel = arg;
+
+    aesd_datalog_expire(&data_log);
+    aesd_timer_arm(wheel, timer, aesd_timer_now_ms() + retention_check_ms(&data_log.retention));
 }
 #endif
 
 // Thread function to handle client connection
 void *thread_func(void *thread_param) {
-    struct thread_data_t *data = (struct thread_data_t *)thread_param;
-    char recv_buf[BUFFER_SIZE];
-    ssize_t bytes_received;
-    char *packet_buffer = NULL;
-    size_t current_packet_size = 0;
-    bool packet_complete = false;
-
-    // --- RECEIVE DATA ---
-    while ((bytes_received = recv(data->client_fd, recv_buf, BUFFER_SIZE, 0)) > 0) {
-        char *temp = realloc(packet_buffer, current_packet_size + bytes_received);
-        if (temp == NULL) {
-            syslog(LOG_ERR, "Malloc failed");
-            if (packet_buffer) free(packet_buffer);
-            packet_buffer = NULL;
-            break; 
+    struct aesd_conn_slot *slot = thread_param;
+
+    // The socket is blocking, so the state machine only returns once it is done
+    // or a socket timeout expired, which is when the deadline is checked
+    while (!signal_caught && aesd_conn_handle(slot->conn) != AESD_CONN_WANT_CLOSE
+           && !aesd_conn_expired(slot->conn, aesd_timer_now_ms()))
+        ;
+
+    aesd_conn_free(slot->conn);
+    slot->conn = NULL;
+
+    // Hands the slot back to the accept loop, it is not ours to touch afterwards
+    aesd_conntable_complete(&conn_table, slot);
+    return NULL;
+}
+
+// Joins the connection threads that finished since the last call, and only those
+static void reap_connection_threads(void) {
+    struct aesd_conn_slot *slot = aesd_conntable_take_completed(&conn_table);
+
+    while (slot != NULL) {
+        struct aesd_conn_slot *next = slot->next;
+        pthread_join(slot->thread_id, NULL);
+        aesd_conntable_free(&conn_table, slot);
+        slot = next;
+    }
+}
+
+// Raise the open file limit so the reactor can hold tens of thousands of idle clients
+static void raise_fd_limit(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) != 0) {
+            syslog(LOG_WARNING, "Could not raise open file limit: %s", strerror(errno));
         }
-        packet_buffer = temp;
-        
-        memcpy(packet_buffer + current_packet_size, recv_buf, bytes_received);
-        current_packet_size += bytes_received;
+    }
+}
+
+// Creates a socket bound to @param res, shared with other SO_REUSEPORT sockets if @param reuseport
+static int open_listener(const struct addrinfo *res, bool reuseport) {
+    int yes = 1;
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd == -1) {
+        syslog(LOG_ERR, "Socket creation failed: %s", strerror(errno));
+        return -1;
+    }
+
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1
+        || (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) == -1)) {
+        syslog(LOG_ERR, "setsockopt failed: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    // Accepted sockets inherit these. With TCP_NODELAY the tail of a reply on a persistent
+    // connection does not wait for the client's delayed ACK of the previous segment; corked
+    // replies are flushed when they are complete, nodelay or not.
+    if (config.tcp != AESD_TCP_NAGLE) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    }
+    // Set before listen(), so the window scale offered to clients matches the buffer
+    if (config.so_rcvbuf > 0) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &config.so_rcvbuf, sizeof(config.so_rcvbuf));
+    }
+    if (config.so_sndbuf > 0) {
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &config.so_sndbuf, sizeof(config.so_sndbuf));
+    }
+
+    // Sharded listeners are accepted from by the event loops, which must never block
+    if (reuseport) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+
+    if (bind(fd, res->ai_addr, res->ai_addrlen) == -1) {
+        syslog(LOG_ERR, "Bind failed: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-d] [-m thread|epoll|pool|uring] [-w threads] [-f none|batch|ms] [-M port]\n"
+                    "          [-l err|warning|notice|info|debug] [-S] [-a] [-C connections] [-b file|mmap]\n"
+                    "          [-r bytes] [-k packets] [-e seconds] [-p port] [-c file] [-o key=value] [-E]\n"
+                    "  -S  one SO_REUSEPORT listener per event loop (epoll and uring modes)\n"
+                    "  -a  pin every event loop to a CPU of its own\n"
+                    "  -C  most connections open at once, later ones are refused\n"
+                    "  -b  keep the history with write() or in a shared mapping (regular file only,\n"
+                    "      the mapping holds at most 64 GiB written and rules out -r, -k and -e)\n"
+                    "  -r, -k, -e  only keep the history within this many bytes, packets or seconds\n"
+                    "      (regular file only, the char device keeps its last commands)\n"
+                    "  -c  read settings from a file of key = value lines, the other options override it\n"
+                    "  -o  set any key, e.g. -o backlog=512 -o so_sndbuf=262144 -o tcp=cork\n"
+                    "      or -o max_packet_bytes=104857600 for lines over the default 1 MiB\n"
+                    "  -E  print the effective settings in config file format and exit\n", prog);
+}
+
+// The config file is applied first, so the command line overrides it wherever -c is
+static int parse_options(int argc, char *argv[], struct aesd_config *config, bool *dump_rtn) {
+    const char *optstring = "dm:w:f:M:l:SaC:b:r:k:e:p:c:o:E";
+    int opt;
 
-        if (memchr(recv_buf, '\n', bytes_received) != NULL) {
-            packet_complete = true;
-            break;
+    while ((opt = getopt(argc, argv, optstring)) != -1) {
+        if (opt == 'c' && aesd_config_load(config, optarg) != 0) {
+            return -1;
+        }
+        if (opt == '?') {
+            usage(argv[0]);
+            return -1;
         }
     }
 
-    if (packet_complete && packet_buffer != NULL) {
-        // --- CRITICAL SECTION START ---
-        if (pthread_mutex_lock(data->mutex) != 0) {
-            syslog(LOG_ERR, "Mutex lock failed");
-        } else {
-            // Modified: Lazy open. File is only opened here, when accessed.
-            int file_fd = open(DATA_FILE, O_WRONLY | O_CREAT | O_APPEND, 0644);
-            if (file_fd == -1) {
-                syslog(LOG_ERR, "Could not open data file: %s", strerror(errno));
-            } else {
-                if (write(file_fd, packet_buffer, current_packet_size) == -1) {
-                    syslog(LOG_ERR, "File write failed: %s", strerror(errno));
-                }
-                close(file_fd);
-            }
-            
-            // --- READ AND SEND BACK ---
-            file_fd = open(DATA_FILE, O_RDONLY);
-            if (file_fd != -1) {
-                char send_buf[BUFFER_SIZE];
-                ssize_t bytes_read;
-                while ((bytes_read = read(file_fd, send_buf, BUFFER_SIZE)) > 0) {
-                    send(data->client_fd, send_buf, bytes_read, MSG_NOSIGNAL);
-                }
-                close(file_fd);
+    optind = 1;
+    while ((opt = getopt(argc, argv, optstring)) != -1) {
+        const char *key = NULL;
+        const char *value = optarg;
+
+        switch (opt) {
+        case 'd': key = "daemon"; value = "yes"; break;
+        case 'm': key = "mode"; break;
+        case 'w': key = "workers"; break;
+        case 'f': key = "sync"; break;
+        case 'M': key = "metrics_port"; break;
+        case 'l': key = "log_level"; break;
+        case 'S': key = "shard_listeners"; value = "yes"; break;
+        case 'a': key = "pin_cpus"; value = "yes"; break;
+        case 'C': key = "max_connections"; break;
+        case 'b': key = "backend"; break;
+        case 'r': key = "retain_bytes"; break;
+        case 'k': key = "retain_packets"; break;
+        case 'e': key = "retain_seconds"; break;
+        case 'p': key = "port"; break;
+        case 'c': continue;
+        case 'E': *dump_rtn = true; continue;
+        case 'o':
+            if (aesd_config_set_pair(config, optarg) != 0) {
+                fprintf(stderr, "Invalid setting %s\n", optarg);
+                return -1;
             }
-            
-            pthread_mutex_unlock(data->mutex);
-            // --- CRITICAL SECTION END ---
+            continue;
+        }
+        if (aesd_config_set(config, key, value) != 0) {
+            usage(argv[0]);
+            return -1;
         }
     }
+    return aesd_config_check(config);
+}
 
-    if (packet_buffer) free(packet_buffer);
-    close(data->client_fd);
-    syslog(LOG_INFO, "Closed connection from %s", data->client_ip);
-    
-    data->thread_complete = true;
-    return NULL;
+// The effective settings, one syslog line each
+static void log_config(const struct aesd_config *config) {
+    char *text = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&text, &size);
+    if (out == NULL) {
+        return;
+    }
+    aesd_config_dump(config, out);
+    fclose(out);
+
+    for (char *line = strtok(text, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+        syslog(LOG_INFO, "Config: %s", line);
+    }
+    free(text);
 }
 
 int main(int argc, char *argv[]) {
@@ -190,20 +295,46 @@ int main(int argc, char *argv[]) {
     struct sockaddr_storage client_addr;
     socklen_t client_addr_size;
     int status;
-    bool daemon_mode = false;
-    
-    // Modified: thread_id variable only needed if not using char device
+    bool dump_config = false;
+    struct aesd_reactor reactor;
+    struct aesd_uring uring;
+    struct aesd_pool pool;
+    struct aesd_metrics_server metrics;
+    bool metrics_running = false;
+    int *shard_fds = NULL;
+    unsigned int nshards = 0;
+    struct aesd_timer_service timers;
+    struct aesd_timer flush_timer;
+#if !USE_AESD_CHAR_DEVICE
+    struct aesd_timer timestamp_timer;
+    struct aesd_timer retention_timer;
+#endif
+
+    aesd_config_init(&config);
+    if (parse_options(argc, argv, &config, &dump_config) != 0) {
+        return -1;
+    }
+    if (dump_config) {
+        aesd_config_dump(&config, stdout);
+        return 0;
+    }
+
 #if !USE_AESD_CHAR_DEVICE
-    pthread_t timestamp_thread_id; 
     // Modified: Only unlink the file if we are using the regular file system
     unlink(DATA_FILE);
 #endif
 
-    if (argc == 2 && strcmp(argv[1], "-d") == 0) {
-        daemon_mode = true;
-    }
-    
     openlog("aesdsocket", LOG_PID, LOG_USER);
+    aesd_log_set_level(config.log_level);
+    log_config(&config);
+
+    aesd_conn_set_limit(config.max_connections);
+    aesd_conn_set_recv_buffer(config.recv_buffer);
+    aesd_conn_set_max_packet(config.max_packet_bytes);
+    aesd_conn_set_cork(config.tcp == AESD_TCP_CORK);
+    aesd_datalog_init(&data_log, &file_mutex, config.backend, config.cache_bytes, config.sync_policy,
+                      config.sync_interval_ms);
+    aesd_datalog_set_retention(&data_log, &config.retention);
 
     struct sigaction sa;
     memset(&sa, 0, sizeof(sa));
@@ -213,43 +344,61 @@ int main(int argc, char *argv[]) {
         return -1;
     }
 
-    SLIST_INIT(&head);
+    // sendfile() and splice() have no MSG_NOSIGNAL, a vanished client must not kill us
+    sa.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &sa, NULL) != 0) {
+        syslog(LOG_ERR, "Error ignoring SIGPIPE: %s", strerror(errno));
+        return -1;
+    }
+
+    aesd_conntable_init(&conn_table);
 
     memset(&hints, 0, sizeof hints);
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags = AI_PASSIVE;
 
-    if ((status = getaddrinfo(NULL, PORT, &hints, &res)) != 0) {
+    if ((status = getaddrinfo(NULL, config.port, &hints, &res)) != 0) {
         syslog(LOG_ERR, "getaddrinfo error: %s", gai_strerror(status));
         return -1;
     }
 
-    server_socket_fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    server_socket_fd = open_listener(res, config.shard_listeners);
     if (server_socket_fd == -1) {
-        syslog(LOG_ERR, "Socket creation failed: %s", strerror(errno));
         freeaddrinfo(res);
         return -1;
     }
 
-    int yes = 1;
-    if (setsockopt(server_socket_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1) {
-        syslog(LOG_ERR, "setsockopt failed: %s", strerror(errno));
-        freeaddrinfo(res);
-        close(server_socket_fd);
-        return -1;
-    }
-
-    if (bind(server_socket_fd, res->ai_addr, res->ai_addrlen) == -1) {
-        syslog(LOG_ERR, "Bind failed: %s", strerror(errno));
-        freeaddrinfo(res);
-        close(server_socket_fd);
-        return -1;
+    // One more listener on the same port for every other loop, the kernel spreads
+    // incoming connections over them by hashing the client address
+    if (config.shard_listeners) {
+        shard_fds = malloc(config.workers * sizeof(int));
+        if (shard_fds == NULL) {
+            syslog(LOG_ERR, "Malloc for listeners failed");
+            freeaddrinfo(res);
+            close(server_socket_fd);
+            return -1;
+        }
+        shard_fds[0] = server_socket_fd;
+        for (nshards = 1; nshards < config.workers; nshards++) {
+            shard_fds[nshards] = open_listener(res, true);
+            if (shard_fds[nshards] == -1) {
+                break;
+            }
+        }
+        if (nshards < config.workers) {
+            while (nshards > 0) {
+                close(shard_fds[--nshards]);
+            }
+            free(shard_fds);
+            freeaddrinfo(res);
+            return -1;
+        }
     }
 
     freeaddrinfo(res);
     
-    if (daemon_mode) {
+    if (config.daemon) {
         pid_t pid = fork();
         if (pid < 0) {
             syslog(LOG_ERR, "Fork failed");
@@ -269,110 +418,214 @@ int main(int argc, char *argv[]) {
         }
     }
     
-    // --- START TIMESTAMP THREAD ---
-    // Modified: Only start timestamp thread if we are NOT using the char device
+    // Every thread started from here on inherits SIGINT/SIGTERM blocked. Only the main
+    // thread takes them, in sigsuspend() or ppoll() below, so they always end its wait.
+    sigset_t stop_signals, old_mask;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &old_mask);
+
+    // --- START TIMERS ---
+    // Like the timestamp thread they replace, the server carries on without them
+    if (aesd_timer_service_init(&timers) == 0) {
+        uint64_t now = aesd_timer_now_ms();
 #if !USE_AESD_CHAR_DEVICE
-    if (pthread_create(&timestamp_thread_id, NULL, timestamp_thread_func, NULL) != 0) {
-        syslog(LOG_ERR, "Failed to create timestamp thread");
-    }
+        aesd_timer_init(&timestamp_timer, timestamp_timer_fn, &timers.wheel);
+        aesd_timer_arm(&timers.wheel, &timestamp_timer, now);
+        if (config.retention.max_age_sec > 0) {
+            aesd_timer_init(&retention_timer, retention_timer_fn, &timers.wheel);
+            aesd_timer_arm(&timers.wheel, &retention_timer, now + retention_check_ms(&config.retention));
+        }
 #endif
+        if (config.sync_policy == AESD_SYNC_INTERVAL) {
+            aesd_timer_init(&flush_timer, flush_timer_fn, &timers.wheel);
+            aesd_timer_arm(&timers.wheel, &flush_timer, now + config.sync_interval_ms);
+        }
+        aesd_timer_service_start(&timers);
+    }
 
-    if (listen(server_socket_fd, BACKLOG) == -1) {
+    if (listen(server_socket_fd, config.backlog) == -1) {
         syslog(LOG_ERR, "Listen failed: %s", strerror(errno));
         close(server_socket_fd);
         return -1;
     }
+    for (unsigned int i = 1; i < nshards; i++) {
+        if (listen(shard_fds[i], config.backlog) == -1) {
+            syslog(LOG_ERR, "Listen failed: %s", strerror(errno));
+            return -1;
+        }
+    }
+
+    // Started after the fork, threads do not survive it
+    if (aesd_log_start() != 0) {
+        syslog(LOG_WARNING, "Logging synchronously");
+    }
+
+    // Not worth failing over, the server works the same without it
+    if (strcmp(config.metrics_port, "0") != 0) {
+        if (aesd_metrics_server_start(&metrics, config.metrics_port) == 0) {
+            metrics_running = true;
+        } else {
+            syslog(LOG_WARNING, "Metrics unavailable on port %s", config.metrics_port);
+        }
+    }
+
+    // --- START EVENT LOOPS ---
+    if (config.mode == MODE_URING) {
+        raise_fd_limit();
+        // Without shards every ring accepts from the one listener
+        int *listen_fds = shard_fds != NULL ? shard_fds : malloc(config.workers * sizeof(int));
+        for (unsigned int i = 0; shard_fds == NULL && listen_fds != NULL && i < config.workers; i++) {
+            listen_fds[i] = server_socket_fd;
+        }
+        if (listen_fds != NULL && aesd_uring_start(&uring, config.workers, listen_fds, config.pin_cpus) == 0) {
+            syslog(LOG_INFO, "Serving with io_uring on %u threads%s", config.workers,
+                   shard_fds != NULL ? ", one listener each" : "");
+        } else {
+            syslog(LOG_WARNING, "io_uring unavailable, falling back to the epoll reactor");
+            config.mode = MODE_EPOLL;
+        }
+        if (listen_fds != shard_fds) {
+            free(listen_fds);
+        }
+    }
+    if (config.mode == MODE_EPOLL) {
+        raise_fd_limit();
+        if (aesd_reactor_start(&reactor, config.workers, shard_fds, config.pin_cpus) != 0) {
+            syslog(LOG_ERR, "Failed to start epoll reactor");
+            close(server_socket_fd);
+            return -1;
+        }
+        syslog(LOG_INFO, "Serving with epoll reactor on %u threads%s", config.workers,
+               shard_fds != NULL ? ", one listener each" : "");
+    } else if (config.mode == MODE_POOL) {
+        if (aesd_pool_start(&pool, config.workers, POOL_QUEUE_DEPTH) != 0) {
+            syslog(LOG_ERR, "Failed to start worker pool");
+            close(server_socket_fd);
+            return -1;
+        }
+        syslog(LOG_INFO, "Serving with %u pooled workers", config.workers);
+    }
     
+    // The rings and sharded loops accept on their own, only wait for SIGINT/SIGTERM
+    if (config.mode == MODE_URING || shard_fds != NULL) {
+        while (!signal_caught) {
+            sigsuspend(&old_mask);
+        }
+    } else {
+        // Waited for in ppoll(), accept() itself must not block with the stop signals masked
+        fcntl(server_socket_fd, F_SETFL, fcntl(server_socket_fd, F_GETFL) | O_NONBLOCK);
+    }
+
     // Main Accept Loop
     while (!signal_caught) {
+        struct pollfd listener = { .fd = server_socket_fd, .events = POLLIN };
+        if (ppoll(&listener, 1, NULL, &old_mask) == -1) {
+            if (errno != EINTR) {
+                aesd_log(LOG_ERR, "ppoll failed: %s", strerror(errno));
+            }
+            continue;
+        }
+
         client_addr_size = sizeof client_addr;
-        int client_fd = accept(server_socket_fd, (struct sockaddr *)&client_addr, &client_addr_size);
+        // Reactor and pool sockets must never block the thread serving them
+        bool nonblock = config.mode == MODE_EPOLL || config.mode == MODE_POOL;
+        int client_fd = accept4(server_socket_fd, (struct sockaddr *)&client_addr, &client_addr_size,
+                                nonblock ? SOCK_NONBLOCK : 0);
         
         if (client_fd == -1) {
-            if (errno == EINTR) continue;
-            syslog(LOG_ERR, "Accept failed: %s", strerror(errno));
+            if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) continue;
+            aesd_log(LOG_ERR, "Accept failed: %s", strerror(errno));
             continue; 
         }
 
-        struct thread_data_t *new_thread_params = malloc(sizeof(struct thread_data_t));
-        if (new_thread_params == NULL) {
-            syslog(LOG_ERR, "Malloc for thread params failed");
+        struct aesd_conn *conn = aesd_conn_new(client_fd, &client_addr);
+        if (conn == NULL) {
             close(client_fd);
             continue;
         }
 
-        void *addr;
-        if (((struct sockaddr *)&client_addr)->sa_family == AF_INET) {
-            addr = &(((struct sockaddr_in *)&client_addr)->sin_addr);
-        } else {
-            addr = &(((struct sockaddr_in6 *)&client_addr)->sin6_addr);
+        if (!nonblock) {
+            // Blocked threads still have to see signal_caught and the deadlines of clients
+            // that stopped sending or reading
+            struct timeval timeout = { CLIENT_RECV_TIMEOUT_SEC, 0 };
+            setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
         }
-        inet_ntop(client_addr.ss_family, addr, new_thread_params->client_ip, sizeof(new_thread_params->client_ip));
-        
-        syslog(LOG_INFO, "Accepted connection from %s", new_thread_params->client_ip);
-
-        new_thread_params->client_fd = client_fd;
-        new_thread_params->mutex = &file_mutex;
-        new_thread_params->thread_complete = false;
-
-        struct slist_data_s *new_node = malloc(sizeof(struct slist_data_s));
-        if (new_node == NULL) {
-             syslog(LOG_ERR, "Malloc for list node failed");
-             free(new_thread_params);
-             close(client_fd);
-             continue;
+
+        if (config.mode == MODE_EPOLL) {
+            if (aesd_reactor_add(&reactor, conn) != 0) {
+                aesd_conn_free(conn);
+            }
+            continue;
         }
-        
-        new_node->thread_params = new_thread_params;
 
-        if (pthread_create(&new_node->thread_id, NULL, thread_func, (void *)new_thread_params) != 0) {
-            syslog(LOG_ERR, "Thread creation failed");
-            free(new_thread_params);
-            free(new_node);
-            close(client_fd);
+        if (config.mode == MODE_POOL) {
+            // Blocks while every worker is busy and the queue is full
+            if (aesd_pool_submit(&pool, conn) != 0) {
+                aesd_conn_free(conn);
+            }
             continue;
         }
 
-        SLIST_INSERT_HEAD(&head, new_node, entries);
+        // Reaped first, so the slots of finished threads are reused right away
+        reap_connection_threads();
 
-        // Cleanup completed threads
-        struct slist_data_s *cursor = SLIST_FIRST(&head);
-        struct slist_data_s *next_node = NULL;
+        struct aesd_conn_slot *slot = aesd_conntable_alloc(&conn_table, conn);
+        if (slot == NULL) {
+            aesd_conn_free(conn);
+            continue;
+        }
 
-        while (cursor != NULL) {
-            next_node = SLIST_NEXT(cursor, entries);
-            
-            if (cursor->thread_params->thread_complete) {
-                pthread_join(cursor->thread_id, NULL);
-                SLIST_REMOVE(&head, cursor, slist_data_s, entries);
-                free(cursor->thread_params);
-                free(cursor);
-            }
-            
-            cursor = next_node;
+        if (pthread_create(&slot->thread_id, NULL, thread_func, slot) != 0) {
+            aesd_log(LOG_ERR, "Thread creation failed");
+            aesd_conntable_free(&conn_table, slot);
+            aesd_conn_free(conn);
+            continue;
         }
     }
 
     // --- SHUTDOWN & CLEANUP ---
-    if (server_socket_fd != -1) {
+    // Sharded listeners are still polled by their loops, they are closed once those stopped
+    if (server_socket_fd != -1 && shard_fds == NULL) {
         close(server_socket_fd);
     }
     
-    // Join timestamp thread
-    // Modified: Only join if the thread was created
-#if !USE_AESD_CHAR_DEVICE
-    pthread_join(timestamp_thread_id, NULL);
-#endif
+    // Woken right away, not at its next timer
+    aesd_timer_service_stop(&timers);
+
+    // Stop the event loops, closing every connection they still hold
+    if (config.mode == MODE_EPOLL) {
+        aesd_reactor_stop(&reactor);
+    }
+    if (config.mode == MODE_URING) {
+        aesd_uring_stop(&uring);
+    }
+    for (unsigned int i = 0; i < nshards; i++) {
+        close(shard_fds[i]);
+    }
+    free(shard_fds);
+
+    // Let the workers drain the queue, then join them
+    if (config.mode == MODE_POOL) {
+        aesd_pool_stop(&pool);
+    }
+
+    // Join connection threads, finished or not
+    for (size_t i = 0; i < conn_table.nslabs * AESD_CONNTABLE_SLAB_SLOTS; i++) {
+        struct aesd_conn_slot *slot = aesd_conntable_slot(&conn_table, i);
+        if (slot->used) {
+            pthread_join(slot->thread_id, NULL);
+        }
+    }
+    aesd_conntable_destroy(&conn_table);
 
-    // Join connection threads
-    while (!SLIST_EMPTY(&head)) {
-        struct slist_data_s *cursor = SLIST_FIRST(&head);
-        pthread_join(cursor->thread_id, NULL);
-        SLIST_REMOVE_HEAD(&head, entries);
-        free(cursor->thread_params);
-        free(cursor);
+    if (metrics_running) {
+        aesd_metrics_server_stop(&metrics);
     }
 
+    aesd_datalog_destroy(&data_log);
     pthread_mutex_destroy(&file_mutex);
     
     // Modified: Only remove the file if we are using the file system (NOT the device)
@@ -380,6 +633,8 @@ int main(int argc, char *argv[]) {
     unlink(DATA_FILE);
 #endif
 
+    // Every thread that could still queue a message is gone by now
+    aesd_log_stop();
     closelog();
     
     return 0;
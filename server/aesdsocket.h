@@ -0,0 +1,75 @@
+/*
+ * aesdsocket.h
+ *
+ *  Build configuration and globals shared by the aesdsocket modules.
+ */
+
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+
+#include <stdbool.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "aesd-datalog.h"
+
+// --- Build Switch Configuration ---
+#ifndef USE_AESD_CHAR_DEVICE
+#define USE_AESD_CHAR_DEVICE 1
+#endif
+
+// Built-in defaults from here on, most of them can be changed at run time (see aesd-config.h)
+#define PORT "9000"
+
+// Loopback port the runtime metrics are served on, see aesd-metrics.h
+#define METRICS_PORT "9001"
+
+#if USE_AESD_CHAR_DEVICE
+    #define DATA_FILE "/dev/aesdchar"
+#else
+    #define DATA_FILE "/var/tmp/aesdsocketdata"
+#endif
+
+// Listen backlog of the thread and pool modes, the event loops default to SOMAXCONN
+#define BACKLOG 10
+// Room every recv() is given at least
+#define BUFFER_SIZE 1024
+
+// Most recent history kept in memory, older bytes are streamed from DATA_FILE with sendfile()
+#define REPLAY_CACHE_BYTES (1024 * 1024)
+
+// Pipe size requested for splicing the char device contents
+#define REPLAY_PIPE_SIZE (1024 * 1024)
+
+// Blocking client sockets give up waiting this often to notice a shutdown request or a missed deadline
+#define CLIENT_RECV_TIMEOUT_SEC 1
+
+// Connections are closed once they miss one of these deadlines: no packet
+// started for CLIENT_IDLE_TIMEOUT_SEC, a started packet not completed within
+// CLIENT_READ_DEADLINE_SEC, or a reply not making progress for CLIENT_WRITE_DEADLINE_SEC
+#define CLIENT_IDLE_TIMEOUT_SEC 300
+#define CLIENT_READ_DEADLINE_SEC 30
+#define CLIENT_WRITE_DEADLINE_SEC 30
+
+// Longest packet accepted by default, a client sending a longer one is disconnected. See -o max_packet_bytes
+#define CLIENT_MAX_PACKET_BYTES (1024 * 1024)
+
+// Connections open at once before new ones are refused, see -C
+#define CLIENT_MAX_CONNECTIONS 65536
+
+// A timestamp record is appended to the history this often (regular file backend)
+#define TIMESTAMP_INTERVAL_SEC 10
+
+// Accepted connections waiting for a pool worker before accept() stalls
+#define POOL_QUEUE_DEPTH 256
+
+// Set by the signal handler once SIGINT/SIGTERM is received
+extern volatile sig_atomic_t signal_caught;
+
+// Guards the commit queue of data_log, appends to DATA_FILE are group committed
+extern pthread_mutex_t file_mutex;
+
+// History replayed to clients
+extern struct aesd_datalog data_log;
+
+#endif /* AESDSOCKET_H */
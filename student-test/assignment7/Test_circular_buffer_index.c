@@ -0,0 +1,198 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+/**
+* Tests for the byte offset index of the circular buffer. Every position of the
+* concatenated contents is looked up and compared with a linear walk over the
+* entries, the way aesd_circular_buffer_find_entry_offset_for_fpos() used to work.
+*/
+
+static const char *commands[] = {
+    "write1\n", "write22\n", "write333\n", "write4444\n", "write55555\n",
+    "write666666\n", "write7777777\n", "write88888888\n", "write999999999\n", "write10\n",
+    "", "w12\n", "write1313131313131313\n", "\n",
+};
+#define COMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+static void add_command(struct aesd_circular_buffer *buffer, const char *command)
+{
+    struct aesd_buffer_entry entry;
+    entry.buffptr = command;
+    entry.size = strlen(command);
+    aesd_circular_buffer_add_entry(buffer, &entry);
+}
+
+/**
+* Finds @param char_offset by summing up entry sizes from the oldest entry on
+*/
+static struct aesd_buffer_entry *walk_entries(struct aesd_circular_buffer *buffer, size_t char_offset,
+            size_t *entry_offset_byte_rtn)
+{
+    uint32_t index = buffer->out_offs;
+    for (uint32_t i = 0; i < aesd_circular_buffer_entries(buffer); i++) {
+        if (char_offset < buffer->entry[index].size) {
+            *entry_offset_byte_rtn = char_offset;
+            return &buffer->entry[index];
+        }
+        char_offset -= buffer->entry[index].size;
+        index = (index + 1) & buffer->mask;
+    }
+    return NULL;
+}
+
+/**
+* Checks every position of @param buffer and the one past its end against walk_entries()
+*/
+static void verify_index(struct aesd_circular_buffer *buffer)
+{
+    size_t total = 0;
+    uint32_t index = buffer->out_offs;
+    for (uint32_t i = 0; i < aesd_circular_buffer_entries(buffer); i++) {
+        total += buffer->entry[index].size;
+        index = (index + 1) & buffer->mask;
+    }
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(total, buffer->total_size, "total_size is not the sum of the entry sizes");
+
+    for (size_t offset = 0; offset <= total; offset++) {
+        size_t expected_byte = 0;
+        size_t actual_byte = 0;
+        struct aesd_buffer_entry *expected = walk_entries(buffer, offset, &expected_byte);
+        struct aesd_buffer_entry *actual = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, offset, &actual_byte);
+
+        TEST_ASSERT_EQUAL_PTR_MESSAGE(expected, actual, "Wrong entry found for an offset");
+        if (expected != NULL) {
+            TEST_ASSERT_EQUAL_UINT32_MESSAGE(expected_byte, actual_byte, "Wrong byte found within an entry");
+        }
+    }
+}
+
+void test_circular_buffer_index_empty()
+{
+    struct aesd_circular_buffer buffer;
+    size_t offset_rtn = 0;
+    aesd_circular_buffer_init(&buffer);
+
+    TEST_ASSERT_EQUAL_UINT32(0, aesd_circular_buffer_entries(&buffer));
+    TEST_ASSERT_EQUAL_UINT32(0, buffer.total_size);
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 0, &offset_rtn),
+            "An empty buffer has no position 0");
+}
+
+void test_circular_buffer_index_filling()
+{
+    struct aesd_circular_buffer buffer;
+    aesd_circular_buffer_init(&buffer);
+
+    for (uint32_t i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
+        add_command(&buffer, commands[i]);
+        TEST_ASSERT_EQUAL_UINT32(i + 1, aesd_circular_buffer_entries(&buffer));
+        verify_index(&buffer);
+    }
+    TEST_ASSERT_TRUE(buffer.full);
+}
+
+void test_circular_buffer_index_wrapping()
+{
+    struct aesd_circular_buffer buffer;
+    aesd_circular_buffer_init(&buffer);
+
+    // Several laps around the buffer, with empty entries among the evicted and the kept ones
+    for (size_t i = 0; i < 5 * COMMANDS; i++) {
+        add_command(&buffer, commands[(i * 7) % COMMANDS]);
+        verify_index(&buffer);
+    }
+}
+
+void test_circular_buffer_index_empty_entries()
+{
+    struct aesd_circular_buffer buffer;
+    size_t offset_rtn = 0;
+    struct aesd_buffer_entry *entry;
+    aesd_circular_buffer_init(&buffer);
+
+    add_command(&buffer, "");
+    add_command(&buffer, "");
+    add_command(&buffer, "ab\n");
+    add_command(&buffer, "");
+    add_command(&buffer, "c\n");
+
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 0, &offset_rtn);
+    TEST_ASSERT_NOT_NULL(entry);
+    TEST_ASSERT_EQUAL_STRING("ab\n", entry->buffptr);
+    TEST_ASSERT_EQUAL_UINT32(0, offset_rtn);
+
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 3, &offset_rtn);
+    TEST_ASSERT_NOT_NULL(entry);
+    TEST_ASSERT_EQUAL_STRING("c\n", entry->buffptr);
+    TEST_ASSERT_EQUAL_UINT32(0, offset_rtn);
+
+    TEST_ASSERT_NULL(aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 5, &offset_rtn));
+    verify_index(&buffer);
+}
+
+void test_circular_buffer_index_counter_wrap()
+{
+    struct aesd_circular_buffer buffer;
+    aesd_circular_buffer_init(&buffer);
+
+    // The running byte count overflows part way through the entries
+    buffer.added_bytes = SIZE_MAX - 20;
+    for (size_t i = 0; i < 2 * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
+        add_command(&buffer, commands[i % COMMANDS]);
+        verify_index(&buffer);
+    }
+}
+
+void test_circular_buffer_index_depth()
+{
+    // Every slot in use, and a depth leaving most slots of its power of two unused
+    static const uint32_t depths[] = { 16, 17, 1000 };
+    static struct aesd_buffer_entry entry[1024];
+    static size_t entry_start[1024];
+
+    for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+        struct aesd_circular_buffer buffer;
+        memset(entry, 0, sizeof(entry));
+        memset(entry_start, 0, sizeof(entry_start));
+        TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_storage(&buffer, entry, entry_start, depths[d]));
+
+        for (size_t i = 0; i < 3 * depths[d]; i++) {
+            add_command(&buffer, commands[(i * 5) % COMMANDS]);
+            TEST_ASSERT_EQUAL_UINT32(i < depths[d] ? i + 1 : depths[d], aesd_circular_buffer_entries(&buffer));
+        }
+        TEST_ASSERT_TRUE(buffer.full);
+        verify_index(&buffer);
+    }
+}
+
+void test_circular_buffer_index_byte_budget()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry removed;
+    aesd_circular_buffer_init(&buffer);
+    buffer.max_bytes = 20;
+
+    add_command(&buffer, "write1\n");
+    add_command(&buffer, "write22\n");
+    TEST_ASSERT_FALSE(aesd_circular_buffer_must_evict(&buffer, 5));
+    TEST_ASSERT_TRUE(aesd_circular_buffer_must_evict(&buffer, 6));
+
+    // Makes room by dropping the oldest entry only
+    add_command(&buffer, "write333\n");
+    TEST_ASSERT_EQUAL_UINT32(2, aesd_circular_buffer_entries(&buffer));
+    TEST_ASSERT_EQUAL_UINT32(17, buffer.total_size);
+    verify_index(&buffer);
+
+    // An entry larger than the budget is still kept, on its own
+    add_command(&buffer, "write1313131313131313\n");
+    TEST_ASSERT_EQUAL_UINT32(1, aesd_circular_buffer_entries(&buffer));
+    verify_index(&buffer);
+
+    TEST_ASSERT_TRUE(aesd_circular_buffer_remove_oldest(&buffer, &removed));
+    TEST_ASSERT_EQUAL_STRING("write1313131313131313\n", removed.buffptr);
+    TEST_ASSERT_FALSE(aesd_circular_buffer_remove_oldest(&buffer, &removed));
+    TEST_ASSERT_EQUAL_UINT32(0, buffer.total_size);
+}
@@ -0,0 +1,52 @@
+#!/bin/bash
+# Checks how the aesdchar driver splits writes into commands.
+# Run against a loaded driver, e.g. after aesd-char-driver/aesdchar_load:
+#   ./aesdchar-write-test.sh [device]
+# Every case writes with one write() per piece and checks what the device ends with,
+# the driver keeps at least the last 10 commands, more than any case adds.
+
+device=${1:-/dev/aesdchar}
+rc=0
+
+# Writes each argument to the device with a single write() call
+write_pieces() {
+    for piece in "$@"; do
+        printf '%b' "${piece}" | dd of="${device}" bs=1M oflag=append conv=notrunc status=none || return 1
+    done
+}
+
+# Writes the pieces, then checks that the device contents end with the expected commands
+check() {
+    local name=$1
+    local expected=$2
+    shift 2
+
+    if ! write_pieces "$@"; then
+        echo "FAIL ${name}: write failed"
+        rc=1
+        return
+    fi
+    local expected_len=$(printf '%b' "${expected}" | wc -c)
+    local actual=$(tail -c "${expected_len}" "${device}" | od -An -c)
+    local wanted=$(printf '%b' "${expected}" | od -An -c)
+    if [ "${actual}" != "${wanted}" ]; then
+        echo "FAIL ${name}: device ends with${actual} instead of${wanted}"
+        rc=1
+    else
+        echo "ok ${name}"
+    fi
+}
+
+if [ ! -w "${device}" ]; then
+    echo "${device} is not writable, load the driver first"
+    exit 1
+fi
+
+check "whole command" 'whole\n' 'whole\n'
+check "pieces" 'piece1piece2\n' 'piece' '1piece' '2\n'
+check "several commands in one write" 'one\ntwo\nthree\n' 'one\ntwo\nthree\n'
+check "newline in the middle of a write" 'mid1\nmid2\nmid3\n' 'mid1\nmi' 'd2\nmid3\n'
+check "partial command completed mid write" 'abcd\nxyz\n' 'abc' 'd\nxyz' '\n'
+check "partial command completed by a whole line" 'efgh\n' 'ef' 'gh\n'
+
+exit ${rc}